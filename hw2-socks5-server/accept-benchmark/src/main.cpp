@@ -0,0 +1,200 @@
+// Measures how many connections per second the SOCKS5 server accepts.
+//
+// Every worker thread repeatedly connects, sends a SOCKS5 greeting, waits for the
+// method selection reply and resets the connection, so a connection is counted only
+// after the server has accepted it and its Session has served one request. Compare
+// a server started with and without --single_shot_accept to see the accept path cost.
+
+#include <tclap/CmdLine.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace
+{
+
+using clock_type = std::chrono::steady_clock;
+
+struct WorkerResult
+{
+    std::uint64_t connections = 0;
+    std::uint64_t failures = 0;
+    std::vector<std::uint32_t> latencies_us;  // connect to greeting reply
+};
+
+bool handshake_once(const sockaddr_in& address)
+{
+    int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1)
+    {
+        return false;
+    }
+
+    // reset instead of FIN, otherwise TIME_WAIT sockets exhaust ephemeral ports within seconds
+    linger reset_on_close = { .l_onoff = 1, .l_linger = 0 };
+    ::setsockopt(fd, SOL_SOCKET, SO_LINGER, &reset_on_close, sizeof(reset_on_close));
+    int one = 1;
+    ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    bool ok = false;
+    if (::connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == 0)
+    {
+        const unsigned char greeting[] = { 0x05, 0x01, 0x00 };  // version 5, one method: no auth
+        unsigned char reply[2];
+        ok = ::send(fd, greeting, sizeof(greeting), MSG_NOSIGNAL) == sizeof(greeting)
+            && ::recv(fd, reply, sizeof(reply), MSG_WAITALL) == sizeof(reply)
+            && reply[0] == 0x05 && reply[1] == 0x00;
+    }
+    ::close(fd);
+    return ok;
+}
+
+void run_worker(const sockaddr_in& address, const std::atomic<bool>& stop, WorkerResult& result)
+{
+    while (!stop.load(std::memory_order_relaxed))
+    {
+        clock_type::time_point start = clock_type::now();
+        if (handshake_once(address))
+        {
+            ++result.connections;
+            auto latency = std::chrono::duration_cast<std::chrono::microseconds>(clock_type::now() - start);
+            result.latencies_us.push_back(static_cast<std::uint32_t>(latency.count()));
+        }
+        else
+        {
+            ++result.failures;
+        }
+    }
+}
+
+std::uint32_t percentile(const std::vector<std::uint32_t>& sorted, double p)
+{
+    if (sorted.empty())
+    {
+        return 0;
+    }
+    auto index = static_cast<std::size_t>(p * static_cast<double>(sorted.size() - 1));
+    return sorted[index];
+}
+
+}  // namespace
+
+int main(int argc, char* argv[])
+{
+    std::string host;
+    in_port_t port;
+    unsigned threads_count;
+    unsigned duration_seconds;
+    try
+    {
+        TCLAP::CmdLine cmd("Connections per second benchmark for the SOCKS5 server", ' ', "0.1");
+
+        TCLAP::ValueArg<std::string> host_arg(
+            /* short flag */    "a",
+            /* long flag */     "address",
+            /* description */   "IPv4 address of the server",
+            /* required */      false,
+            /* default */       "127.0.0.1",
+            /* type info */     "string"
+        );
+        cmd.add(host_arg);
+
+        TCLAP::ValueArg<in_port_t> port_arg(
+            /* short flag */    "p",
+            /* long flag */     "port",
+            /* description */   "Port of the server",
+            /* required */      true,
+            /* default */       0,
+            /* type info */     "int"
+        );
+        cmd.add(port_arg);
+
+        TCLAP::ValueArg<unsigned> threads_count_arg(
+            /* short flag */    "t",
+            /* long flag */     "threads",
+            /* description */   "Count of connecting threads",
+            /* required */      false,
+            /* default */       std::thread::hardware_concurrency(),
+            /* type info */     "int"
+        );
+        cmd.add(threads_count_arg);
+
+        TCLAP::ValueArg<unsigned> duration_arg(
+            /* short flag */    "d",
+            /* long flag */     "duration",
+            /* description */   "Benchmark duration in seconds",
+            /* required */      false,
+            /* default */       10,
+            /* type info */     "int"
+        );
+        cmd.add(duration_arg);
+
+        cmd.parse(argc, argv);
+        host = host_arg.getValue();
+        port = port_arg.getValue();
+        threads_count = std::max(threads_count_arg.getValue(), 1u);
+        duration_seconds = duration_arg.getValue();
+    }
+    catch (TCLAP::ArgException& e)
+    {
+        std::fprintf(stderr, "Parsing command line arguments failed: '%s' for arg %s\n",
+                     e.error().c_str(), e.argId().c_str());
+        return EXIT_FAILURE;
+    }
+
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = ::htons(port);
+    if (::inet_pton(AF_INET, host.c_str(), &address.sin_addr) != 1)
+    {
+        std::fprintf(stderr, "Invalid IPv4 address '%s'\n", host.c_str());
+        return EXIT_FAILURE;
+    }
+
+    std::atomic<bool> stop = false;
+    std::vector<WorkerResult> results(threads_count);
+    std::vector<std::thread> threads;
+    threads.reserve(threads_count);
+    clock_type::time_point start = clock_type::now();
+    for (WorkerResult& result : results)
+    {
+        threads.emplace_back(run_worker, std::cref(address), std::cref(stop), std::ref(result));
+    }
+    std::this_thread::sleep_for(std::chrono::seconds(duration_seconds));
+    stop = true;
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+    std::chrono::duration<double> elapsed = clock_type::now() - start;
+
+    WorkerResult total;
+    for (WorkerResult& result : results)
+    {
+        total.connections += result.connections;
+        total.failures += result.failures;
+        total.latencies_us.insert(total.latencies_us.end(), result.latencies_us.begin(), result.latencies_us.end());
+    }
+    std::sort(total.latencies_us.begin(), total.latencies_us.end());
+
+    std::printf("threads:         %u\n", threads_count);
+    std::printf("connections:     %llu\n", static_cast<unsigned long long>(total.connections));
+    std::printf("failures:        %llu\n", static_cast<unsigned long long>(total.failures));
+    std::printf("connections/s:   %.0f\n", static_cast<double>(total.connections) / elapsed.count());
+    std::printf("latency p50/p99: %u/%u us\n",
+                percentile(total.latencies_us, 0.50), percentile(total.latencies_us, 0.99));
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,213 @@
+#ifndef HW2_SOCKS5_SERVER_ASYNC_LOGGER_HPP_
+#define HW2_SOCKS5_SERVER_ASYNC_LOGGER_HPP_
+
+#include <utils.hpp>
+
+#include <spdlog/spdlog.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// Levels below HW2_LOG_ACTIVE_LEVEL are compiled out, arguments of such calls are not even evaluated
+#ifndef HW2_LOG_ACTIVE_LEVEL
+#ifdef NDEBUG
+#define HW2_LOG_ACTIVE_LEVEL SPDLOG_LEVEL_INFO
+#else
+#define HW2_LOG_ACTIVE_LEVEL SPDLOG_LEVEL_DEBUG
+#endif
+#endif
+
+// Logging from the event loops. The format must be a string literal, it is referenced by the
+// record and only formatted on the logging thread.
+#define HW2_LOG(severity, ...)                                                                     \
+    do                                                                                             \
+    {                                                                                              \
+        if constexpr ((severity) >= HW2_LOG_ACTIVE_LEVEL)                                          \
+            ::hw2::async_logger().log(static_cast<spdlog::level::level_enum>(severity), __VA_ARGS__); \
+    } while (false)
+
+#define LOG_DEBUG(...)    HW2_LOG(SPDLOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOG_INFO(...)     HW2_LOG(SPDLOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_ERROR(...)    HW2_LOG(SPDLOG_LEVEL_ERROR, __VA_ARGS__)
+
+namespace hw2
+{
+
+// Logger whose producers only copy a fixed-size binary record into a ring of their own thread:
+// the format string pointer, a timestamp and the arguments, with strings copied inline. A
+// background thread formats the records and hands them to the sinks of the target spdlog
+// logger, keeping the time and thread id of the producer. A producer never blocks or
+// allocates after its first call; when its ring is full the record is dropped and counted.
+class AsyncLogger
+{
+public:
+    static constexpr unsigned MAX_ARGS = 4;
+    static constexpr std::size_t TEXT_CAPACITY = 160;
+    static constexpr unsigned RING_CAPACITY = 2048;  // records per thread, power of 2
+    static constexpr std::chrono::milliseconds POLL_INTERVAL{1};
+
+    explicit AsyncLogger(std::shared_ptr<spdlog::logger> target);
+    ~AsyncLogger();
+
+    AsyncLogger(const AsyncLogger&) = delete;
+    AsyncLogger& operator=(const AsyncLogger&) = delete;
+
+    template <typename... Args>
+    void log(spdlog::level::level_enum level, fmt::format_string<Args...> format, Args&&... args);
+
+    // formats all records queued so far, e.g. before the process exits
+    void flush();
+
+    [[nodiscard]] std::uint64_t dropped_count() const;
+
+private:
+    enum class ArgType : std::uint8_t
+    {
+        BOOL,
+        SIGNED,
+        UNSIGNED,
+        DOUBLE,
+        TEXT,
+    };
+
+    struct Arg
+    {
+        ArgType type;
+        std::uint8_t text_size;
+        std::uint16_t text_offset;
+        union
+        {
+            bool b;
+            std::int64_t i;
+            std::uint64_t u;
+            double d;
+        };
+    };
+
+    struct alignas(64) Record
+    {
+        std::int64_t timestamp_ns;  // since the epoch of spdlog::log_clock
+        const char* format;
+        std::uint16_t format_size;
+        std::uint8_t level;
+        std::uint8_t args_count;
+        std::uint32_t thread_id;
+        std::uint16_t text_size;
+        std::array<Arg, MAX_ARGS> args;
+        std::array<char, TEXT_CAPACITY> text;
+    };
+    static_assert(sizeof(Record) == 256);
+
+    // single producer, single consumer
+    struct Ring
+    {
+        alignas(64) std::atomic<std::uint64_t> head = 0;  // written by the producer
+        std::uint64_t cached_tail = 0;                   // producer's last view of tail
+        std::atomic<std::uint64_t> dropped = 0;           // written by the producer
+        alignas(64) std::atomic<std::uint64_t> tail = 0;  // written by the consumer
+        std::uint64_t reported_dropped = 0;
+        std::array<Record, RING_CAPACITY> records;
+    };
+
+    // reserves the next record of the calling thread, nullptr if its ring is full
+    [[nodiscard]] Record* begin_record();
+    void commit_record();
+    [[nodiscard]] Ring& thread_ring();
+
+    template <typename T>
+    static void store_arg(Record& record, Arg& arg, const T& value);
+    static void store_text(Record& record, Arg& arg, std::string_view text);
+
+    void run();
+    // formats queued records of all threads, returns false if there were none
+    bool drain();
+    void emit(const Record& record);
+
+    // identifies the logger in t_ring_owner, an address could be reused by another instance
+    const std::uint64_t m_id;
+    std::shared_ptr<spdlog::logger> m_target;
+    mutable std::mutex m_rings_mutex;
+    std::vector<std::unique_ptr<Ring>> m_rings;
+    // the background thread and flush() both consume
+    std::mutex m_consumer_mutex;
+    std::atomic<bool> m_stop = false;
+    std::thread m_thread;
+
+    // ring of the calling thread, valid if it belongs to the logger with id t_ring_owner
+    static thread_local std::uint64_t t_ring_owner;
+    static thread_local Ring* t_ring;
+};
+
+// logger of the event loops, targets logger(); it is never destroyed and flushed at exit
+[[nodiscard]] AsyncLogger& async_logger();
+
+template <typename... Args>
+void AsyncLogger::log(spdlog::level::level_enum level, fmt::format_string<Args...> format, Args&&... args)
+{
+    static_assert(sizeof...(Args) <= MAX_ARGS, "too many arguments for a log record");
+    Record* record = this->begin_record();
+    if (UNLIKELY(record == nullptr))
+    {
+        return;
+    }
+    fmt::string_view format_view = format;
+    record->timestamp_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        spdlog::log_clock::now().time_since_epoch()).count();
+    record->format = format_view.data();
+    record->format_size = static_cast<std::uint16_t>(format_view.size());
+    record->level = static_cast<std::uint8_t>(level);
+    record->args_count = static_cast<std::uint8_t>(sizeof...(Args));
+    record->thread_id = static_cast<std::uint32_t>(spdlog::details::os::thread_id());
+    record->text_size = 0;
+    unsigned index = 0;
+    (store_arg(*record, record->args[index++], args), ...);
+    this->commit_record();
+}
+
+template <typename T>
+void AsyncLogger::store_arg(Record& record, Arg& arg, const T& value)
+{
+    using type = std::decay_t<T>;
+    if constexpr (std::is_same_v<type, bool>)
+    {
+        arg.type = ArgType::BOOL;
+        arg.b = value;
+    }
+    else if constexpr (std::is_integral_v<type> && std::is_signed_v<type>)
+    {
+        arg.type = ArgType::SIGNED;
+        arg.i = value;
+    }
+    else if constexpr (std::is_integral_v<type>)
+    {
+        arg.type = ArgType::UNSIGNED;
+        arg.u = value;
+    }
+    else if constexpr (std::is_floating_point_v<type>)
+    {
+        arg.type = ArgType::DOUBLE;
+        arg.d = value;
+    }
+    else if constexpr (std::is_convertible_v<const T&, std::string_view>)
+    {
+        store_text(record, arg, std::string_view(value));
+    }
+    else
+    {
+        static_assert(!sizeof(T), "unsupported log argument type");
+    }
+}
+
+}  // namespace hw2
+
+#endif  // HW2_SOCKS5_SERVER_ASYNC_LOGGER_HPP_
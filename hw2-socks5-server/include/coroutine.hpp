@@ -0,0 +1,74 @@
+#ifndef HW2_SOCKS5_SERVER_COROUTINE_HPP_
+#define HW2_SOCKS5_SERVER_COROUTINE_HPP_
+
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <utility>
+
+namespace hw2
+{
+
+// Per-thread free list of coroutine frames. Every thread runs its own IoUring and never
+// finishes a coroutine started by another thread, so no synchronization is needed. Blocks
+// are kept for reuse once the peak count of concurrent coroutines is reached.
+class FramePool
+{
+public:
+    static constexpr std::size_t BLOCK_SIZE = 1024;
+
+    // frames larger than BLOCK_SIZE go to the global allocator
+    [[nodiscard]] static void* allocate(std::size_t size);
+    static void deallocate(void* frame, std::size_t size) noexcept;
+
+private:
+    struct FreeBlock
+    {
+        FreeBlock* next;
+    };
+
+    static thread_local FreeBlock* t_free_blocks;
+};
+
+// Coroutine returning bool, started by the first resume() and owned by the Task object.
+// It suspends at the end, so its owner checks done() after resume() and reads the result,
+// or the exception which ended it.
+class Task
+{
+public:
+    struct promise_type
+    {
+        static void* operator new(std::size_t size) { return FramePool::allocate(size); }
+        static void operator delete(void* frame, std::size_t size) noexcept { FramePool::deallocate(frame, size); }
+
+        Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_value(bool value) { result = value; }
+        // kept for the owner, so that it fails only its session instead of the event loop
+        void unhandled_exception() { exception = std::current_exception(); }
+
+        bool result = false;
+        std::exception_ptr exception;
+    };
+
+    Task() = default;
+    Task(Task&& other) noexcept : m_handle(std::exchange(other.m_handle, nullptr)) {}
+    Task& operator=(Task&& other) noexcept;
+    ~Task();
+
+    void resume() { m_handle.resume(); }
+    [[nodiscard]] bool done() const { return m_handle.done(); }
+    [[nodiscard]] bool result() const { return m_handle.promise().result; }
+    // of a coroutine which ended by an exception instead of returning, nullptr otherwise
+    [[nodiscard]] std::exception_ptr exception() const { return m_handle.promise().exception; }
+
+private:
+    explicit Task(std::coroutine_handle<promise_type> handle) : m_handle(handle) {}
+
+    std::coroutine_handle<promise_type> m_handle;
+};
+
+}  // namespace hw2
+
+#endif  // HW2_SOCKS5_SERVER_COROUTINE_HPP_
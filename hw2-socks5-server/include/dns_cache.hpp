@@ -0,0 +1,82 @@
+#ifndef HW2_SOCKS5_SERVER_DNS_CACHE_HPP_
+#define HW2_SOCKS5_SERVER_DNS_CACHE_HPP_
+
+#include <utils.hpp>
+
+#include <arpa/inet.h>
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace hw2
+{
+
+struct DnsAnswer
+{
+    enum class Status
+    {
+        SUCCESS,
+        NAME_ERROR,  // NXDOMAIN or no records of requested type
+        FAILURE,     // timeout, SERVFAIL, malformed response etc.
+    };
+
+    static constexpr unsigned MAX_ADDRESSES = 8;
+
+    Status status = Status::FAILURE;
+    std::uint32_t ttl = 0;
+    unsigned ipv4_count = 0;
+    std::array<in_addr, MAX_ADDRESSES> ipv4_addresses;
+    unsigned ipv6_count = 0;
+    std::array<in6_addr, MAX_ADDRESSES> ipv6_addresses;
+};
+
+// Fixed-capacity answer cache with CLOCK eviction. Every IoUring owns its own
+// instance through its Resolver, so no synchronization is needed.
+class DnsCache
+{
+public:
+    using clock_type = std::chrono::steady_clock;
+
+    static constexpr std::chrono::seconds NEGATIVE_TTL{30};
+    static constexpr std::chrono::seconds MAX_TTL{3600};
+
+    DnsCache(std::size_t max_entries);
+
+    // name is expected to be normalized (lowercase, no trailing dot)
+    [[nodiscard]] const DnsAnswer* find(std::string_view name, clock_type::time_point now);
+    // successful answers live for their TTL, NAME_ERROR for NEGATIVE_TTL, failures are not cached
+    void insert(std::string_view name, const DnsAnswer& answer, clock_type::time_point now);
+
+    [[nodiscard]] std::size_t size() const { return m_entries.size(); }
+    [[nodiscard]] std::uint64_t hits() const { return m_hits; }
+    [[nodiscard]] std::uint64_t misses() const { return m_misses; }
+
+    const std::size_t capacity;
+
+private:
+    struct Entry
+    {
+        std::string name;
+        DnsAnswer answer;
+        clock_type::time_point expires_at;
+        bool referenced;
+    };
+
+    [[nodiscard]] std::size_t evict(clock_type::time_point now);
+
+    std::vector<Entry> m_entries;
+    std::unordered_map<std::string, std::size_t, StringHash, std::equal_to<>> m_index;
+    std::size_t m_clock_hand = 0;
+
+    std::uint64_t m_hits = 0;
+    std::uint64_t m_misses = 0;
+};
+
+}  // namespace hw2
+
+#endif  // HW2_SOCKS5_SERVER_DNS_CACHE_HPP_
@@ -0,0 +1,49 @@
+#ifndef HW2_SOCKS5_SERVER_MEMORY_ARENA_HPP_
+#define HW2_SOCKS5_SERVER_MEMORY_ARENA_HPP_
+
+#include <cstddef>
+
+namespace hw2
+{
+
+enum class HugePages
+{
+    NONE,         // 4 KiB pages
+    TRANSPARENT,  // madvise(MADV_HUGEPAGE), honoured if transparent huge pages are not disabled
+    EXPLICIT,     // MAP_HUGETLB from vm.nr_hugepages, TRANSPARENT if the reserved pool is short
+};
+
+// Anonymous mapping whose pages are faulted in by the constructor, so that no page fault hits
+// the event loop later, and which is backed by huge pages to keep TLB misses down. Faulting
+// happens on the constructing thread, so the pages come from its NUMA node.
+class MemoryArena
+{
+public:
+    static constexpr std::size_t HUGE_PAGE_SIZE = std::size_t{ 1 } << 21;
+
+    MemoryArena(std::size_t size, HugePages huge_pages);
+    ~MemoryArena();
+
+    MemoryArena(const MemoryArena&) = delete;
+    MemoryArena& operator=(const MemoryArena&) = delete;
+
+    // size rounded up to whole pages of the kind requested
+    [[nodiscard]] static std::size_t mapped_size(std::size_t size, HugePages huge_pages);
+
+    [[nodiscard]] unsigned char* data() const { return m_data; }
+    [[nodiscard]] std::size_t size() const { return m_size; }
+    // what the kernel granted, which may be less than requested
+    [[nodiscard]] HugePages huge_pages() const { return m_huge_pages; }
+
+private:
+    void map_pages();
+    void prefault();
+
+    unsigned char* m_data = nullptr;
+    std::size_t m_size;
+    HugePages m_huge_pages;
+};
+
+}  // namespace hw2
+
+#endif  // HW2_SOCKS5_SERVER_MEMORY_ARENA_HPP_
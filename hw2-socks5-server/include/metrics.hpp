@@ -0,0 +1,88 @@
+#ifndef HW2_SOCKS5_SERVER_METRICS_HPP_
+#define HW2_SOCKS5_SERVER_METRICS_HPP_
+
+#include <arpa/inet.h>
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <span>
+#include <string>
+
+namespace hw2
+{
+
+// Monotonic counter with a single writer, the event loop thread owning it, and any number of
+// readers. An update is a relaxed load and store instead of a read-modify-write, so it compiles
+// to a plain increment and never locks the bus.
+class Counter
+{
+public:
+    void add(std::uint64_t n = 1)
+    {
+        m_value.store(m_value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    [[nodiscard]] std::uint64_t value() const { return m_value.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<std::uint64_t> m_value = 0;
+};
+
+// Counters of one IoUring. Each thread writes only its own block, which is cache line aligned
+// so that threads never share a line; blocks are summed when the metrics are scraped.
+struct alignas(64) Metrics
+{
+    // SOCKS5 reply codes 0x01-0x08 are failures
+    static constexpr unsigned REPLY_CODES_COUNT = 9;
+
+    Counter accepts;
+    Counter sessions_opened;
+    Counter sessions_closed;
+    // connections closed right after accept because a pool was exhausted
+    Counter sessions_rejected;
+    Counter buffer_pool_exhaustions;
+    Counter upstream_bytes;    // client to destination
+    Counter downstream_bytes;  // destination to client
+    // malformed greetings and greetings without an acceptable method
+    Counter greeting_failures;
+    // failure replies to connection requests, indexed by reply code
+    std::array<Counter, REPLY_CODES_COUNT> request_failures;
+    Counter cqe_errors;
+    // sessions aborted because a phase exceeded its ServerOptions timeout
+    Counter handshake_timeouts;
+    Counter connect_timeouts;
+    Counter idle_timeouts;
+    Counter zero_copy_sends;  // IORING_OP_SEND_ZC writes to clients
+    // wakeups which found completions held back by the kernel as they did not fit the CQ
+    Counter cq_overflows;
+};
+
+// sum of metrics of all threads in the Prometheus text exposition format
+[[nodiscard]] std::string format_prometheus(std::span<const Metrics> metrics);
+
+// Minimal HTTP endpoint for Prometheus scrapes. It answers GET /metrics on its own thread with
+// blocking sockets, so scrapes never touch the event loops beyond reading their counters.
+class MetricsEndpoint
+{
+public:
+    // listens on loopback only, the endpoint is meant for a local agent or an SSH tunnel
+    MetricsEndpoint(in_port_t port, std::span<const Metrics> metrics);
+    ~MetricsEndpoint();
+
+    MetricsEndpoint(const MetricsEndpoint&) = delete;
+    MetricsEndpoint& operator=(const MetricsEndpoint&) = delete;
+
+    // never returns
+    void serve();
+
+private:
+    void handle_connection(int fd);
+
+    int m_fd = -1;
+    std::span<const Metrics> m_metrics;
+};
+
+}  // namespace hw2
+
+#endif  // HW2_SOCKS5_SERVER_METRICS_HPP_
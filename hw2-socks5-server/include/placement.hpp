@@ -0,0 +1,41 @@
+#ifndef HW2_SOCKS5_SERVER_PLACEMENT_HPP_
+#define HW2_SOCKS5_SERVER_PLACEMENT_HPP_
+
+#include <string>
+#include <vector>
+
+namespace hw2
+{
+
+enum class PlacementPolicy
+{
+    NONE,         // threads float, as scheduled by the kernel
+    COMPACT,      // fill the allowed CPUs node by node
+    NUMA_SPREAD,  // round robin over NUMA nodes
+};
+
+struct WorkerPlacement
+{
+    int cpu = -1;            // -1 if not pinned
+    int sq_thread_cpu = -1;  // CPU of the SQPOLL kernel thread, -1 if not pinned
+    int numa_node = -1;
+};
+
+// Assigns CPUs from the affinity mask of the process to event loop threads. With
+// kernel polling SQPOLL threads get the CPUs left after the workers on the NUMA node
+// of their worker, or share the worker's CPU if that node has none left.
+[[nodiscard]] std::vector<WorkerPlacement> plan_placement(PlacementPolicy policy, unsigned threads_count,
+                                                          bool kernel_polling);
+
+// Listener index, i.e. worker thread, for each allowed CPU: the worker pinned to it, or else
+// one of the workers on its NUMA node, -1 if there is none. Workers sharing a CPU are reached
+// only through the first of them.
+[[nodiscard]] std::vector<int> listener_index_by_cpu(const std::vector<WorkerPlacement>& placements);
+
+// Pins the calling thread and makes its allocations, e.g. BufferPool and SessionPool
+// of the IoUring it constructs afterwards, come from its local NUMA node.
+void apply_placement(const WorkerPlacement& placement);
+
+}  // namespace hw2
+
+#endif  // HW2_SOCKS5_SERVER_PLACEMENT_HPP_
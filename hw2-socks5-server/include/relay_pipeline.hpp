@@ -0,0 +1,51 @@
+#ifndef HW2_SOCKS5_SERVER_RELAY_PIPELINE_HPP_
+#define HW2_SOCKS5_SERVER_RELAY_PIPELINE_HPP_
+
+#include <array>
+#include <utility>
+
+namespace hw2
+{
+
+// Ring of equally sized slices relaying one direction in RelayMode::PIPELINED.
+// One read fills the next free slice while filled slices are written out in order;
+// reading stops when all slices are filled until a write frees one.
+class RelayPipeline
+{
+public:
+    static constexpr unsigned MAX_DEPTH = 16;
+
+    RelayPipeline() = default;
+    RelayPipeline(unsigned depth, unsigned slice_size);
+
+    [[nodiscard]] bool can_read() const { return !m_reading && !m_eof && m_filled < m_depth; }
+    // returns offset of the slice to read slice_size() bytes into
+    [[nodiscard]] unsigned start_read();
+    void complete_read(unsigned nread);
+    // the source reached EOF, remaining slices are still written out
+    void set_eof();
+
+    [[nodiscard]] bool can_write() const { return !m_writing && m_filled != 0; }
+    // returns {nbytes, offset} of the data to write
+    [[nodiscard]] std::pair<unsigned, unsigned> start_write();
+    void complete_write(unsigned nwrite);
+
+    [[nodiscard]] bool is_drained() const { return m_eof && m_filled == 0 && !m_writing; }
+    [[nodiscard]] unsigned slice_size() const { return m_slice_size; }
+
+private:
+    unsigned m_depth = 0;
+    unsigned m_slice_size = 0;
+    std::array<unsigned, MAX_DEPTH> m_lengths = {};
+    unsigned m_read_slice = 0;
+    unsigned m_write_slice = 0;
+    unsigned m_write_offset = 0;
+    unsigned m_filled = 0;
+    bool m_reading = false;
+    bool m_writing = false;
+    bool m_eof = false;
+};
+
+}  // namespace hw2
+
+#endif  // HW2_SOCKS5_SERVER_RELAY_PIPELINE_HPP_
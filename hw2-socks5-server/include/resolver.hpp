@@ -0,0 +1,127 @@
+#ifndef HW2_SOCKS5_SERVER_RESOLVER_HPP_
+#define HW2_SOCKS5_SERVER_RESOLVER_HPP_
+
+#include <dns_cache.hpp>
+#include <utils.hpp>
+
+#include <arpa/inet.h>
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <random>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace hw2
+{
+
+using byte_t = unsigned char;
+
+class IoUring;
+class Session;
+
+struct ResolverConfig
+{
+    // reads the first IPv4 nameserver from /etc/resolv.conf and IPv4 entries from /etc/hosts
+    static ResolverConfig from_system();
+
+    // expects "ip" or "ip:port", throws std::invalid_argument on malformed input
+    void set_nameserver(std::string_view address);
+
+    sockaddr_in nameserver;
+    std::unordered_map<std::string, in_addr, StringHash, std::equal_to<>> hosts;
+    std::size_t cache_capacity = 4096;
+};
+
+// Minimal stub resolver which sends A and AAAA queries over UDP to a single recursive
+// nameserver. All socket operations go through the IoUring which owns the resolver,
+// so lookups never block the event loop. Concurrent lookups of the same name
+// share one query.
+class Resolver
+{
+public:
+    static constexpr unsigned MAX_PACKET_SIZE = 512;
+    static constexpr std::chrono::seconds QUERY_TIMEOUT{2};
+    static constexpr unsigned MAX_ATTEMPTS = 3;
+    static constexpr unsigned MAX_NAME_LENGTH = 255;
+
+    Resolver(IoUring& server, const ResolverConfig& config);
+    ~Resolver();
+
+    Resolver(const Resolver&) = delete;
+    Resolver& operator=(const Resolver&) = delete;
+
+    // answers numeric addresses, /etc/hosts entries and cached answers without any I/O
+    [[nodiscard]] std::optional<DnsAnswer> resolve_locally(std::string_view name);
+    // queues a query, IoUring::handle_resolved is called for the client once both A and AAAA
+    // answers arrive; returns false if the name is not a valid domain name
+    [[nodiscard]] bool resolve(Session* client, std::string_view name);
+
+    void handle_receive(unsigned nread);
+    void handle_send();
+    void handle_tick();
+
+    [[nodiscard]] int fd() const { return m_fd; }
+    [[nodiscard]] std::span<byte_t> receive_buffer() { return m_receive_buffer; }
+    [[nodiscard]] const DnsCache& cache() const { return m_cache; }
+
+private:
+    // one question of a Query, sent and retried on its own
+    struct Question
+    {
+        std::uint16_t id;
+        std::array<byte_t, MAX_PACKET_SIZE> packet;
+        unsigned packet_size;
+        std::chrono::steady_clock::time_point deadline;
+        unsigned attempts;
+        bool answered;
+        DnsAnswer::Status status;
+    };
+
+    // A and AAAA questions for one name are asked in parallel
+    struct Query
+    {
+        std::string name;
+        std::vector<Session*> clients;
+        std::array<Question, 2> questions;
+        // addresses of the answered questions
+        DnsAnswer answer;
+
+        [[nodiscard]] bool is_answered() const { return questions[0].answered && questions[1].answered; }
+    };
+
+    // by name, queries are not moved while their packets may be sent
+    using QueryMap = std::unordered_map<std::string, std::unique_ptr<Query>, StringHash, std::equal_to<>>;
+
+    void send_question(Question& question);
+    void record_answer(Query& query, Question& question, const DnsAnswer& answer);
+    void complete_query(QueryMap::iterator it);
+    [[nodiscard]] std::uint16_t generate_query_id();
+
+    IoUring& m_server;
+    const ResolverConfig& m_config;
+    int m_fd = -1;
+
+    QueryMap m_queries;
+    // ids of unanswered questions
+    std::unordered_map<std::uint16_t, Query*> m_queries_by_id;
+    // completed queries whose packets may still be read by in-flight sends
+    std::vector<std::unique_ptr<Query>> m_retired_queries;
+    unsigned m_sends_in_flight = 0;
+
+    DnsCache m_cache;
+
+    std::mt19937 m_random_engine;
+    std::array<byte_t, MAX_PACKET_SIZE> m_receive_buffer;
+};
+
+}  // namespace hw2
+
+#endif  // HW2_SOCKS5_SERVER_RESOLVER_HPP_
@@ -1,15 +1,32 @@
 #ifndef HW2_SOCKS5_SERVER_SERVER_EVENT_LOOP_HPP_
 #define HW2_SOCKS5_SERVER_SERVER_EVENT_LOOP_HPP_
 
+#include <coroutine.hpp>
+#include <memory_arena.hpp>
+#include <metrics.hpp>
+#include <resolver.hpp>
 #include <socket.hpp>
+#include <relay_pipeline.hpp>
+#include <socks5_parser.hpp>
+#include <timer_wheel.hpp>
+#include <utils.hpp>
 
 #include <liburing.h>
 #include <netdb.h>
 
-#include <functional>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
 #include <memory>
+#include <new>
+#include <optional>
 #include <queue>
 #include <span>
+#include <utility>
 #include <vector>
 
 namespace hw2
@@ -17,38 +34,103 @@ namespace hw2
 
 using byte_t = unsigned char;
 
-enum class EventType
+enum class EventType : std::uint8_t
 {
     CLIENT_ACCEPT = 0,
     CLIENT_READ,
     CLIENT_WRITE,
     DESTINATION_CONNECT,
+    DESTINATION_CONNECT_DELAY,  // RFC 8305 delay before the next connect attempt
+    DESTINATION_FAST_OPEN,      // sendmsg starting a connect attempt with data in the SYN
     DESTINATION_READ,
     DESTINATION_WRITE,
+    DNS_SEND,
+    DNS_RECEIVE,
+    TIMER,
 };
 
-class Session;
+enum class RelayMode
+{
+    COPY,    // read into BufferPool buffers and write them out
+    SPLICE,  // splice through per-session pipes, payload never enters user space
+    BUFFER_RING,  // like COPY, but payload lands in kernel-selected buffers of a shared BufferRing
+    PIPELINED,    // like COPY, but reads stay outstanding while previous chunks are written, see RelayPipeline
+};
 
-struct Event
+// io_uring setup flags, every level includes the ones before it. A level the kernel rejects
+// falls back to the one below; SQPOLL allows SINGLE_ISSUER at most.
+enum class RingSetup
 {
-    std::size_t id;
-    Session* client;
-    EventType type;
+    PLAIN,
+    SINGLE_ISSUER,  // Linux 6.0+, only the event loop thread submits, so the kernel skips locking
+    COOP_TASKRUN,   // Linux 5.19+, completions do not interrupt the thread while it is busy
+    DEFER_TASKRUN,  // Linux 6.1+, completions are only run when the thread waits for them
 };
 
-class EventPool
+struct ServerOptions
 {
-public:
-    EventPool(std::size_t nconnections);
+    bool kernel_polling = false;
+    int sq_thread_cpu = -1;  // pins the SQPOLL thread if kernel_polling
+    RingSetup ring_setup = RingSetup::DEFER_TASKRUN;
+    // 0 derives the size from the count of connections, see IoUring::IoUring and
+    // IoUring::cq_entries_per_session
+    unsigned sq_entries = 0;
+    unsigned cq_entries = 0;
+    RelayMode relay_mode = RelayMode::COPY;
+    unsigned buffer_ring_entries = 1024;  // RelayMode::BUFFER_RING, power of 2
+    unsigned pipeline_depth = 4;  // RelayMode::PIPELINED, slices per direction
+    bool fixed_files = false;  // sockets are accepted and created straight into a FileTable
+    bool multishot_accept = true;  // one accept request serves all incoming connections
+    bool adaptive_buffers = true;  // RelayMode::COPY, buffers move between BufferPool size classes
+    // adaptive_buffers: a 64 KiB and a 256 KiB buffer per this many sessions, 0 leaves the class
+    // out; the defaults keep the pool at the 32 KiB per session of two static 16 KiB buffers
+    unsigned sessions_per_64k_buffer = 16;
+    unsigned sessions_per_256k_buffer = 64;
+    HugePages huge_pages = HugePages::TRANSPARENT;  // backing the BufferPool arena
+    // in seconds, 0 disables; checked on ticks, so a timeout may fire up to a second early
+    unsigned handshake_timeout = 10;  // from accept until the CONNECT reply is sent, connecting excluded
+    unsigned connect_timeout = 10;
+    unsigned idle_timeout = 300;  // proxying without any completed request
+    // the first connect attempt sends payload the client pipelined after its request in the SYN;
+    // not with fixed_files, as the outcome of such a connect is read with getsockopt
+    bool fast_open = false;
+    // RelayMode::COPY and BUFFER_RING: writes to the client of at least this many bytes are sent
+    // with IORING_OP_SEND_ZC (Linux 6.0+), 0 disables
+    unsigned zero_copy_threshold = 0;
+};
 
-    [[nodiscard]] Event& obtain_event();
-    void return_event(const Event& event);
+class Session;
 
-    const std::size_t total_events_count;
+// Target of a completion, packed into the user_data of its request:
+//   bits 0-7    EventType
+//   bits 8-31   SessionPool slot, SERVICE_SLOT for events of the IoUring itself (accept, DNS, timer)
+//   bits 32-39  index among requests of the same type, e.g. the address of a connect attempt
+//   bits 40-63  generation of the slot in debug builds, catches completions for recycled sessions
+struct EventTag
+{
+    static constexpr unsigned SERVICE_SLOT = (1u << 24) - 1;
+    static constexpr std::uint32_t GENERATION_MASK = (1u << 24) - 1;
 
-private:
-    std::vector<Event> m_events;
-    std::queue<std::size_t> m_free_events;
+    [[nodiscard]] std::uint64_t encode() const
+    {
+        return std::uint64_t{generation} << 40 | std::uint64_t{index} << 32 | std::uint64_t{slot} << 8
+            | static_cast<std::uint64_t>(type);
+    }
+
+    [[nodiscard]] static EventTag decode(std::uint64_t user_data)
+    {
+        return {
+            static_cast<EventType>(user_data & 0xFF),
+            static_cast<unsigned>(user_data >> 8) & SERVICE_SLOT,
+            static_cast<std::uint32_t>(user_data >> 40),
+            static_cast<std::uint8_t>(user_data >> 32),
+        };
+    }
+
+    EventType type;
+    unsigned slot = SERVICE_SLOT;
+    std::uint32_t generation = 0;
+    std::uint8_t index = 0;
 };
 
 class BufferPool
@@ -61,176 +143,638 @@ public:
         ~InsufficientBuffersException() override;
     };
 
-    static constexpr unsigned HALF_BUFFER_SIZE = (1 << 14);
-    // 0: receive from client, send to destination
-    // 1: receive from destination, send to client
-    static constexpr unsigned BUFFER_SIZE = HALF_BUFFER_SIZE * 2;
+    static constexpr unsigned DEFAULT_BUFFER_SIZE = (1 << 14);
+    // RelayMode::BUFFER_RING keeps only handshake messages in the pool, 512 bytes fit any of them
+    static constexpr unsigned HANDSHAKE_BUFFER_SIZE = (1 << 9);
+
+    struct SizeClass
+    {
+        unsigned buffer_size;
+        unsigned buffer_count;
+    };
+
+    // every session holds two buffers, one per direction, of one size class each
+    [[nodiscard]] static std::vector<SizeClass> single_class(unsigned nconnections, unsigned buffer_size);
+    // 4 KiB for everybody, 16 KiB for half of the directions, and a 64 KiB and a 256 KiB buffer
+    // per the given count of sessions, 0 leaving that class out
+    [[nodiscard]] static std::vector<SizeClass> adaptive_classes(unsigned nconnections, unsigned sessions_per_64k_buffer,
+                                                                 unsigned sessions_per_256k_buffer);
+
+    // bytes of the arena holding the classes, each of them starts on a page
+    [[nodiscard]] static std::size_t memory_size(const std::vector<SizeClass>& size_classes);
 
-    BufferPool(unsigned nconnections);
+    // classes are ordered by buffer size, buffer ids are consecutive across classes;
+    // all of them live in one prefaulted MemoryArena
+    BufferPool(const std::vector<SizeClass>& size_classes, HugePages huge_pages = HugePages::NONE);
 
-    [[nodiscard]] unsigned obtain_free_buffer();
-    void return_buffer(unsigned buffer_index);
+    // throws InsufficientBuffersException if the class is exhausted
+    [[nodiscard]] unsigned obtain_buffer(unsigned size_class);
+    [[nodiscard]] std::optional<unsigned> try_obtain_buffer(unsigned size_class);
+    void return_buffer(unsigned buffer_id);
 
+    // one iovec per size class, so registering them stays within the kernel limit on registered
+    // buffers; a buffer is used with the fixed index of its size class
     [[nodiscard]] std::span<const iovec> get_iovecs() const;
     [[nodiscard]] std::span<iovec> get_iovecs();
 
-    [[nodiscard]] std::span<const byte_t> buffer_half0(unsigned buffer_index) const;
-    [[nodiscard]] std::span<byte_t> buffer_half0(unsigned buffer_index);
-    [[nodiscard]] std::span<const byte_t> buffer_half1(unsigned buffer_index) const;
-    [[nodiscard]] std::span<byte_t> buffer_half1(unsigned buffer_index);
+    [[nodiscard]] std::span<const byte_t> buffer(unsigned buffer_id) const;
+    [[nodiscard]] std::span<byte_t> buffer(unsigned buffer_id);
+    [[nodiscard]] unsigned size_class_of(unsigned buffer_id) const;
 
-    const unsigned total_buffer_count;
+    [[nodiscard]] unsigned size_classes_count() const { return static_cast<unsigned>(m_classes.size()); }
+    [[nodiscard]] unsigned buffer_size(unsigned size_class) const { return m_classes[size_class].buffer_size; }
+    [[nodiscard]] unsigned buffer_count(unsigned size_class) const { return m_classes[size_class].buffer_count; }
+    [[nodiscard]] unsigned in_use_count(unsigned size_class) const;
+    [[nodiscard]] const MemoryArena& arena() const { return m_arena; }
 
 private:
-    std::vector<byte_t> m_buffers;
-    std::queue<unsigned> m_free_buffers;
+    struct Class
+    {
+        unsigned buffer_size;
+        unsigned buffer_count;
+        unsigned first_buffer_id;
+        byte_t* memory;  // within m_arena
+        std::queue<unsigned> free_buffers;
+    };
+
+    MemoryArena m_arena;
+    std::vector<Class> m_classes;
     std::vector<iovec> m_iovecs;
 };
 
+// Decides when a direction of a session should move its buffer to a neighbouring size class:
+// a streak of reads filling the whole buffer promotes it, a long streak of reads which would
+// comfortably fit the smaller class demotes it.
+class BufferSizePolicy
+{
+public:
+    static constexpr unsigned PROMOTE_AFTER_FULL_READS = 4;
+    static constexpr unsigned DEMOTE_AFTER_SMALL_READS = 64;
+
+    // smaller_buffer_size is 0 for the smallest class
+    void record_read(unsigned nread, unsigned buffer_size, unsigned smaller_buffer_size);
+    // +1 to promote, -1 to demote, 0 to keep the size class
+    [[nodiscard]] int take_decision();
+
+private:
+    unsigned m_full_reads = 0;
+    unsigned m_small_reads = 0;
+};
+
+// Provided buffer ring shared by all sessions of one IoUring. The kernel picks a buffer
+// only when data arrives, so idle connections do not pin any payload memory.
+class BufferRing
+{
+public:
+    static constexpr unsigned short GROUP_ID = 0;
+    static constexpr unsigned MAX_ENTRIES = 1 << 15;
+
+    BufferRing(io_uring& ring, unsigned entries_, unsigned buffer_size_);
+    ~BufferRing();
+
+    BufferRing(const BufferRing&) = delete;
+    BufferRing& operator=(const BufferRing&) = delete;
+
+    [[nodiscard]] std::span<byte_t> buffer(unsigned short buffer_id);
+    // buffer_id was consumed by a completed read
+    void take_buffer(unsigned short buffer_id);
+    // hands buffer_id back to the kernel
+    void return_buffer(unsigned short buffer_id);
+    // buffers returned since the previous call
+    [[nodiscard]] unsigned take_returned_count();
+
+    [[nodiscard]] unsigned in_use_count() const { return m_in_use_count; }
+
+    const unsigned entries;
+    const unsigned buffer_size;
+
+private:
+    io_uring& m_ring;
+    io_uring_buf_ring* m_buf_ring = nullptr;
+    // default-initialized, pages are not touched before the kernel fills them
+    std::unique_ptr<byte_t[]> m_buffers;
+    unsigned m_in_use_count = 0;
+    unsigned m_returned_count = 0;
+};
+
+// Slots of the sparse file table registered with io_uring. Sockets accepted or created
+// there have no regular fd, and requests on them skip the fget/fput pair in the kernel.
+// The first accept_slots are allocated by the kernel for accepted clients, the rest are
+// handed out by obtain_slot().
+class FileTable
+{
+public:
+    FileTable(io_uring& ring, unsigned accept_slots_, unsigned size_);
+
+    [[nodiscard]] bool has_free_slot() const { return !m_free_slots.empty(); }
+    [[nodiscard]] unsigned obtain_slot();
+    void return_slot(unsigned slot);
+
+    const unsigned accept_slots;
+    const unsigned size;
+
+private:
+    std::queue<unsigned> m_free_slots;
+};
+
 class IoUring;
 
+// Awaitable request of the Session handshake coroutine: the request is issued on suspension,
+// its completion handler in Session resumes the coroutine, co_await yields the CQE result
+class IoOperation
+{
+public:
+    IoOperation(IoUring& server, Session& client, EventType type, unsigned nbytes = 0, unsigned offset = 0)
+        : m_server(server), m_client(client), m_type(type), m_nbytes(nbytes), m_offset(offset)
+    {
+    }
+
+    [[nodiscard]] bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> handle);
+    [[nodiscard]] int await_resume() const noexcept;
+
+private:
+    IoUring& m_server;
+    Session& m_client;
+    EventType m_type;
+    unsigned m_nbytes;
+    unsigned m_offset;
+};
+
+// Awaitable connection to the destination of the Session handshake coroutine, raced over the
+// resolved addresses as in RFC 8305; co_await yields 0 or errno of the last failed attempt
+class ConnectOperation
+{
+public:
+    explicit ConnectOperation(Session& client) : m_client(client) {}
+
+    [[nodiscard]] bool await_ready() const noexcept { return false; }
+    [[nodiscard]] bool await_suspend(std::coroutine_handle<> handle);
+    [[nodiscard]] int await_resume() const noexcept;
+
+private:
+    Session& m_client;
+};
+
+// Awaitable DNS resolution of the Session handshake coroutine, a name which cannot be
+// queried resumes it immediately with a failed answer
+class ResolveOperation
+{
+public:
+    ResolveOperation(IoUring& server, Session& client, std::string_view name)
+        : m_server(server), m_client(client), m_name(name)
+    {
+    }
+
+    [[nodiscard]] bool await_ready() const noexcept { return false; }
+    [[nodiscard]] bool await_suspend(std::coroutine_handle<> handle);
+    [[nodiscard]] const DnsAnswer& await_resume() const noexcept;
+
+private:
+    IoUring& m_server;
+    Session& m_client;
+    std::string_view m_name;
+};
+
 class Session
 {
+    friend class IoOperation;
+    friend class ConnectOperation;
+    friend class ResolveOperation;
+
 public:
+    static constexpr unsigned MAX_CONNECT_ATTEMPTS = 2 * DnsAnswer::MAX_ADDRESSES;
+
+    // phase limited by a ServerOptions timeout
+    enum class Timeout : std::uint8_t
+    {
+        HANDSHAKE,
+        CONNECT,
+        IDLE,
+    };
+
+    // fd is a FileTable slot if IoUring::uses_fixed_files()
     Session(int fd, IoUring& server, BufferPool& buffers);
     ~Session();
 
-    void write_to_client();
-    void read_from_client();
-    void read_some_from_client(unsigned n);
+    // starts the negotiate() coroutine, which is resumed by completions of its requests
+    void start_handshake();
 
-    [[nodiscard]] std::span<byte_t> buffer0() { return m_buffer0; }
-    [[nodiscard]] std::span<const byte_t> buffer0() const { return m_buffer0; }
-    [[nodiscard]] std::span<byte_t> buffer1() { return m_buffer1; }
-    [[nodiscard]] std::span<const byte_t> buffer1() const { return m_buffer1; }
+    [[nodiscard]] std::span<byte_t> buffer0() { return { m_buffer0_data, m_buffer0_size }; }
+    [[nodiscard]] std::span<const byte_t> buffer0() const { return { m_buffer0_data, m_buffer0_size }; }
+    [[nodiscard]] std::span<byte_t> buffer1() { return { m_buffer1_data, m_buffer1_size }; }
+    [[nodiscard]] std::span<const byte_t> buffer1() const { return { m_buffer1_data, m_buffer1_size }; }
+    // indices for io_uring_prep_{read,write}_fixed, -1 if the buffer is not registered
+    [[nodiscard]] int buffer0_fixed_index() const { return m_buffer0_fixed_index; }
+    [[nodiscard]] int buffer1_fixed_index() const { return m_buffer1_fixed_index; }
+    // RelayMode::BUFFER_RING: the completed read of given type filled buffer_id of the BufferRing
+    void attach_selected_buffer(EventType type, unsigned short buffer_id);
 
     void handle_client_read(unsigned nread);
+    void handle_client_eof();
     void handle_client_write(unsigned nwrite);
-    void handle_destination_connect();
+    // attempt indexes the address, failed attempts are reported here as well
+    void handle_destination_connect(unsigned attempt, int result);
+    void handle_connect_delay();
+    void handle_fast_open(int result);
+    // a zero-copy send to the client completed and the kernel will report when it releases buffer1
+    void expect_send_notification();
+    void handle_send_notification();
     void handle_destination_read(unsigned nread);
+    void handle_destination_eof();
     void handle_destination_write(unsigned nwrite);
+    void handle_domain_resolved(const DnsAnswer& answer);
 
     [[nodiscard]] Socket* destination_socket() { return m_destination_socket.get(); }
+    // FileTable slot if IoUring::uses_fixed_files(), the socket fd otherwise
+    [[nodiscard]] int destination_fd() const { return m_destination_fd; }
+    // client -> destination and destination -> client pipes in RelayMode::SPLICE, {read end, write end}
+    [[nodiscard]] const std::array<int, 2>& upstream_pipe() const { return m_upstream_pipe; }
+    [[nodiscard]] const std::array<int, 2>& downstream_pipe() const { return m_downstream_pipe; }
 
-    [[nodiscard]] int fd() const;
+    [[nodiscard]] int fd() const { return m_fd; }
     void fail_delayed();
     void fail_immediately();
-    [[nodiscard]] bool is_failed() const;
-
-private:
+    [[nodiscard]] bool is_failed() const { return m_is_failed; }
+    // fails the session and makes its requests in flight complete, even those on stalled sockets
+    void abort();
 
-    void consume_bytes_from_read_buffer(unsigned nread);
+    [[nodiscard]] TimerWheel::Entry& timer_entry() { return m_timer_entry; }
+    [[nodiscard]] Timeout timeout() const { return m_timeout; }
+    // IDLE deadlines are moved lazily: completions only record their tick, see IoUring::handle_timeout
+    void touch(std::uint32_t tick) { m_last_activity_tick = tick; }
+    [[nodiscard]] std::uint32_t last_activity_tick() const { return m_last_activity_tick; }
 
-    void read_client_greeting();
-    void read_auth_methods();
-    void read_client_connection_request();
-    void read_domain_name_length();
-    void read_address();
+private:
+    // The SOCKS5 negotiation up to the CONNECT reply, true if proxying may start. It finishes
+    // early on errors, after failing the session or sending the failure reply.
+    [[nodiscard]] Task negotiate();
+    void resume_handshake();
+    // parses the next message out of buffered bytes, INCOMPLETE if it is not received yet
+    [[nodiscard]] Socks5Parser::Result parse_handshake_message();
+    // handshake replies are copied to buffer1, returns their size
+    [[nodiscard]] unsigned copy_to_buffer1(std::span<const byte_t> message);
+    // (re)starts the timeout of the phase, it is measured from now
+    void set_timeout(Timeout timeout);
+    // continues a phase whose timeout was interrupted with ticks_left of it remaining
+    void resume_timeout(Timeout timeout, std::uint32_t ticks_left);
 
     void translate_errno(int error_code);
     void send_fail_message(byte_t error_code = 0x01);
 
-    void connect_ipv4_destination();
-    void connect_ipv6_destination();
+    // starts the first connect attempts, false if none could be started
+    [[nodiscard]] bool start_connect_race();
+    // starts the attempt for the next address whose socket can be created, and arms the delay
+    // of the one after it
+    void start_connect_attempt();
+    // cancels attempts still in flight and closes their sockets
+    void finish_connect_race();
+    void close_connect_attempt(unsigned attempt);
+    void close_client();
+    void close_destination();
+
+    void start_proxying();
+    void relay_from_client();
+    void relay_from_destination();
+    void record_read_size(unsigned nread, unsigned buffer_id, BufferSizePolicy& policy);
+    // moves an idle buffer to a neighbouring size class if the policy asks for it, true if it moved
+    [[nodiscard]] bool adapt_buffer_size(BufferSizePolicy& policy, unsigned& buffer_id);
+    [[nodiscard]] int pool_fixed_index(unsigned buffer_id) const;
+    void set_buffer0(std::span<byte_t> buffer, int fixed_index);
+    void set_buffer1(std::span<byte_t> buffer, int fixed_index);
+    void relay_to_client();
+    void relay_to_destination();
+    void release_client_buffer();
+    void release_destination_buffer();
+    // RelayMode::PIPELINED: issues every read and write the pipeline allows
+    void pump_upstream();
+    void pump_downstream();
 
 private:
-    enum class State
-    {
-        READING_CLIENT_GREETING,
-        READING_AUTH_METHODS,
-        READING_CLIENT_CONNECTION_REQUEST,
-        READING_DOMAIN_NAME_LENGTH,
-        READING_ADDRESS,
-        CONNECTING_TO_DESTINATION,
+    enum class State : std::uint8_t
+    {
+        NEGOTIATING,  // completions resume the negotiate() coroutine
         PROXYING_REQUESTS,
     };
 
-    enum Command
+    // Connects to the addresses of Handshake::answer, IPv6 first with the families interleaved.
+    // A new attempt starts whenever one fails or IoUring::CONNECT_ATTEMPT_DELAY passes without
+    // a connection; the first connected socket wins and the other attempts are cancelled.
+    struct ConnectRace
     {
-        COMMAND_CONNECT = 0x01,
-        COMMAND_BIND = 0x02,
-        COMMAND_UDP_ASSOCIATE = 0x03,
+        // sockets of attempts in flight, indexed by attempt
+        std::array<std::unique_ptr<Socket>, MAX_CONNECT_ATTEMPTS> sockets;
+        // FileTable slots if IoUring::uses_fixed_files(), the socket fds otherwise
+        std::array<int, MAX_CONNECT_ATTEMPTS> fds;
+        unsigned next = 0;  // attempt to start next
+        unsigned in_flight = 0;
+        bool delay_armed = false;
+        bool finished = false;
+        int error = 0;  // of the last failed attempt
+        // attempt 0 with ServerOptions::fast_open, its sendmsg refers to the early payload in buffer0
+        bool fast_open = false;
+        unsigned fast_open_sent = 0;  // bytes queued with the SYN, they are not relayed again
+        int fast_open_error = 0;  // of the sendmsg, if it did not even send the SYN
+        msghdr fast_open_message;
+        iovec fast_open_iovec;
     };
 
-    enum AddressType
+    // SOCKS5 negotiation state, allocated on accept and released once proxying starts
+    struct Handshake
     {
-        ADDRESS_TYPE_IPV4 = 0x01,
-        ADDRESS_TYPE_DOMAIN_NAME = 0x03,
-        ADDRESS_TYPE_IPV6 = 0x04,
+        Task task;
+        // result of the awaited request, handed over by the completion handler
+        int result = 0;
+        DnsAnswer answer;
+        Socks5Parser parser;
+        // received and not yet parsed bytes at the beginning of buffer0
+        unsigned buffered = 0;
+        ConnectRace race;
     };
 
 private:
-    int m_fd = -1;
-    State m_state = State::READING_CLIENT_GREETING;
+    // Everything a relayed chunk touches comes first and fits the first cache line of the Session
     IoUring& m_server;
+    byte_t* m_buffer0_data;
+    byte_t* m_buffer1_data;
+    unsigned m_buffer0_size;
+    unsigned m_buffer1_size;
+    int m_fd = -1;
+    int m_destination_fd = -1;
+    unsigned m_client_write_size;
+    unsigned m_client_write_offset;
+    unsigned m_destination_write_size;
+    unsigned m_destination_write_offset;
+    // indices for io_uring_prep_{read,write}_fixed, -1 if the buffer is not registered
+    std::int16_t m_buffer0_fixed_index;
+    std::int16_t m_buffer1_fixed_index;
 
 public:
-    std::size_t awaiting_events_count = 0;
+    std::uint16_t awaiting_events_count = 0;
 
 private:
+    State m_state = State::NEGOTIATING;
+    bool m_is_failed = false;
+    // buffer1 is not read into before the kernel released it from all zero-copy sends
+    bool m_destination_read_deferred = false;
+    std::uint16_t m_pending_send_notifications = 0;
+
     BufferPool& m_buffer_pool;
-    const unsigned m_buffer_index;
+    // BufferPool ids, m_buffer0_data and m_buffer1_data point to them unless a BufferRing buffer is attached
+    unsigned m_buffer0_id;
+    unsigned m_buffer1_id;
+    BufferSizePolicy m_buffer0_size_policy;
+    BufferSizePolicy m_buffer1_size_policy;
+    // RelayMode::BUFFER_RING: BufferRing buffers held until their data is written, or -1
+    int m_client_buffer_id = -1;
+    int m_destination_buffer_id = -1;
 
+    std::unique_ptr<Socket> m_destination_socket;
+    std::array<int, 2> m_upstream_pipe = { -1, -1 };
+    std::array<int, 2> m_downstream_pipe = { -1, -1 };
+    // RelayMode::SPLICE: the early payload is written from buffer0 before splicing starts
+    bool m_writing_early_payload = false;
+    // RelayMode::PIPELINED: client -> destination through buffer0, destination -> client through buffer1
+    RelayPipeline m_upstream_pipeline;
+    RelayPipeline m_downstream_pipeline;
+
+    std::unique_ptr<Handshake> m_handshake;
+
+    TimerWheel::Entry m_timer_entry;
+    std::uint32_t m_last_activity_tick = 0;
+    Timeout m_timeout = Timeout::HANDSHAKE;
+};
+
+// Fixed-capacity slab of Sessions owned by one IoUring, accepting and closing connections never
+// reaches the global allocator. Slots are default-initialized, their pages are not touched before use.
+class SessionPool
+{
 public:
-    const unsigned buffer0_index;
-    const unsigned buffer1_index;
+    explicit SessionPool(unsigned capacity_);
 
-private:
+    // nullptr if all slots are taken, exceptions of the Session constructor are propagated
+    template <typename... Args>
+    [[nodiscard]] Session* create(Args&&... args);
+    void destroy(Session* session);
 
-    std::span<byte_t> m_buffer0;
-    std::span<byte_t> m_buffer1;
+    [[nodiscard]] unsigned slot_of(const Session* session) const
+    {
+        return static_cast<unsigned>(reinterpret_cast<const Slot*>(session) - m_slots.get());
+    }
+    [[nodiscard]] Session* session_at(unsigned slot)
+    {
+        return std::launder(reinterpret_cast<Session*>(m_slots[slot].storage));
+    }
+    // bumped on every destroy() in debug builds, always 0 otherwise
+    [[nodiscard]] std::uint32_t generation(unsigned slot) const
+    {
+#ifndef NDEBUG
+        return m_generations[slot] & EventTag::GENERATION_MASK;
+#else
+        (void)slot;
+        return 0;
+#endif
+    }
 
-    std::function<bool()> m_is_read_completed;
-    // TODO: investigate if std::deque is more suitable in terms of performance
-    std::vector<byte_t> m_read_buffer;
-    std::vector<byte_t> m_write_client_buffer;
+    [[nodiscard]] unsigned in_use_count() const { return capacity - static_cast<unsigned>(m_free_slots.size()); }
 
-    unsigned m_auth_methods_count;
-    byte_t m_auth_method;
-    Command m_command;
-    AddressType m_address_type;
-    unsigned m_domain_name_length;
-    std::string m_domain_name;
-    in_addr m_ipv4_address;
-    in6_addr m_ipv6_address;
-    in_port_t m_port;
+    const unsigned capacity;
 
-    std::unique_ptr<Socket> m_destination_socket;
+private:
+    static constexpr std::size_t CACHE_LINE_SIZE = 64;
 
-    unsigned m_client_write_size;
-    unsigned m_client_write_offset;
-    unsigned m_destination_write_size;
-    unsigned m_destination_write_offset;
+    // sessions start at a cache line, so their hot fields share exactly one
+    struct Slot
+    {
+        alignas(alignof(Session) > CACHE_LINE_SIZE ? alignof(Session) : CACHE_LINE_SIZE) std::byte storage[sizeof(Session)];
+    };
 
-    bool m_is_failed = false;
+    std::unique_ptr<Slot[]> m_slots;
+    // used as a stack, so a new session takes the most recently released slot which is likely still cached
+    std::vector<unsigned> m_free_slots;
+#ifndef NDEBUG
+    std::vector<std::uint32_t> m_generations;
+#endif
 };
 
+template <typename... Args>
+Session* SessionPool::create(Args&&... args)
+{
+    if (UNLIKELY(m_free_slots.empty()))
+    {
+        return nullptr;
+    }
+    unsigned slot = m_free_slots.back();
+    Session* session = ::new (m_slots[slot].storage) Session(std::forward<Args>(args)...);
+    m_free_slots.pop_back();
+    return session;
+}
+
 class IoUring
 {
 public:
-    IoUring(const MainSocket& socket, unsigned nconnections, bool kernel_polling = false);
+    static constexpr unsigned CQE_BATCH_SIZE = 256;
+    static constexpr unsigned STATISTICS_INTERVAL_TICKS = 60;
+    // RFC 8305 Connection Attempt Delay
+    static constexpr std::chrono::nanoseconds CONNECT_ATTEMPT_DELAY = std::chrono::milliseconds(250);
+
+    struct Statistics
+    {
+        // bucket 0 counts wakeups without completions, bucket i > 0 counts [2^(i-1), 2^i) completions
+        static constexpr unsigned CQE_HISTOGRAM_SIZE = std::bit_width(CQE_BATCH_SIZE) + 1;
+
+        std::uint64_t submit_calls = 0;
+        std::array<std::uint64_t, CQE_HISTOGRAM_SIZE> cqes_per_wakeup = {};
+    };
+
+    // user_data of requests whose completions carry no information, e.g. failed linked polls
+    static constexpr std::uint64_t UNTRACKED_USER_DATA = UINT64_MAX;
+    static constexpr unsigned SPLICE_CHUNK_SIZE = 1 << 16;  // default pipe capacity
+    // CQ entries for requests of no session: accept, DNS, timers
+    static constexpr unsigned SERVICE_CQ_ENTRIES = 64;
+    // fixed file slots per session: accepts get two, so that a burst of connections over
+    // capacity is accepted and closed instead of failing; so do destinations, whose connect
+    // races hold a slot per attempt in flight
+    static constexpr unsigned ACCEPT_SLOTS_PER_SESSION = 2;
+    static constexpr unsigned DESTINATION_SLOTS_PER_SESSION = 2;
+
+    // metrics are owned by the caller, so that they can be scraped from another thread
+    IoUring(const MainSocket& socket, unsigned nconnections, const ResolverConfig& resolver_config,
+            const ServerOptions& options, Metrics& metrics);
 
     ~IoUring();
 
+    // of the BufferPool of an IoUring with these arguments
+    [[nodiscard]] static std::size_t buffer_memory_size(unsigned nconnections, const ServerOptions& options);
+    // of the FileTable of an IoUring with nconnections sessions
+    [[nodiscard]] static unsigned file_table_size(unsigned nconnections);
+    // entries of the process file table a session may hold: its sockets unless they are fixed
+    // files, and the relay pipes of RelayMode::SPLICE
+    [[nodiscard]] static unsigned descriptors_per_session(const ServerOptions& options);
+    // completions a session may have pending at once, the default CQ holds them for every session
+    [[nodiscard]] static unsigned cq_entries_per_session(const ServerOptions& options);
+
     void event_loop();
 
+    [[nodiscard]] const ServerOptions& options() const { return m_options; }
+    [[nodiscard]] Resolver& resolver() { return m_resolver; }
+    [[nodiscard]] Statistics& statistics() { return m_statistics; }
+    [[nodiscard]] Metrics& metrics() { return m_metrics; }
+    [[nodiscard]] bool uses_fixed_buffers() const { return m_fixed_buffers; }
+    // ServerOptions::zero_copy_threshold, 0 if the kernel cannot send zero-copy
+    [[nodiscard]] unsigned zero_copy_threshold() const { return m_zero_copy_threshold; }
+    [[nodiscard]] BufferRing& buffer_ring() { return *m_buffer_ring; }
+    [[nodiscard]] bool uses_fixed_files() const { return m_file_table.has_value(); }
+    [[nodiscard]] bool has_free_file_slot() const { return m_file_table->has_free_slot(); }
+    [[nodiscard]] unsigned obtain_file_slot() { return m_file_table->obtain_slot(); }
+    // queues removal of the slot's socket, the slot may be reused right away
+    void close_file_slot(unsigned slot);
+    // shuts the socket down for both directions, so that its requests in flight complete
+    void shutdown_socket(int fd);
+    // cancels requests of the client, whose sockets may be closed already
+    void cancel_requests(const Session* client);
+    // cancels every request on the socket, including the untracked poll heads of splice links;
+    // to be called before the socket is closed
+    void cancel_socket_requests(int fd);
+    void cancel_request(const Session* client, EventType type, unsigned index = 0, int flags = 0);
+    // schedules the current timeout of the client, or cancels it if it is disabled
+    void schedule_timeout(Session* client);
+    // schedules it to expire in ticks instead, or cancels it if ticks is 0
+    void schedule_timeout(Session* client, std::uint32_t ticks);
+    // ticks until the timeout of the client expires, 0 if none is scheduled
+    [[nodiscard]] std::uint32_t timeout_ticks_left(Session* client) const;
+    // flushes queued SQEs, must be called before closing fds they may refer to
+    void submit_pending();
+    void handle_resolved(Session* client, const DnsAnswer& answer);
+
+    // multishot unless ServerOptions::multishot_accept is off, handle_accept re-arms it when needed
     void add_client_accept_request(struct sockaddr_in* client_addr, socklen_t* client_addr_len);
     void add_client_read_request(Session* client);
+    void add_client_read_request(Session* client, unsigned nbytes, unsigned offset);
     void add_client_write_request(Session* client, unsigned nbytes, unsigned offset = 0);
-    void add_destination_connect_request(Session* client);
+    // completes like a write, then posts a notification once the kernel released the buffer
+    void add_client_send_zc_request(Session* client, unsigned nbytes, unsigned offset);
+    // socket holds the address, attempt is passed back to Session::handle_destination_connect
+    void add_destination_connect_request(Session* client, const Socket& socket, int fd, unsigned attempt);
+    void add_connect_delay_request(Session* client);
+    // connects with sendmsg(MSG_FASTOPEN) of message, then polls until the handshake completes;
+    // the poll is reported to Session::handle_destination_connect with its mask as the result
+    void add_destination_fast_open_request(Session* client, int fd, msghdr* message, unsigned attempt);
     void add_destination_read_request(Session* client);
+    void add_destination_read_request(Session* client, unsigned nbytes, unsigned offset);
     void add_destination_write_request(Session* client, unsigned nbytes, unsigned offset = 0);
+    void add_client_splice_in_request(Session* client);
+    void add_client_splice_out_request(Session* client, unsigned nbytes);
+    void add_destination_splice_in_request(Session* client);
+    void add_destination_splice_out_request(Session* client, unsigned nbytes);
+    void add_client_buffer_ring_read_request(Session* client);
+    void add_destination_buffer_ring_read_request(Session* client);
+    void add_dns_send_request(const byte_t* data, unsigned nbytes);
+    void add_dns_receive_request();
+    void add_timer_request();
 
 private:
+    // SQEs are only queued here, event_loop submits them once per batch of completions;
+    // reserve guarantees that linked SQEs end up in the same submission
+    [[nodiscard]] io_uring_sqe* get_sqe(unsigned reserve = 1);
+    // requests on Session sockets refer to FileTable slots when fixed files are used
+    void mark_fixed_file(io_uring_sqe* sqe) const;
+
+    // splice is not pollable, so wait for poll_fd readiness first to not occupy an io-wq worker
+    void add_splice_request(Session* client, EventType type, int poll_fd, unsigned poll_mask,
+                            int fd_in, int fd_out, unsigned nbytes);
+    void add_buffer_ring_read_request(Session* client, EventType type, int fd);
+
+    void handle_cqe(const io_uring_cqe* cqe);
+    void handle_selected_buffer(const io_uring_cqe* cqe);
+    [[nodiscard]] bool is_starved_read(const io_uring_cqe* cqe, EventType type, const Session* client) const;
+    // re-issues reads which got -ENOBUFS, at most one per returned buffer
+    void resume_starved_reads();
     void handle_accept(const io_uring_cqe* cqe);
+    void handle_send_notification(Session* client);
+    void destroy_session(Session* client);
+    void handle_service_event(EventType type, int result);
+    [[nodiscard]] EventTag event_tag(const Session* client, EventType type, unsigned index) const;
+    // tags the request of sqe as an event of type targeting client
+    void set_event(io_uring_sqe* sqe, const Session* client, EventType type, unsigned index = 0);
+    void set_service_event(io_uring_sqe* sqe, EventType type);
+    [[nodiscard]] Session* session_of(const EventTag& tag);
+    void handle_tick();
+    void handle_timeout(Session* client);
+    void log_statistics() const;
 
     const MainSocket& m_socket;
-    EventPool m_event_pool;
+    const ServerOptions m_options;
     BufferPool m_buffer_pool;
+    SessionPool m_session_pool;
     io_uring m_ring;
     sockaddr_in m_client_addr;
     socklen_t m_client_addr_len = sizeof(m_client_addr);
     bool m_is_root;
+    bool m_fixed_buffers = false;  // the BufferPool is registered
+    unsigned m_zero_copy_threshold = 0;
+    Resolver m_resolver;
+    __kernel_timespec m_tick_interval = { .tv_sec = 1, .tv_nsec = 0 };
+    __kernel_timespec m_connect_attempt_delay = { .tv_sec = 0, .tv_nsec = CONNECT_ATTEMPT_DELAY.count() };
+    unsigned m_ticks_count = 0;
+    TimerWheel m_timer_wheel;
+    Statistics m_statistics;
+    Metrics& m_metrics;
+    std::array<io_uring_cqe*, CQE_BATCH_SIZE> m_cqes;
+
+    struct StarvedRead
+    {
+        Session* client;
+        EventType type;
+    };
+
+    std::optional<BufferRing> m_buffer_ring;
+    // still counted in awaiting_events_count of their sessions
+    std::deque<StarvedRead> m_starved_reads;
+
+    std::optional<FileTable> m_file_table;
+    // set when accept failed, it is re-armed on the next tick instead of spinning on e.g. EMFILE
+    bool m_accept_paused = false;
 };
 
 
@@ -9,6 +9,7 @@
 
 #include <cstdio>
 #include <cstring>
+#include <span>
 #include <stdexcept>
 
 namespace hw2
@@ -39,6 +40,8 @@ class SocketIPv4 : public Socket
 {
 public:
     SocketIPv4(in_addr addr, in_port_t port);
+    // adopts fd, -1 stands for a socket which lives only in the io_uring file table
+    SocketIPv4(int fd, in_addr addr, in_port_t port);
     ~SocketIPv4() override;
 
     [[nodiscard]] const sockaddr* address() const override;
@@ -53,6 +56,8 @@ class SocketIPv6 : public Socket
 {
 public:
     SocketIPv6(in6_addr addr, in_port_t port);
+    // adopts fd, -1 stands for a socket which lives only in the io_uring file table
+    SocketIPv6(int fd, in6_addr addr, in_port_t port);
     ~SocketIPv6() override;
 
     [[nodiscard]] const sockaddr* address() const override;
@@ -66,8 +71,17 @@ protected:
 class MainSocket : public SocketIPv4
 {
 public:
-    MainSocket(in_port_t port, int maxqueue);
+    // with reuse_port every worker may bind its own MainSocket to the same port
+    MainSocket(in_port_t port, int maxqueue, bool reuse_port = false);
     ~MainSocket() override;
+
+    // connections go to the group member with index listener_by_cpu[receiving CPU], members are
+    // indexed in the order they were bound; CPUs mapped to -1 or beyond the table fall back to the hash
+    void steer_reuseport_group_by_cpu(std::span<const int> listener_by_cpu);
+    // clients with a cookie may send data in the SYN, it is readable as soon as the connection is accepted
+    void enable_fast_open(int queue_length);
+    // a connection is accepted once the client sent its greeting, silent ones stay in the kernel
+    void defer_accept(int timeout_seconds);
 };
 
 }  // namespace hw2
@@ -0,0 +1,92 @@
+#ifndef HW2_SOCKS5_SERVER_SOCKS5_PARSER_HPP_
+#define HW2_SOCKS5_SERVER_SOCKS5_PARSER_HPP_
+
+#include <arpa/inet.h>
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string_view>
+
+namespace hw2
+{
+
+using byte_t = unsigned char;
+
+// Incremental parser of the client messages of the SOCKS5 handshake (RFC 1928): the greeting
+// and then the CONNECT request. It is given all bytes received so far and not consumed yet,
+// so a client which pipelines its messages is served from a single read. Nothing is allocated
+// or copied except the domain name, which is kept in the parser itself.
+class Socks5Parser
+{
+public:
+    static constexpr byte_t VERSION = 0x05;
+    static constexpr byte_t METHOD_NO_AUTH = 0x00;
+    static constexpr byte_t METHOD_NOT_ACCEPTABLE = 0xFF;
+
+    static constexpr byte_t REPLY_GENERAL_FAILURE = 0x01;
+    static constexpr byte_t REPLY_COMMAND_NOT_SUPPORTED = 0x07;
+    static constexpr byte_t REPLY_ADDRESS_TYPE_NOT_SUPPORTED = 0x08;
+
+    static constexpr std::size_t MAX_GREETING_SIZE = 2 + 255;
+    static constexpr std::size_t MAX_REQUEST_SIZE = 4 + 1 + 255 + 2;
+
+    enum class Result
+    {
+        INCOMPLETE,        // the current message needs more bytes
+        GREETING,          // greeting parsed, see no_auth_offered()
+        REQUEST,           // CONNECT request parsed, see address_type() and the address accessors
+        INVALID_GREETING,  // wrong version or no methods, the connection is to be dropped
+        INVALID_REQUEST,   // the request cannot be served, reply with reply_code()
+    };
+
+    enum class AddressType : byte_t
+    {
+        IPV4 = 0x01,
+        DOMAIN_NAME = 0x03,
+        IPV6 = 0x04,
+    };
+
+    // Parses the next message from the beginning of data. Unless INCOMPLETE is returned,
+    // consumed() leading bytes of data belonged to the message.
+    [[nodiscard]] Result parse(std::span<const byte_t> data);
+    [[nodiscard]] std::size_t consumed() const { return m_consumed; }
+
+    [[nodiscard]] bool no_auth_offered() const { return m_no_auth_offered; }
+    [[nodiscard]] byte_t reply_code() const { return m_reply_code; }
+
+    [[nodiscard]] AddressType address_type() const { return m_address_type; }
+    [[nodiscard]] const in_addr& ipv4_address() const { return m_ipv4_address; }
+    [[nodiscard]] const in6_addr& ipv6_address() const { return m_ipv6_address; }
+    [[nodiscard]] std::string_view domain_name() const { return { m_domain_name.data(), m_domain_name_length }; }
+    // network byte order
+    [[nodiscard]] in_port_t port() const { return m_port; }
+
+private:
+    enum class Stage
+    {
+        GREETING,
+        REQUEST,
+        DONE,
+    };
+
+    [[nodiscard]] Result parse_greeting(std::span<const byte_t> data);
+    [[nodiscard]] Result parse_request(std::span<const byte_t> data);
+
+    Stage m_stage = Stage::GREETING;
+    std::size_t m_consumed = 0;
+    bool m_no_auth_offered = false;
+    byte_t m_reply_code = 0;
+
+    AddressType m_address_type = AddressType::IPV4;
+    in_addr m_ipv4_address = {};
+    in6_addr m_ipv6_address = {};
+    in_port_t m_port = 0;
+    std::uint8_t m_domain_name_length = 0;
+    std::array<char, 255> m_domain_name;
+};
+
+}  // namespace hw2
+
+#endif  // HW2_SOCKS5_SERVER_SOCKS5_PARSER_HPP_
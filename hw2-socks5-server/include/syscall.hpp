@@ -2,8 +2,12 @@
 #define HW2_SOCKS5_SERVER_SYSCALL_HPP_
 
 #include <arpa/inet.h>
+#include <linux/filter.h>
+#include <sched.h>
 #include <sys/resource.h>
 
+#include <array>
+#include <cstddef>
 #include <stdexcept>
 #include <string>
 
@@ -23,14 +27,31 @@ public:
 int socket(int address_family);
 int socket_ipv4();
 int socket_ipv6();
+int socket_udp_ipv4();
 void close(int fd);
+// returns {read end, write end}
+std::array<int, 2> pipe();
 void bind(int fd, const sockaddr_in& address);
 void listen(int fd, int maxqueue);
+void connect(int fd, const sockaddr_in& address);
 void setsockopt_reuseaddr(int fd);
+void setsockopt_reuseport(int fd);
+// program picks the socket index within the SO_REUSEPORT group
+void setsockopt_attach_reuseport_cbpf(int fd, const sock_fprog& program);
+// queue_length bounds pending Fast Open connections which have not been accepted yet
+void setsockopt_tcp_fastopen(int fd, int queue_length);
+// accept reports a connection only once data arrived or timeout_seconds passed
+void setsockopt_tcp_defer_accept(int fd, int timeout_seconds);
 rlimit getrlimit_nofile();
 void setrlimit_nofile(rlimit file_limit);
 rlimit getrlimit_memlock();
 void setrlimit_memlock(rlimit memory_limit);
+// CPUs the calling thread may run on
+cpu_set_t sched_getaffinity();
+// pins the calling thread
+void sched_setaffinity(const cpu_set_t& cpus);
+// makes further allocations of the calling thread prefer its current NUMA node
+void set_mempolicy_local();
 
 }  // namespace hw2::syscall_wrapper
 
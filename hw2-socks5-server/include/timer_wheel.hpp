@@ -0,0 +1,66 @@
+#ifndef HW2_SOCKS5_SERVER_TIMER_WHEEL_HPP_
+#define HW2_SOCKS5_SERVER_TIMER_WHEEL_HPP_
+
+#include <array>
+#include <cstdint>
+
+namespace hw2
+{
+
+class Session;
+
+// Hashed timer wheel of session deadlines, counted in IoUring ticks. An entry is linked into
+// the slot of its deadline modulo SLOTS_COUNT, so scheduling and cancelling are O(1) and a tick
+// visits only one slot; deadlines more than SLOTS_COUNT ticks ahead are skipped until their round.
+class TimerWheel
+{
+public:
+    static constexpr unsigned SLOTS_COUNT = 512;
+
+    // embedded in its Session
+    struct Entry
+    {
+        Entry* prev = nullptr;
+        Entry* next = nullptr;
+        Session* session = nullptr;
+        std::uint32_t deadline = 0;
+
+        [[nodiscard]] bool is_scheduled() const { return next != nullptr; }
+    };
+
+    TimerWheel();
+
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+
+    // moves the entry if it is scheduled already
+    void schedule(Entry& entry, std::uint32_t deadline);
+    void cancel(Entry& entry);
+    // unlinks the entries due at tick and passes each to on_expired, which may schedule it again
+    template <typename F>
+    void expire(std::uint32_t tick, F&& on_expired);
+
+private:
+    // heads of circular lists
+    std::array<Entry, SLOTS_COUNT> m_slots;
+};
+
+template <typename F>
+void TimerWheel::expire(std::uint32_t tick, F&& on_expired)
+{
+    Entry& head = m_slots[tick % SLOTS_COUNT];
+    for (Entry* entry = head.next; entry != &head;)
+    {
+        Entry* next = entry->next;
+        if (entry->deadline <= tick)
+        {
+            this->cancel(*entry);
+            on_expired(*entry);
+        }
+        entry = next;
+    }
+}
+
+}  // namespace hw2
+
+#endif  // HW2_SOCKS5_SERVER_TIMER_WHEEL_HPP_
@@ -6,10 +6,25 @@
 
 #include <spdlog/spdlog.h>
 
+#include <functional>
+#include <string_view>
+
 namespace hw2
 {
 
-std::shared_ptr<spdlog::logger> logger();
+// enables lookups by std::string_view in containers keyed by std::string
+struct StringHash
+{
+    using is_transparent = void;
+
+    std::size_t operator()(std::string_view value) const
+    {
+        return std::hash<std::string_view>{}(value);
+    }
+};
+
+// synchronous, for setup and rare events; event loops log through LOG_* of async_logger.hpp
+const std::shared_ptr<spdlog::logger>& logger();
 
 }  // namespace hw2
 
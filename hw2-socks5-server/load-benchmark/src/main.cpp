@@ -0,0 +1,917 @@
+// End-to-end load generator for the SOCKS5 server.
+//
+// The benchmark runs an echo server on loopback as the destination and drives a given count
+// of concurrent client connections through the SOCKS5 server, all of them multiplexed over
+// one io_uring per thread. A connection does the SOCKS5 handshake with the chosen address
+// type, then sends --requests payloads one by one, each echoed back by the destination, and
+// is closed and replaced by a new one. New connections may be paced with --rate, otherwise
+// they are opened as fast as the old ones finish. Handshake latency spans connect to the
+// CONNECT reply, relay latency spans sending a payload to receiving all of its echo.
+//
+// With --optimistic a connection sends the greeting, the request and its first payload at once
+// without waiting for the replies, and time to first byte spans connect to the first echoed byte.
+// --fast_open adds TCP Fast Open to both hops, the proxy should run with --fast_open as well:
+// the client sends its data in the SYN to the proxy, and the echo server takes it in the SYN
+// of the proxy. The first connection of each hop only obtains the cookie. On loopback a round
+// trip costs microseconds, so most of the gain seen here is saved syscalls and wakeups; on a
+// real network each hop saves a full RTT.
+//
+// The cost of the io_uring setup flags of the proxy shows in the tail latencies: run the proxy
+// with each --ring_setup level in turn under the same --connections and --rate, and compare the
+// relay latency percentiles. Task work run at arbitrary kernel entries interrupts the proxy
+// below defer_taskrun, which mostly moves p99 and above; the median changes little.
+
+#include <tclap/CmdLine.h>
+
+#include <arpa/inet.h>
+#include <liburing.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace
+{
+
+using clock_type = std::chrono::steady_clock;
+
+constexpr std::uint64_t ACCEPT_IPV4_USER_DATA = 1;
+constexpr std::uint64_t ACCEPT_IPV6_USER_DATA = 2;
+constexpr __kernel_timespec WAIT_TIMEOUT = { .tv_sec = 0, .tv_nsec = 100'000'000 };
+
+enum class AddressType
+{
+    IPV4,
+    IPV6,
+    DOMAIN_NAME,
+};
+
+struct Options
+{
+    sockaddr_in proxy;
+    unsigned connections_count;
+    unsigned threads_count;
+    unsigned duration_seconds;
+    unsigned payload_size;
+    unsigned requests_count;  // payloads per connection
+    double rate;              // new connections per second over all threads, 0 if not paced
+    AddressType address_type;
+    bool optimistic;          // the handshake and the first payload are sent at once
+    bool fast_open;
+};
+
+struct WorkerResult
+{
+    std::uint64_t connections = 0;
+    std::uint64_t failures = 0;
+    std::uint64_t relayed_bytes = 0;  // payload sent plus echo received
+    std::vector<std::uint32_t> handshake_latencies_us;
+    std::vector<std::uint32_t> relay_latencies_us;
+    std::vector<std::uint32_t> first_byte_latencies_us;  // Options::optimistic
+};
+
+std::uint32_t elapsed_us(clock_type::time_point since)
+{
+    return static_cast<std::uint32_t>(
+        std::chrono::duration_cast<std::chrono::microseconds>(clock_type::now() - since).count());
+}
+
+class Ring
+{
+public:
+    explicit Ring(unsigned entries)
+    {
+        int res = io_uring_queue_init(std::bit_ceil(entries), &m_ring, 0);
+        if (res < 0)
+        {
+            throw std::runtime_error(std::string("io_uring_queue_init: ") + std::strerror(-res));
+        }
+    }
+
+    ~Ring()
+    {
+        io_uring_queue_exit(&m_ring);
+    }
+
+    Ring(const Ring&) = delete;
+    Ring& operator=(const Ring&) = delete;
+
+    io_uring_sqe* get_sqe()
+    {
+        io_uring_sqe* sqe = io_uring_get_sqe(&m_ring);
+        if (sqe == nullptr)
+        {
+            io_uring_submit(&m_ring);
+            sqe = io_uring_get_sqe(&m_ring);
+        }
+        return sqe;
+    }
+
+    // submits queued requests and calls handle for every completion which arrives within WAIT_TIMEOUT
+    template <typename Handler>
+    void process_completions(Handler&& handle)
+    {
+        io_uring_cqe* cqe;
+        __kernel_timespec timeout = WAIT_TIMEOUT;
+        if (io_uring_submit_and_wait_timeout(&m_ring, &cqe, 1, &timeout, nullptr) < 0)
+        {
+            return;
+        }
+        unsigned head;
+        unsigned count = 0;
+        io_uring_for_each_cqe(&m_ring, head, cqe)
+        {
+            handle(cqe->user_data, cqe->res);
+            ++count;
+        }
+        io_uring_cq_advance(&m_ring, count);
+    }
+
+private:
+    io_uring m_ring;
+};
+
+// Echoes whatever it receives, listens on the same port of 127.0.0.1 and ::1
+class EchoServer
+{
+public:
+    static constexpr unsigned BUFFER_SIZE = 16 * 1024;
+
+    EchoServer(unsigned max_connections, bool fast_open)
+        : m_ring(max_connections + 2)
+    {
+        int fast_open_queue_length = fast_open ? static_cast<int>(max_connections) : 0;
+        m_ipv4_fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in ipv4_address = {};
+        ipv4_address.sin_family = AF_INET;
+        ipv4_address.sin_addr.s_addr = ::htonl(INADDR_LOOPBACK);
+        socklen_t ipv4_address_length = sizeof(ipv4_address);
+        if (m_ipv4_fd == -1
+            || ::bind(m_ipv4_fd, reinterpret_cast<const sockaddr*>(&ipv4_address), sizeof(ipv4_address)) != 0
+            || ::setsockopt(m_ipv4_fd, IPPROTO_TCP, TCP_FASTOPEN, &fast_open_queue_length,
+                            sizeof(fast_open_queue_length)) != 0
+            || ::listen(m_ipv4_fd, SOMAXCONN) != 0
+            || ::getsockname(m_ipv4_fd, reinterpret_cast<sockaddr*>(&ipv4_address), &ipv4_address_length) != 0)
+        {
+            throw std::runtime_error(std::string("Cannot listen on 127.0.0.1: ") + std::strerror(errno));
+        }
+        m_port = ipv4_address.sin_port;
+
+        // IPv6 loopback is optional, e.g. it is disabled in some containers
+        m_ipv6_fd = ::socket(AF_INET6, SOCK_STREAM, 0);
+        sockaddr_in6 ipv6_address = {};
+        ipv6_address.sin6_family = AF_INET6;
+        ipv6_address.sin6_addr = in6addr_loopback;
+        ipv6_address.sin6_port = m_port;
+        int one = 1;
+        if (m_ipv6_fd != -1
+            && (::setsockopt(m_ipv6_fd, IPPROTO_IPV6, IPV6_V6ONLY, &one, sizeof(one)) != 0
+                || ::bind(m_ipv6_fd, reinterpret_cast<const sockaddr*>(&ipv6_address), sizeof(ipv6_address)) != 0
+                || ::setsockopt(m_ipv6_fd, IPPROTO_TCP, TCP_FASTOPEN, &fast_open_queue_length,
+                                sizeof(fast_open_queue_length)) != 0
+                || ::listen(m_ipv6_fd, SOMAXCONN) != 0))
+        {
+            ::close(m_ipv6_fd);
+            m_ipv6_fd = -1;
+        }
+    }
+
+    ~EchoServer()
+    {
+        ::close(m_ipv4_fd);
+        if (m_ipv6_fd != -1)
+        {
+            ::close(m_ipv6_fd);
+        }
+    }
+
+    [[nodiscard]] in_port_t port() const { return m_port; }  // network byte order
+    [[nodiscard]] bool has_ipv6() const { return m_ipv6_fd != -1; }
+
+    void run(const std::atomic<bool>& stop)
+    {
+        this->add_accept(m_ipv4_fd, ACCEPT_IPV4_USER_DATA);
+        if (m_ipv6_fd != -1)
+        {
+            this->add_accept(m_ipv6_fd, ACCEPT_IPV6_USER_DATA);
+        }
+        while (!stop.load(std::memory_order_relaxed))
+        {
+            m_ring.process_completions([this](std::uint64_t user_data, int res) { this->handle(user_data, res); });
+        }
+    }
+
+private:
+    struct Connection
+    {
+        int fd;
+        unsigned size = 0;    // received and not yet echoed
+        unsigned offset = 0;  // echoed of size
+        std::array<unsigned char, BUFFER_SIZE> buffer;
+    };
+
+    void add_accept(int fd, std::uint64_t user_data)
+    {
+        io_uring_sqe* sqe = m_ring.get_sqe();
+        io_uring_prep_accept(sqe, fd, nullptr, nullptr, 0);
+        io_uring_sqe_set_data64(sqe, user_data);
+    }
+
+    void add_recv(Connection* connection)
+    {
+        io_uring_sqe* sqe = m_ring.get_sqe();
+        io_uring_prep_recv(sqe, connection->fd, connection->buffer.data(), BUFFER_SIZE, 0);
+        io_uring_sqe_set_data(sqe, connection);
+    }
+
+    void add_send(Connection* connection)
+    {
+        io_uring_sqe* sqe = m_ring.get_sqe();
+        io_uring_prep_send(sqe, connection->fd, connection->buffer.data() + connection->offset,
+                           connection->size - connection->offset, MSG_NOSIGNAL);
+        io_uring_sqe_set_data(sqe, connection);
+    }
+
+    void handle(std::uint64_t user_data, int res)
+    {
+        if (user_data == ACCEPT_IPV4_USER_DATA || user_data == ACCEPT_IPV6_USER_DATA)
+        {
+            this->add_accept(user_data == ACCEPT_IPV4_USER_DATA ? m_ipv4_fd : m_ipv6_fd, user_data);
+            if (res >= 0)
+            {
+                auto* connection = new Connection;
+                connection->fd = res;
+                this->add_recv(connection);
+            }
+            return;
+        }
+
+        // a connection has exactly one request in flight, a recv or a send
+        auto* connection = reinterpret_cast<Connection*>(user_data);
+        if (res <= 0)
+        {
+            ::close(connection->fd);
+            delete connection;
+            return;
+        }
+        if (connection->size == 0)
+        {
+            connection->size = static_cast<unsigned>(res);
+            connection->offset = 0;
+        }
+        else
+        {
+            connection->offset += static_cast<unsigned>(res);
+        }
+        if (connection->offset == connection->size)
+        {
+            connection->size = 0;
+            this->add_recv(connection);
+        }
+        else
+        {
+            this->add_send(connection);
+        }
+    }
+
+    Ring m_ring;
+    int m_ipv4_fd = -1;
+    int m_ipv6_fd = -1;
+    in_port_t m_port = 0;
+};
+
+// Drives connections_count / threads_count client connections over one io_uring
+class LoadGenerator
+{
+public:
+    LoadGenerator(const Options& options, in_port_t destination_port, unsigned connections_count,
+                  WorkerResult& result)
+        : m_options(options)
+        , m_connections(connections_count)
+        , m_payload(options.payload_size, 0x5A)
+        , m_result(result)
+        , m_ring(connections_count)
+    {
+        // +-----+-----+-------+------+----------+----------+
+        // | VER | CMD |  RSV  | ATYP | DST.ADDR | DST.PORT |
+        // +-----+-----+-------+------+----------+----------+
+        m_request = { 0x05, 0x01, 0x00 };
+        switch (options.address_type)
+        {
+        case AddressType::IPV4:
+        {
+            in_addr address = { ::htonl(INADDR_LOOPBACK) };
+            m_request.push_back(0x01);
+            m_request.insert(m_request.end(), reinterpret_cast<const unsigned char*>(&address),
+                             reinterpret_cast<const unsigned char*>(&address) + sizeof(address));
+            m_reply_size = 10;
+            break;
+        }
+        case AddressType::IPV6:
+            m_request.push_back(0x04);
+            m_request.insert(m_request.end(), in6addr_loopback.s6_addr, in6addr_loopback.s6_addr + 16);
+            m_reply_size = 22;
+            break;
+        case AddressType::DOMAIN_NAME:
+        {
+            // answered from /etc/hosts by the server
+            const std::string name = "localhost";
+            m_request.push_back(0x03);
+            m_request.push_back(static_cast<unsigned char>(name.size()));
+            m_request.insert(m_request.end(), name.begin(), name.end());
+            m_reply_size = 10;  // the server connects to the resolved IPv4 address
+            break;
+        }
+        }
+        m_request.insert(m_request.end(), reinterpret_cast<const unsigned char*>(&destination_port),
+                         reinterpret_cast<const unsigned char*>(&destination_port) + sizeof(destination_port));
+
+        std::size_t buffer_size = std::max<std::size_t>(options.payload_size, m_reply_size);
+        if (options.optimistic)
+        {
+            m_optimistic_message.assign(std::begin(GREETING), std::end(GREETING));
+            m_optimistic_message.insert(m_optimistic_message.end(), m_request.begin(), m_request.end());
+            m_optimistic_message.insert(m_optimistic_message.end(), m_payload.begin(), m_payload.end());
+            // the method, the reply and the echo arrive back to back
+            buffer_size = 2 + m_reply_size + options.payload_size;
+        }
+        for (Connection& connection : m_connections)
+        {
+            connection.buffer.resize(buffer_size);
+        }
+        if (m_options.rate > 0)
+        {
+            m_start_interval = std::chrono::duration_cast<clock_type::duration>(
+                std::chrono::duration<double>(static_cast<double>(m_options.threads_count) / m_options.rate));
+        }
+    }
+
+    ~LoadGenerator()
+    {
+        for (Connection& connection : m_connections)
+        {
+            if (connection.fd != -1)
+            {
+                ::close(connection.fd);
+            }
+        }
+    }
+
+    void run(const std::atomic<bool>& stop)
+    {
+        m_next_start = clock_type::now();
+        for (unsigned i = 0; i < m_connections.size(); ++i)
+        {
+            this->schedule_start(i);
+        }
+        while (!stop.load(std::memory_order_relaxed))
+        {
+            m_ring.process_completions([this](std::uint64_t user_data, int res)
+            {
+                this->handle(static_cast<unsigned>(user_data), res);
+            });
+        }
+    }
+
+private:
+    enum class State
+    {
+        WAITING,
+        CONNECTING,
+        SENDING_GREETING,
+        RECEIVING_METHOD,
+        SENDING_REQUEST,
+        RECEIVING_REPLY,
+        SENDING_PAYLOAD,
+        RECEIVING_ECHO,
+        SENDING_OPTIMISTIC,    // greeting, request and first payload
+        RECEIVING_OPTIMISTIC,  // method, reply and first echo
+    };
+
+    static constexpr unsigned char GREETING[] = { 0x05, 0x01, 0x00 };  // version 5, one method: no auth
+
+    struct Connection
+    {
+        int fd = -1;
+        State state = State::WAITING;
+        unsigned offset = 0;  // of the message being sent or received
+        unsigned requests_done = 0;
+        clock_type::time_point handshake_start;
+        clock_type::time_point request_start;
+        __kernel_timespec start_time;
+        std::vector<unsigned char> buffer;
+    };
+
+    void schedule_start(unsigned index)
+    {
+        Connection& connection = m_connections[index];
+        connection.state = State::WAITING;
+        if (m_start_interval == clock_type::duration::zero())
+        {
+            this->start(index);
+            return;
+        }
+        // paced: the absolute start time of this connection is taken from the common schedule
+        m_next_start = std::max(m_next_start + m_start_interval, clock_type::now());
+        auto since_epoch = std::chrono::duration_cast<std::chrono::nanoseconds>(m_next_start.time_since_epoch());
+        connection.start_time.tv_sec = since_epoch.count() / 1'000'000'000;
+        connection.start_time.tv_nsec = since_epoch.count() % 1'000'000'000;
+        io_uring_sqe* sqe = m_ring.get_sqe();
+        io_uring_prep_timeout(sqe, &connection.start_time, 0, IORING_TIMEOUT_ABS);
+        io_uring_sqe_set_data64(sqe, index);
+    }
+
+    void start(unsigned index)
+    {
+        Connection& connection = m_connections[index];
+        connection.fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        if (connection.fd == -1)
+        {
+            this->fail(index);
+            return;
+        }
+        // reset instead of FIN, otherwise TIME_WAIT sockets exhaust ephemeral ports within seconds
+        linger reset_on_close = { .l_onoff = 1, .l_linger = 0 };
+        ::setsockopt(connection.fd, SOL_SOCKET, SO_LINGER, &reset_on_close, sizeof(reset_on_close));
+        int one = 1;
+        ::setsockopt(connection.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (m_options.fast_open)
+        {
+            // connect completes at once and the first send goes out with the SYN
+            ::setsockopt(connection.fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &one, sizeof(one));
+        }
+
+        connection.state = State::CONNECTING;
+        connection.handshake_start = clock_type::now();
+        io_uring_sqe* sqe = m_ring.get_sqe();
+        io_uring_prep_connect(sqe, connection.fd, reinterpret_cast<const sockaddr*>(&m_options.proxy),
+                              sizeof(m_options.proxy));
+        io_uring_sqe_set_data64(sqe, index);
+    }
+
+    void send(unsigned index, State state, const unsigned char* data, unsigned size)
+    {
+        Connection& connection = m_connections[index];
+        if (connection.state != state)
+        {
+            connection.state = state;
+            connection.offset = 0;
+        }
+        io_uring_sqe* sqe = m_ring.get_sqe();
+        io_uring_prep_send(sqe, connection.fd, data + connection.offset, size - connection.offset, MSG_NOSIGNAL);
+        io_uring_sqe_set_data64(sqe, index);
+    }
+
+    void receive(unsigned index, State state, unsigned size)
+    {
+        Connection& connection = m_connections[index];
+        if (connection.state != state)
+        {
+            connection.state = state;
+            connection.offset = 0;
+        }
+        io_uring_sqe* sqe = m_ring.get_sqe();
+        io_uring_prep_recv(sqe, connection.fd, connection.buffer.data() + connection.offset,
+                           size - connection.offset, 0);
+        io_uring_sqe_set_data64(sqe, index);
+    }
+
+    void send_payload(unsigned index)
+    {
+        m_connections[index].request_start = clock_type::now();
+        this->send(index, State::SENDING_PAYLOAD, m_payload.data(), m_options.payload_size);
+    }
+
+    void fail(unsigned index)
+    {
+        ++m_result.failures;
+        this->finish(index);
+    }
+
+    void finish(unsigned index)
+    {
+        Connection& connection = m_connections[index];
+        if (connection.fd != -1)
+        {
+            ::close(connection.fd);
+            connection.fd = -1;
+        }
+        this->schedule_start(index);
+    }
+
+    // returns true once the whole message of size bytes went through
+    bool advance(Connection& connection, int res, unsigned size)
+    {
+        connection.offset += static_cast<unsigned>(res);
+        return connection.offset == size;
+    }
+
+    void handle(unsigned index, int res)
+    {
+        Connection& connection = m_connections[index];
+        if (connection.state == State::WAITING)
+        {
+            this->start(index);  // the pacing timeout expired
+            return;
+        }
+        bool is_receive = connection.state == State::RECEIVING_METHOD || connection.state == State::RECEIVING_REPLY
+            || connection.state == State::RECEIVING_ECHO || connection.state == State::RECEIVING_OPTIMISTIC;
+        if (res < 0 || (res == 0 && is_receive))
+        {
+            this->fail(index);
+            return;
+        }
+
+        auto optimistic_size = static_cast<unsigned>(m_optimistic_message.size());
+        unsigned optimistic_reply_size = 2 + m_reply_size + m_options.payload_size;
+        switch (connection.state)
+        {
+        case State::WAITING:
+            break;
+        case State::CONNECTING:
+            if (m_options.optimistic)
+                this->send(index, State::SENDING_OPTIMISTIC, m_optimistic_message.data(), optimistic_size);
+            else
+                this->send(index, State::SENDING_GREETING, GREETING, sizeof(GREETING));
+            break;
+        case State::SENDING_GREETING:
+            if (this->advance(connection, res, sizeof(GREETING)))
+                this->receive(index, State::RECEIVING_METHOD, 2);
+            else
+                this->send(index, State::SENDING_GREETING, GREETING, sizeof(GREETING));
+            break;
+        case State::RECEIVING_METHOD:
+            if (!this->advance(connection, res, 2))
+            {
+                this->receive(index, State::RECEIVING_METHOD, 2);
+            }
+            else if (connection.buffer[1] != 0x00)
+            {
+                this->fail(index);
+            }
+            else
+            {
+                this->send(index, State::SENDING_REQUEST, m_request.data(), static_cast<unsigned>(m_request.size()));
+            }
+            break;
+        case State::SENDING_REQUEST:
+            if (this->advance(connection, res, static_cast<unsigned>(m_request.size())))
+                this->receive(index, State::RECEIVING_REPLY, m_reply_size);
+            else
+                this->send(index, State::SENDING_REQUEST, m_request.data(), static_cast<unsigned>(m_request.size()));
+            break;
+        case State::RECEIVING_REPLY:
+            if (!this->advance(connection, res, m_reply_size))
+            {
+                this->receive(index, State::RECEIVING_REPLY, m_reply_size);
+            }
+            else if (connection.buffer[1] != 0x00)
+            {
+                this->fail(index);
+            }
+            else
+            {
+                m_result.handshake_latencies_us.push_back(elapsed_us(connection.handshake_start));
+                connection.requests_done = 0;
+                this->next_request(index);
+            }
+            break;
+        case State::SENDING_PAYLOAD:
+            if (this->advance(connection, res, m_options.payload_size))
+                this->receive(index, State::RECEIVING_ECHO, m_options.payload_size);
+            else
+                this->send(index, State::SENDING_PAYLOAD, m_payload.data(), m_options.payload_size);
+            break;
+        case State::RECEIVING_ECHO:
+            if (!this->advance(connection, res, m_options.payload_size))
+            {
+                this->receive(index, State::RECEIVING_ECHO, m_options.payload_size);
+                break;
+            }
+            m_result.relay_latencies_us.push_back(elapsed_us(connection.request_start));
+            m_result.relayed_bytes += 2 * static_cast<std::uint64_t>(m_options.payload_size);
+            ++connection.requests_done;
+            this->next_request(index);
+            break;
+        case State::SENDING_OPTIMISTIC:
+            if (this->advance(connection, res, optimistic_size))
+                this->receive(index, State::RECEIVING_OPTIMISTIC, optimistic_reply_size);
+            else
+                this->send(index, State::SENDING_OPTIMISTIC, m_optimistic_message.data(), optimistic_size);
+            break;
+        case State::RECEIVING_OPTIMISTIC:
+        {
+            unsigned replies_size = 2 + m_reply_size;
+            bool had_replies = connection.offset >= replies_size;
+            bool had_echo = connection.offset > replies_size;
+            this->advance(connection, res, optimistic_reply_size);
+            if (!had_replies && connection.offset >= replies_size)
+            {
+                if (connection.buffer[1] != 0x00 || connection.buffer[3] != 0x00)
+                {
+                    this->fail(index);
+                    break;
+                }
+                m_result.handshake_latencies_us.push_back(elapsed_us(connection.handshake_start));
+            }
+            if (!had_echo && connection.offset > replies_size)
+            {
+                m_result.first_byte_latencies_us.push_back(elapsed_us(connection.handshake_start));
+            }
+            if (connection.offset != optimistic_reply_size)
+            {
+                this->receive(index, State::RECEIVING_OPTIMISTIC, optimistic_reply_size);
+                break;
+            }
+            m_result.relayed_bytes += 2 * static_cast<std::uint64_t>(m_options.payload_size);
+            connection.requests_done = 1;
+            this->next_request(index);
+            break;
+        }
+        }
+    }
+
+    void next_request(unsigned index)
+    {
+        if (m_connections[index].requests_done == m_options.requests_count || m_options.payload_size == 0)
+        {
+            ++m_result.connections;
+            this->finish(index);
+            return;
+        }
+        this->send_payload(index);
+    }
+
+    const Options& m_options;
+    std::vector<Connection> m_connections;
+    std::vector<unsigned char> m_request;
+    unsigned m_reply_size = 0;
+    const std::vector<unsigned char> m_payload;
+    std::vector<unsigned char> m_optimistic_message;
+    WorkerResult& m_result;
+    clock_type::duration m_start_interval = clock_type::duration::zero();
+    clock_type::time_point m_next_start;
+    // destroyed first, so that no request refers to the buffers above afterwards
+    Ring m_ring;
+};
+
+std::uint32_t percentile(const std::vector<std::uint32_t>& sorted, double p)
+{
+    if (sorted.empty())
+    {
+        return 0;
+    }
+    auto index = static_cast<std::size_t>(p * static_cast<double>(sorted.size() - 1));
+    return sorted[index];
+}
+
+void print_latencies(const char* name, std::vector<std::uint32_t>& latencies_us)
+{
+    std::sort(latencies_us.begin(), latencies_us.end());
+    std::printf("%s p50/p99/p999: %u/%u/%u us (%zu samples)\n", name, percentile(latencies_us, 0.50),
+                percentile(latencies_us, 0.99), percentile(latencies_us, 0.999), latencies_us.size());
+}
+
+}  // namespace
+
+int main(int argc, char* argv[])
+{
+    Options options;
+    std::string host;
+    try
+    {
+        TCLAP::CmdLine cmd("End-to-end load generator for the SOCKS5 server", ' ', "0.1");
+
+        TCLAP::ValueArg<std::string> host_arg(
+            /* short flag */    "a",
+            /* long flag */     "address",
+            /* description */   "IPv4 address of the server",
+            /* required */      false,
+            /* default */       "127.0.0.1",
+            /* type info */     "string"
+        );
+        cmd.add(host_arg);
+
+        TCLAP::ValueArg<in_port_t> port_arg(
+            /* short flag */    "p",
+            /* long flag */     "port",
+            /* description */   "Port of the server",
+            /* required */      true,
+            /* default */       0,
+            /* type info */     "int"
+        );
+        cmd.add(port_arg);
+
+        TCLAP::ValueArg<unsigned> connections_count_arg(
+            /* short flag */    "c",
+            /* long flag */     "connections",
+            /* description */   "Count of concurrent connections",
+            /* required */      false,
+            /* default */       64,
+            /* type info */     "int"
+        );
+        cmd.add(connections_count_arg);
+
+        TCLAP::ValueArg<unsigned> threads_count_arg(
+            /* short flag */    "t",
+            /* long flag */     "threads",
+            /* description */   "Count of load generating threads, connections are split between them",
+            /* required */      false,
+            /* default */       1,
+            /* type info */     "int"
+        );
+        cmd.add(threads_count_arg);
+
+        TCLAP::ValueArg<unsigned> duration_arg(
+            /* short flag */    "d",
+            /* long flag */     "duration",
+            /* description */   "Benchmark duration in seconds",
+            /* required */      false,
+            /* default */       10,
+            /* type info */     "int"
+        );
+        cmd.add(duration_arg);
+
+        TCLAP::ValueArg<unsigned> payload_size_arg(
+            /* short flag */    "s",
+            /* long flag */     "payload_size",
+            /* description */   "Size of a payload echoed by the destination (0 for handshakes only)",
+            /* required */      false,
+            /* default */       1024,
+            /* type info */     "int"
+        );
+        cmd.add(payload_size_arg);
+
+        TCLAP::ValueArg<unsigned> requests_count_arg(
+            /* short flag */    "n",
+            /* long flag */     "requests",
+            /* description */   "Count of payloads sent over a connection before it is replaced",
+            /* required */      false,
+            /* default */       10,
+            /* type info */     "int"
+        );
+        cmd.add(requests_count_arg);
+
+        TCLAP::ValueArg<double> rate_arg(
+            /* short flag */    "r",
+            /* long flag */     "rate",
+            /* description */   "New connections per second (0 opens them as fast as the old ones finish)",
+            /* required */      false,
+            /* default */       0.0,
+            /* type info */     "float"
+        );
+        cmd.add(rate_arg);
+
+        std::vector<std::string> address_types = { "ipv4", "ipv6", "domain" };
+        TCLAP::ValuesConstraint<std::string> address_type_constraint(address_types);
+        TCLAP::ValueArg<std::string> address_type_arg(
+            /* short flag */    "T",
+            /* long flag */     "address_type",
+            /* description */   "Address of the destination in CONNECT requests: 127.0.0.1, ::1 or localhost",
+            /* required */      false,
+            /* default */       "ipv4",
+            /* constraint */    &address_type_constraint
+        );
+        cmd.add(address_type_arg);
+
+        TCLAP::SwitchArg optimistic_arg(
+            /* short flag */    "o",
+            /* long flag */     "optimistic",
+            /* description */   "Send the greeting, the request and the first payload at once and report time to first byte",
+            /* default */       false
+        );
+        cmd.add(optimistic_arg);
+
+        TCLAP::SwitchArg fast_open_arg(
+            /* short flag */    "F",
+            /* long flag */     "fast_open",
+            /* description */   "Connect to the server with TCP Fast Open and accept it on the echo server",
+            /* default */       false
+        );
+        cmd.add(fast_open_arg);
+
+        cmd.parse(argc, argv);
+        host = host_arg.getValue();
+        options.proxy = {};
+        options.proxy.sin_family = AF_INET;
+        options.proxy.sin_port = ::htons(port_arg.getValue());
+        options.threads_count = std::max(threads_count_arg.getValue(), 1u);
+        options.connections_count = std::max(connections_count_arg.getValue(), options.threads_count);
+        options.duration_seconds = duration_arg.getValue();
+        options.payload_size = payload_size_arg.getValue();
+        options.requests_count = std::max(requests_count_arg.getValue(), 1u);
+        options.rate = std::max(rate_arg.getValue(), 0.0);
+        options.address_type = AddressType::IPV4;
+        if (address_type_arg.getValue() == "ipv6")
+            options.address_type = AddressType::IPV6;
+        else if (address_type_arg.getValue() == "domain")
+            options.address_type = AddressType::DOMAIN_NAME;
+        options.optimistic = optimistic_arg.getValue();
+        options.fast_open = fast_open_arg.getValue();
+    }
+    catch (TCLAP::ArgException& e)
+    {
+        std::fprintf(stderr, "Parsing command line arguments failed: '%s' for arg %s\n",
+                     e.error().c_str(), e.argId().c_str());
+        return EXIT_FAILURE;
+    }
+
+    if (::inet_pton(AF_INET, host.c_str(), &options.proxy.sin_addr) != 1)
+    {
+        std::fprintf(stderr, "Invalid IPv4 address '%s'\n", host.c_str());
+        return EXIT_FAILURE;
+    }
+    if (options.optimistic && options.payload_size == 0)
+    {
+        std::fprintf(stderr, "Optimistic connections need a payload\n");
+        return EXIT_FAILURE;
+    }
+
+    std::atomic<bool> stop = false;
+    std::atomic<bool> echo_stop = false;
+    std::vector<WorkerResult> results(options.threads_count);
+    std::vector<std::thread> threads;
+    try
+    {
+        auto echo_server = std::make_unique<EchoServer>(options.connections_count, options.fast_open);
+        if (options.address_type == AddressType::IPV6 && !echo_server->has_ipv6())
+        {
+            std::fprintf(stderr, "Cannot listen on ::1\n");
+            return EXIT_FAILURE;
+        }
+        std::thread echo_thread([&echo_server, &echo_stop]() { echo_server->run(echo_stop); });
+
+        clock_type::time_point start = clock_type::now();
+        for (unsigned i = 0; i < options.threads_count; ++i)
+        {
+            unsigned connections_count = options.connections_count / options.threads_count
+                + (i < options.connections_count % options.threads_count ? 1 : 0);
+            threads.emplace_back([&options, &echo_server, connections_count, &result = results[i], &stop]()
+            {
+                LoadGenerator generator(options, echo_server->port(), connections_count, result);
+                generator.run(stop);
+            });
+        }
+        std::this_thread::sleep_for(std::chrono::seconds(options.duration_seconds));
+        stop = true;
+        for (std::thread& thread : threads)
+        {
+            thread.join();
+        }
+        std::chrono::duration<double> elapsed = clock_type::now() - start;
+        echo_stop = true;
+        echo_thread.join();
+
+        WorkerResult total;
+        for (WorkerResult& result : results)
+        {
+            total.connections += result.connections;
+            total.failures += result.failures;
+            total.relayed_bytes += result.relayed_bytes;
+            total.handshake_latencies_us.insert(total.handshake_latencies_us.end(),
+                                                result.handshake_latencies_us.begin(),
+                                                result.handshake_latencies_us.end());
+            total.relay_latencies_us.insert(total.relay_latencies_us.end(), result.relay_latencies_us.begin(),
+                                            result.relay_latencies_us.end());
+            total.first_byte_latencies_us.insert(total.first_byte_latencies_us.end(),
+                                                 result.first_byte_latencies_us.begin(),
+                                                 result.first_byte_latencies_us.end());
+        }
+
+        double seconds = elapsed.count();
+        std::printf("connections:   %u concurrent, %llu completed, %llu failed\n", options.connections_count,
+                    static_cast<unsigned long long>(total.connections), static_cast<unsigned long long>(total.failures));
+        std::printf("connections/s: %.0f\n", static_cast<double>(total.connections) / seconds);
+        std::printf("handshakes/s:  %.0f\n", static_cast<double>(total.handshake_latencies_us.size()) / seconds);
+        std::printf("throughput:    %.3f Gbit/s (%.0f payloads/s)\n",
+                    static_cast<double>(total.relayed_bytes) * 8.0 / seconds / 1e9,
+                    static_cast<double>(total.relay_latencies_us.size()) / seconds);
+        print_latencies("handshake", total.handshake_latencies_us);
+        print_latencies("relay    ", total.relay_latencies_us);
+        if (options.optimistic)
+        {
+            print_latencies("first byte", total.first_byte_latencies_us);
+        }
+    }
+    catch (const std::exception& e)
+    {
+        std::fprintf(stderr, "%s\n", e.what());
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,118 @@
+// Throughput of log-heavy event loops: the per-CQE debug line of Session logged through a
+// synchronous spdlog logger and through AsyncLogger, from one and from several threads. Both
+// write to a null sink, so the numbers are the cost paid by the logging thread itself; the
+// mutex of the synchronous sink is what several threads contend on.
+//
+// AsyncLogger is fed in bursts which fit its rings, the backend catches up between them with
+// the timer paused. A sustained rate above what the backend formats would only measure drops.
+
+#include <async_logger.hpp>
+
+#include <benchmark/benchmark.h>
+
+#include <spdlog/sinks/null_sink.h>
+
+#include <memory>
+
+namespace bm = benchmark;
+
+namespace
+{
+
+std::shared_ptr<spdlog::logger> make_null_logger()
+{
+    auto logger = std::make_shared<spdlog::logger>("null", std::make_shared<spdlog::sinks::null_sink_mt>());
+    logger->set_level(spdlog::level::debug);
+    logger->set_pattern("[%Y-%m-%d %H:%M:%S.%e] [tid %t] [%l] %v");
+    return logger;
+}
+
+void spdlog_sync(bm::State& state)
+{
+    static std::shared_ptr<spdlog::logger> logger = make_null_logger();
+    unsigned nread = 0;
+    for (auto _ : state)  // NOLINT clang-analyzer-deadcode.DeadStores
+    {
+        logger->debug("CQE: read from client, nread = {}", ++nread);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(spdlog_sync)->Threads(1)->Threads(4);  // NOLINT cert-err58-cpp
+
+constexpr unsigned BURST_SIZE = hw2::AsyncLogger::RING_CAPACITY / 2;
+
+void async_logger(bm::State& state)
+{
+    static hw2::AsyncLogger logger(make_null_logger());
+    std::uint64_t dropped_before = logger.dropped_count();
+    unsigned nread = 0;
+    for (auto _ : state)  // NOLINT clang-analyzer-deadcode.DeadStores
+    {
+        for (unsigned i = 0; i < BURST_SIZE; ++i)
+        {
+            logger.log(spdlog::level::debug, "CQE: read from client, nread = {}", ++nread);
+        }
+        state.PauseTiming();
+        logger.flush();
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * BURST_SIZE);
+    if (state.thread_index() == 0)
+    {
+        // expected to stay 0, otherwise the bursts do not fit the rings
+        state.counters["dropped"] = static_cast<double>(logger.dropped_count() - dropped_before);
+    }
+}
+BENCHMARK(async_logger)->Threads(1)->Threads(4);  // NOLINT cert-err58-cpp
+
+void async_logger_strings(bm::State& state)
+{
+    static hw2::AsyncLogger logger(make_null_logger());
+    std::string_view name = "example.com";
+    for (auto _ : state)  // NOLINT clang-analyzer-deadcode.DeadStores
+    {
+        for (unsigned i = 0; i < BURST_SIZE; ++i)
+        {
+            logger.log(spdlog::level::info, "Got domain name {0}, port {1}", name, 443);
+        }
+        state.PauseTiming();
+        logger.flush();
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * BURST_SIZE);
+}
+BENCHMARK(async_logger_strings);  // NOLINT cert-err58-cpp
+
+// the producer cost together with formatting on the backend, i.e. total CPU per record
+void async_logger_end_to_end(bm::State& state)
+{
+    static hw2::AsyncLogger logger(make_null_logger());
+    unsigned nread = 0;
+    for (auto _ : state)  // NOLINT clang-analyzer-deadcode.DeadStores
+    {
+        for (unsigned i = 0; i < BURST_SIZE; ++i)
+        {
+            logger.log(spdlog::level::debug, "CQE: read from client, nread = {}", ++nread);
+        }
+        logger.flush();
+    }
+    state.SetItemsProcessed(state.iterations() * BURST_SIZE);
+}
+BENCHMARK(async_logger_end_to_end);  // NOLINT cert-err58-cpp
+
+// below HW2_LOG_ACTIVE_LEVEL in every build, so nothing is left of the call
+void compiled_out(bm::State& state)
+{
+    unsigned nread = 0;
+    for (auto _ : state)  // NOLINT clang-analyzer-deadcode.DeadStores
+    {
+        HW2_LOG(SPDLOG_LEVEL_TRACE, "CQE: read from client, nread = {}", ++nread);
+        bm::DoNotOptimize(nread);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(compiled_out);  // NOLINT cert-err58-cpp
+
+}  // namespace
+
+BENCHMARK_MAIN();
@@ -0,0 +1,161 @@
+// Microbenchmarks of the SOCKS5 handshake parser. Messages are parsed the way a Session
+// does it: from the bytes buffered so far, consuming every complete message.
+
+#include <socks5_parser.hpp>
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace bm = benchmark;
+
+namespace
+{
+
+using hw2::byte_t;
+using hw2::Socks5Parser;
+
+// greeting offering no auth, then CONNECT to 93.184.216.34:80
+const std::vector<byte_t> IPV4_HANDSHAKE = {
+    0x05, 0x01, 0x00,
+    0x05, 0x01, 0x00, 0x01, 93, 184, 216, 34, 0x00, 0x50,
+};
+
+// greeting offering two methods, then CONNECT to example.com:443
+const std::vector<byte_t> DOMAIN_NAME_HANDSHAKE = {
+    0x05, 0x02, 0x02, 0x00,
+    0x05, 0x01, 0x00, 0x03, 11, 'e', 'x', 'a', 'm', 'p', 'l', 'e', '.', 'c', 'o', 'm', 0x01, 0xBB,
+};
+
+// parses a handshake which arrives in chunks of chunk_size bytes, returns false on failure
+bool parse_handshake(const std::vector<byte_t>& handshake, std::size_t chunk_size)
+{
+    Socks5Parser parser;
+    byte_t buffer[Socks5Parser::MAX_GREETING_SIZE + Socks5Parser::MAX_REQUEST_SIZE];
+    std::size_t buffered = 0;
+    std::size_t received = 0;
+    while (received < handshake.size())
+    {
+        std::size_t nread = std::min(chunk_size, handshake.size() - received);
+        std::memcpy(buffer + buffered, handshake.data() + received, nread);
+        buffered += nread;
+        received += nread;
+        for (;;)
+        {
+            Socks5Parser::Result result = parser.parse({ buffer, buffered });
+            if (result == Socks5Parser::Result::INCOMPLETE)
+                break;
+            if (result != Socks5Parser::Result::GREETING && result != Socks5Parser::Result::REQUEST)
+                return false;
+            buffered -= parser.consumed();
+            std::memmove(buffer, buffer + parser.consumed(), buffered);
+            if (result == Socks5Parser::Result::REQUEST)
+                return true;
+        }
+    }
+    return false;
+}
+
+// the previous approach for comparison: every read is appended to a vector which is erased
+// from the front, completion of a step is checked by a std::function
+bool parse_handshake_with_vector(const std::vector<byte_t>& handshake, std::size_t chunk_size)
+{
+    std::vector<byte_t> read_buffer;
+    std::function<bool()> is_read_completed;
+    std::size_t received = 0;
+    auto read_some = [&](std::size_t n)
+    {
+        is_read_completed = [n, &read_buffer](){ return read_buffer.size() >= n; };
+        while (!is_read_completed() && received < handshake.size())
+        {
+            std::size_t nread = std::min(chunk_size, handshake.size() - received);
+            read_buffer.insert(read_buffer.end(), handshake.data() + received, handshake.data() + received + nread);
+            received += nread;
+        }
+        return is_read_completed();
+    };
+    auto consume = [&](std::size_t n)
+    {
+        read_buffer.erase(read_buffer.begin(), read_buffer.begin() + static_cast<std::ptrdiff_t>(n));
+    };
+
+    if (!read_some(2) || read_buffer[0] != 0x05)
+        return false;
+    std::size_t methods_count = read_buffer[1];
+    consume(2);
+    if (!read_some(methods_count))
+        return false;
+    consume(methods_count);
+    if (!read_some(4))
+        return false;
+    byte_t address_type = read_buffer[3];
+    consume(4);
+    std::size_t address_size = 4;
+    if (address_type == 0x03)
+    {
+        if (!read_some(1))
+            return false;
+        address_size = read_buffer[0];
+        consume(1);
+    }
+    if (!read_some(address_size + 2))
+        return false;
+    std::string domain_name(read_buffer.begin(), read_buffer.begin() + static_cast<std::ptrdiff_t>(address_size));
+    bm::DoNotOptimize(domain_name);
+    consume(address_size + 2);
+    return true;
+}
+
+void parser_pipelined_ipv4(bm::State& state)
+{
+    for (auto _ : state)  // NOLINT clang-analyzer-deadcode.DeadStores
+    {
+        bm::DoNotOptimize(parse_handshake(IPV4_HANDSHAKE, IPV4_HANDSHAKE.size()));
+    }
+}
+BENCHMARK(parser_pipelined_ipv4);  // NOLINT cert-err58-cpp
+
+void parser_pipelined_domain_name(bm::State& state)
+{
+    for (auto _ : state)  // NOLINT clang-analyzer-deadcode.DeadStores
+    {
+        bm::DoNotOptimize(parse_handshake(DOMAIN_NAME_HANDSHAKE, DOMAIN_NAME_HANDSHAKE.size()));
+    }
+}
+BENCHMARK(parser_pipelined_domain_name);  // NOLINT cert-err58-cpp
+
+void parser_byte_by_byte_domain_name(bm::State& state)
+{
+    for (auto _ : state)  // NOLINT clang-analyzer-deadcode.DeadStores
+    {
+        bm::DoNotOptimize(parse_handshake(DOMAIN_NAME_HANDSHAKE, 1));
+    }
+}
+BENCHMARK(parser_byte_by_byte_domain_name);  // NOLINT cert-err58-cpp
+
+void vector_pipelined_ipv4(bm::State& state)
+{
+    for (auto _ : state)  // NOLINT clang-analyzer-deadcode.DeadStores
+    {
+        bm::DoNotOptimize(parse_handshake_with_vector(IPV4_HANDSHAKE, IPV4_HANDSHAKE.size()));
+    }
+}
+BENCHMARK(vector_pipelined_ipv4);  // NOLINT cert-err58-cpp
+
+void vector_pipelined_domain_name(bm::State& state)
+{
+    for (auto _ : state)  // NOLINT clang-analyzer-deadcode.DeadStores
+    {
+        bm::DoNotOptimize(parse_handshake_with_vector(DOMAIN_NAME_HANDSHAKE, DOMAIN_NAME_HANDSHAKE.size()));
+    }
+}
+BENCHMARK(vector_pipelined_domain_name);  // NOLINT cert-err58-cpp
+
+}  // namespace
+
+BENCHMARK_MAIN();
@@ -0,0 +1,220 @@
+#include <async_logger.hpp>
+
+#include <spdlog/details/log_msg.h>
+
+#if defined(SPDLOG_FMT_EXTERNAL)
+#include <fmt/args.h>
+#else
+#include <spdlog/fmt/bundled/args.h>
+#endif
+
+#include <algorithm>
+#include <cstdlib>
+
+namespace hw2
+{
+
+namespace
+{
+
+std::atomic<std::uint64_t> g_next_logger_id = 1;
+
+}  // namespace
+
+thread_local std::uint64_t AsyncLogger::t_ring_owner = 0;
+thread_local AsyncLogger::Ring* AsyncLogger::t_ring = nullptr;
+
+AsyncLogger::AsyncLogger(std::shared_ptr<spdlog::logger> target)
+    : m_id(g_next_logger_id.fetch_add(1, std::memory_order_relaxed))
+    , m_target(std::move(target))
+    , m_thread(&AsyncLogger::run, this)
+{
+}
+
+AsyncLogger::~AsyncLogger()
+{
+    m_stop = true;
+    m_thread.join();
+    this->flush();
+}
+
+void AsyncLogger::flush()
+{
+    while (this->drain())
+    {
+    }
+}
+
+std::uint64_t AsyncLogger::dropped_count() const
+{
+    std::lock_guard<std::mutex> lock(m_rings_mutex);
+    std::uint64_t count = 0;
+    for (const std::unique_ptr<Ring>& ring : m_rings)
+    {
+        count += ring->dropped.load(std::memory_order_relaxed);
+    }
+    return count;
+}
+
+AsyncLogger::Ring& AsyncLogger::thread_ring()
+{
+    if (LIKELY(t_ring_owner == m_id))
+    {
+        return *t_ring;
+    }
+    // first record of this thread, rings live as long as the logger
+    std::lock_guard<std::mutex> lock(m_rings_mutex);
+    t_ring = m_rings.emplace_back(std::make_unique<Ring>()).get();
+    t_ring_owner = m_id;
+    return *t_ring;
+}
+
+AsyncLogger::Record* AsyncLogger::begin_record()
+{
+    Ring& ring = this->thread_ring();
+    std::uint64_t head = ring.head.load(std::memory_order_relaxed);
+    if (head - ring.cached_tail == RING_CAPACITY)
+    {
+        ring.cached_tail = ring.tail.load(std::memory_order_acquire);
+        if (head - ring.cached_tail == RING_CAPACITY)
+        {
+            ring.dropped.store(ring.dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+    }
+    return &ring.records[head % RING_CAPACITY];
+}
+
+void AsyncLogger::commit_record()
+{
+    t_ring->head.store(t_ring->head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+void AsyncLogger::store_text(Record& record, Arg& arg, std::string_view text)
+{
+    // truncated to what is left of the record
+    std::size_t size = std::min({ text.size(), TEXT_CAPACITY - record.text_size, std::size_t{ UINT8_MAX } });
+    std::memcpy(record.text.data() + record.text_size, text.data(), size);
+    arg.type = ArgType::TEXT;
+    arg.text_offset = record.text_size;
+    arg.text_size = static_cast<std::uint8_t>(size);
+    record.text_size = static_cast<std::uint16_t>(record.text_size + size);
+}
+
+void AsyncLogger::run()
+{
+    // polling keeps producers free of wakeup syscalls, the interval bounds the logging delay
+    while (!m_stop.load(std::memory_order_relaxed))
+    {
+        if (!this->drain())
+        {
+            std::this_thread::sleep_for(POLL_INTERVAL);
+        }
+    }
+}
+
+bool AsyncLogger::drain()
+{
+    std::lock_guard<std::mutex> consumer_lock(m_consumer_mutex);
+    std::vector<Ring*> rings;
+    {
+        std::lock_guard<std::mutex> lock(m_rings_mutex);
+        rings.reserve(m_rings.size());
+        for (const std::unique_ptr<Ring>& ring : m_rings)
+        {
+            rings.push_back(ring.get());
+        }
+    }
+
+    bool drained = false;
+    for (Ring* ring : rings)
+    {
+        std::uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+        std::uint64_t head = ring->head.load(std::memory_order_acquire);
+        if (tail != head)
+        {
+            for (; tail != head; ++tail)
+            {
+                this->emit(ring->records[tail % RING_CAPACITY]);
+            }
+            // the records may be overwritten from now on
+            ring->tail.store(tail, std::memory_order_release);
+            drained = true;
+        }
+        std::uint64_t dropped = ring->dropped.load(std::memory_order_relaxed);
+        if (dropped != ring->reported_dropped)
+        {
+            m_target->warn("Logger ring overflowed, {0} records dropped", dropped - ring->reported_dropped);
+            ring->reported_dropped = dropped;
+        }
+    }
+    return drained;
+}
+
+void AsyncLogger::emit(const Record& record)
+{
+    fmt::dynamic_format_arg_store<fmt::format_context> store;
+    for (unsigned i = 0; i < record.args_count; ++i)
+    {
+        const Arg& arg = record.args[i];
+        switch (arg.type)
+        {
+        case ArgType::BOOL:
+            store.push_back(arg.b);
+            break;
+        case ArgType::SIGNED:
+            store.push_back(arg.i);
+            break;
+        case ArgType::UNSIGNED:
+            store.push_back(arg.u);
+            break;
+        case ArgType::DOUBLE:
+            store.push_back(arg.d);
+            break;
+        case ArgType::TEXT:
+            store.push_back(std::string_view(record.text.data() + arg.text_offset, arg.text_size));
+            break;
+        }
+    }
+
+    std::string_view format(record.format, record.format_size);
+    std::string text;
+    try
+    {
+        text = fmt::vformat(format, store);
+    }
+    catch (const fmt::format_error&)
+    {
+        text = format;
+    }
+
+    auto level = static_cast<spdlog::level::level_enum>(record.level);
+    if (!m_target->should_log(level))
+    {
+        return;
+    }
+    spdlog::log_clock::time_point time(std::chrono::duration_cast<spdlog::log_clock::duration>(
+        std::chrono::nanoseconds(record.timestamp_ns)));
+    spdlog::details::log_msg message(time, spdlog::source_loc{}, m_target->name(), level, text);
+    message.thread_id = record.thread_id;
+    for (const spdlog::sink_ptr& sink : m_target->sinks())
+    {
+        if (sink->should_log(level))
+        {
+            sink->log(message);
+        }
+    }
+}
+
+AsyncLogger& async_logger()
+{
+    static AsyncLogger* instance = []()
+    {
+        auto* logger = new AsyncLogger(hw2::logger());
+        std::atexit([]() { async_logger().flush(); });
+        return logger;
+    }();
+    return *instance;
+}
+
+}  // namespace hw2
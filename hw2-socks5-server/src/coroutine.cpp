@@ -0,0 +1,54 @@
+#include <coroutine.hpp>
+
+#include <new>
+
+namespace hw2
+{
+
+thread_local FramePool::FreeBlock* FramePool::t_free_blocks = nullptr;
+
+void* FramePool::allocate(std::size_t size)
+{
+    if (size > BLOCK_SIZE)
+    {
+        return ::operator new(size);
+    }
+    if (t_free_blocks == nullptr)
+    {
+        return ::operator new(BLOCK_SIZE);
+    }
+    FreeBlock* block = t_free_blocks;
+    t_free_blocks = block->next;
+    return block;
+}
+
+void FramePool::deallocate(void* frame, std::size_t size) noexcept
+{
+    if (size > BLOCK_SIZE)
+    {
+        ::operator delete(frame);
+        return;
+    }
+    t_free_blocks = ::new (frame) FreeBlock{ t_free_blocks };
+}
+
+Task& Task::operator=(Task&& other) noexcept
+{
+    if (this != &other)
+    {
+        if (m_handle)
+            m_handle.destroy();
+        m_handle = std::exchange(other.m_handle, nullptr);
+    }
+    return *this;
+}
+
+Task::~Task()
+{
+    if (m_handle)
+    {
+        m_handle.destroy();
+    }
+}
+
+}  // namespace hw2
@@ -0,0 +1,95 @@
+#include <dns_cache.hpp>
+#include <utils.hpp>
+
+#include <algorithm>
+#include <cassert>
+
+namespace hw2
+{
+
+DnsCache::DnsCache(std::size_t max_entries)
+    : capacity(max_entries)
+{
+    m_entries.reserve(capacity);
+    m_index.reserve(capacity);
+}
+
+const DnsAnswer* DnsCache::find(std::string_view name, clock_type::time_point now)
+{
+    auto it = m_index.find(name);
+    if (it == m_index.end() || m_entries[it->second].expires_at <= now)
+    {
+        ++m_misses;
+        return nullptr;
+    }
+
+    ++m_hits;
+    Entry& entry = m_entries[it->second];
+    entry.referenced = true;
+    return &entry.answer;
+}
+
+void DnsCache::insert(std::string_view name, const DnsAnswer& answer, clock_type::time_point now)
+{
+    clock_type::duration ttl;
+    switch (answer.status)
+    {
+    case DnsAnswer::Status::SUCCESS:
+        ttl = std::min<clock_type::duration>(std::chrono::seconds(answer.ttl), MAX_TTL);
+        break;
+    case DnsAnswer::Status::NAME_ERROR:
+        ttl = NEGATIVE_TTL;
+        break;
+    default:
+        return;
+    }
+    if (capacity == 0 || ttl == clock_type::duration::zero())
+        return;
+
+    auto it = m_index.find(name);
+    std::size_t index;
+    if (it != m_index.end())
+    {
+        index = it->second;
+    }
+    else
+    {
+        if (m_entries.size() < capacity)
+        {
+            index = m_entries.size();
+            m_entries.emplace_back();
+        }
+        else
+        {
+            index = this->evict(now);
+            m_index.erase(m_entries[index].name);
+        }
+        m_entries[index].name = name;
+        m_index.emplace(m_entries[index].name, index);
+    }
+
+    Entry& entry = m_entries[index];
+    entry.answer = answer;
+    entry.expires_at = now + ttl;
+    entry.referenced = false;
+}
+
+std::size_t DnsCache::evict(clock_type::time_point now)
+{
+    assert(!m_entries.empty());
+    for (;;)
+    {
+        std::size_t index = m_clock_hand;
+        m_clock_hand = (m_clock_hand + 1) % m_entries.size();
+
+        Entry& entry = m_entries[index];
+        if (entry.referenced && entry.expires_at > now)
+        {
+            entry.referenced = false;  // second chance
+            continue;
+        }
+        return index;
+    }
+}
+
+}  // namespace hw2
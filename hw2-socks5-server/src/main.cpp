@@ -1,19 +1,56 @@
+#include <metrics.hpp>
+#include <placement.hpp>
+#include <resolver.hpp>
 #include <server.hpp>
 #include <socket.hpp>
 #include <utils.hpp>
 
 #include <tclap/CmdLine.h>
 
+#include <unistd.h>
+
+#include <algorithm>
+#include <bit>
+#include <fstream>
+#include <memory>
 #include <optional>
+#include <stdexcept>
+#include <string>
 #include <thread>
+#include <vector>
+
+enum class ListenerMode
+{
+    SHARED,          // one listening socket, all threads accept on it
+    REUSE_PORT,      // SO_REUSEPORT socket per thread, the kernel hashes connections over them
+    REUSE_PORT_CPU,  // same, but a connection goes to the thread of the CPU which received it
+};
 
 struct Params
 {
     unsigned threads_count;
     in_port_t port;
-    bool kerlen_polling;
+    in_port_t metrics_port;  // 0 if the metrics endpoint is disabled
+    ListenerMode listener_mode;
+    bool fast_open;                   // listening sockets accept data in the SYN
+    unsigned defer_accept_seconds;    // 0 if accept reports connections before any data
+    hw2::PlacementPolicy placement_policy;
+    hw2::ServerOptions server_options;
+    hw2::ResolverConfig resolver_config;
 };
 
+// bits of net.ipv4.tcp_fastopen, which covers IPv6 as well
+constexpr unsigned TCP_FASTOPEN_CLIENT = 0x1;
+constexpr unsigned TCP_FASTOPEN_SERVER = 0x2;
+
+static unsigned tcp_fastopen_sysctl()
+{
+    std::ifstream file("/proc/sys/net/ipv4/tcp_fastopen");
+    unsigned value = 0;
+    file >> value;
+    return value;
+}
+
 static std::optional<Params> parse_cmd_line(int argc, char* argv[])
 {
     try
@@ -41,6 +78,16 @@ static std::optional<Params> parse_cmd_line(int argc, char* argv[])
         );
         cmd.add(port_arg);
 
+        TCLAP::ValueArg<in_port_t> metrics_port_arg(
+            /* short flag */    "m",
+            /* long flag */     "metrics_port",
+            /* description */   "Loopback port serving metrics in Prometheus text format (0 disables the endpoint)",
+            /* required */      false,
+            /* default */       0,
+            /* type info */     "int"
+        );
+        cmd.add(metrics_port_arg);
+
         TCLAP::SwitchArg kernel_polling_arg(
             /* short flag */    "k",
             /* long flag */     "kernel_polling",
@@ -49,26 +96,362 @@ static std::optional<Params> parse_cmd_line(int argc, char* argv[])
         );
         cmd.add(kernel_polling_arg);
 
+        TCLAP::SwitchArg fixed_files_arg(
+            /* short flag */    "f",
+            /* long flag */     "fixed_files",
+            /* description */   "Keep sockets in a registered io_uring file table (Linux 5.19+)",
+            /* default */       false
+        );
+        cmd.add(fixed_files_arg);
+
+        TCLAP::SwitchArg single_shot_accept_arg(
+            /* short flag */    "s",
+            /* long flag */     "single_shot_accept",
+            /* description */   "Re-arm a single-shot accept per connection instead of using multishot accept",
+            /* default */       false
+        );
+        cmd.add(single_shot_accept_arg);
+
+        TCLAP::SwitchArg static_buffers_arg(
+            /* short flag */    "S",
+            /* long flag */     "static_buffers",
+            /* description */   "Keep every session at 16 KiB buffers in copy relay mode instead of adapting them to the traffic",
+            /* default */       false
+        );
+        cmd.add(static_buffers_arg);
+
+        TCLAP::ValueArg<unsigned> sessions_per_64k_buffer_arg(
+            /* short flag */    "x",
+            /* long flag */     "sessions_per_64k_buffer",
+            /* description */   "Adaptive copy relay buffers: one 64 KiB buffer per this many sessions, 4 KiB per "
+                                "session by default (0 disables 64 KiB and 256 KiB buffers); with both defaults the "
+                                "pool takes 32 KiB per session, as much as static buffers",
+            /* required */      false,
+            /* default */       16,
+            /* type info */     "int"
+        );
+        cmd.add(sessions_per_64k_buffer_arg);
+
+        TCLAP::ValueArg<unsigned> sessions_per_256k_buffer_arg(
+            /* short flag */    "X",
+            /* long flag */     "sessions_per_256k_buffer",
+            /* description */   "Adaptive copy relay buffers: one 256 KiB buffer per this many sessions (0 disables "
+                                "them); 4 KiB per session by default",
+            /* required */      false,
+            /* default */       64,
+            /* type info */     "int"
+        );
+        cmd.add(sessions_per_256k_buffer_arg);
+
+        TCLAP::ValueArg<std::string> dns_server_arg(
+            /* short flag */    "d",
+            /* long flag */     "dns_server",
+            /* description */   "Nameserver in form ip[:port] (first IPv4 nameserver from /etc/resolv.conf by default)",
+            /* required */      false,
+            /* default */       "",
+            /* type info */     "string"
+        );
+        cmd.add(dns_server_arg);
+
+        TCLAP::ValueArg<std::size_t> dns_cache_size_arg(
+            /* short flag */    "c",
+            /* long flag */     "dns_cache_size",
+            /* description */   "Maximum count of cached DNS answers per thread (0 disables caching)",
+            /* required */      false,
+            /* default */       4096,
+            /* type info */     "int"
+        );
+        cmd.add(dns_cache_size_arg);
+
+        std::vector<std::string> relay_modes = { "copy", "splice", "buffer_ring", "pipelined" };
+        TCLAP::ValuesConstraint<std::string> relay_mode_constraint(relay_modes);
+        TCLAP::ValueArg<std::string> relay_mode_arg(
+            /* short flag */    "r",
+            /* long flag */     "relay_mode",
+            /* description */   "How payload is relayed: copy through per-connection buffers, splice through pipes "
+                                "or copy through buffers picked by the kernel from a shared ring, "
+                                "or copy with reads overlapping writes",
+            /* required */      false,
+            /* default */       "copy",
+            /* constraint */    &relay_mode_constraint
+        );
+        cmd.add(relay_mode_arg);
+
+        TCLAP::ValueArg<unsigned> buffer_ring_entries_arg(
+            /* short flag */    "b",
+            /* long flag */     "buffer_ring_entries",
+            /* description */   "Count of 16 KiB buffers per thread in buffer_ring relay mode (power of 2)",
+            /* required */      false,
+            /* default */       1024,
+            /* type info */     "int"
+        );
+        cmd.add(buffer_ring_entries_arg);
+
+        TCLAP::ValueArg<unsigned> pipeline_depth_arg(
+            /* short flag */    "D",
+            /* long flag */     "pipeline_depth",
+            /* description */   "Count of 16 KiB slices per direction of a connection in pipelined relay mode (1-16)",
+            /* required */      false,
+            /* default */       4,
+            /* type info */     "int"
+        );
+        cmd.add(pipeline_depth_arg);
+
+        TCLAP::ValueArg<unsigned> zero_copy_threshold_arg(
+            /* short flag */    "z",
+            /* long flag */     "zero_copy_threshold",
+            /* description */   "Send writes to clients of at least this many bytes without copying them "
+                                "(Linux 6.0+, copy and buffer_ring relay modes, 0 disables)",
+            /* required */      false,
+            /* default */       0,
+            /* type info */     "int"
+        );
+        cmd.add(zero_copy_threshold_arg);
+
+        TCLAP::ValueArg<unsigned> handshake_timeout_arg(
+            /* short flag */    "H",
+            /* long flag */     "handshake_timeout",
+            /* description */   "Seconds a client has to complete the SOCKS5 handshake, connecting excluded (0 disables)",
+            /* required */      false,
+            /* default */       10,
+            /* type info */     "int"
+        );
+        cmd.add(handshake_timeout_arg);
+
+        TCLAP::ValueArg<unsigned> connect_timeout_arg(
+            /* short flag */    "C",
+            /* long flag */     "connect_timeout",
+            /* description */   "Seconds to wait for a connection to the destination (0 disables)",
+            /* required */      false,
+            /* default */       10,
+            /* type info */     "int"
+        );
+        cmd.add(connect_timeout_arg);
+
+        TCLAP::ValueArg<unsigned> idle_timeout_arg(
+            /* short flag */    "I",
+            /* long flag */     "idle_timeout",
+            /* description */   "Seconds a proxied connection may stay without traffic in either direction (0 disables)",
+            /* required */      false,
+            /* default */       300,
+            /* type info */     "int"
+        );
+        cmd.add(idle_timeout_arg);
+
+        std::vector<std::string> huge_pages_modes = { "none", "transparent", "explicit" };
+        TCLAP::ValuesConstraint<std::string> huge_pages_constraint(huge_pages_modes);
+        TCLAP::ValueArg<std::string> huge_pages_arg(
+            /* short flag */    "g",
+            /* long flag */     "huge_pages",
+            /* description */   "Pages backing the buffer pools: 4 KiB ones, transparent huge pages or "
+                                "huge pages reserved in vm.nr_hugepages",
+            /* required */      false,
+            /* default */       "transparent",
+            /* constraint */    &huge_pages_constraint
+        );
+        cmd.add(huge_pages_arg);
+
+        std::vector<std::string> ring_setups = { "plain", "single_issuer", "coop_taskrun", "defer_taskrun" };
+        TCLAP::ValuesConstraint<std::string> ring_setup_constraint(ring_setups);
+        TCLAP::ValueArg<std::string> ring_setup_arg(
+            /* short flag */    "R",
+            /* long flag */     "ring_setup",
+            /* description */   "io_uring setup flags, each including the previous ones; levels the kernel "
+                                "lacks fall back to the one below, kernel polling caps them at single_issuer",
+            /* required */      false,
+            /* default */       "defer_taskrun",
+            /* constraint */    &ring_setup_constraint
+        );
+        cmd.add(ring_setup_arg);
+
+        TCLAP::ValueArg<unsigned> sq_entries_arg(
+            /* short flag */    "q",
+            /* long flag */     "sq_entries",
+            /* description */   "Submission queue entries of each thread's ring (0 means one per connection)",
+            /* required */      false,
+            /* default */       0,
+            /* type info */     "int"
+        );
+        cmd.add(sq_entries_arg);
+
+        TCLAP::ValueArg<unsigned> cq_entries_arg(
+            /* short flag */    "Q",
+            /* long flag */     "cq_entries",
+            /* description */   "Completion queue entries of each thread's ring (0 means enough for the requests "
+                                "a connection may have in flight, four to five, and some for the listener, "
+                                "resolver and timer)",
+            /* required */      false,
+            /* default */       0,
+            /* type info */     "int"
+        );
+        cmd.add(cq_entries_arg);
+
+        TCLAP::SwitchArg fast_open_arg(
+            /* short flag */    "F",
+            /* long flag */     "fast_open",
+            /* description */   "TCP Fast Open: accept client data in the SYN and send payload the client "
+                                "pipelined after its request in the SYN to the destination",
+            /* default */       false
+        );
+        cmd.add(fast_open_arg);
+
+        TCLAP::ValueArg<unsigned> defer_accept_arg(
+            /* short flag */    "A",
+            /* long flag */     "defer_accept",
+            /* description */   "Seconds the kernel holds a connection back until the client sends its greeting (0 disables)",
+            /* required */      false,
+            /* default */       0,
+            /* type info */     "int"
+        );
+        cmd.add(defer_accept_arg);
+
+        std::vector<std::string> listener_modes = { "shared", "reuse_port", "reuse_port_cpu" };
+        TCLAP::ValuesConstraint<std::string> listener_mode_constraint(listener_modes);
+        TCLAP::ValueArg<std::string> listener_mode_arg(
+            /* short flag */    "l",
+            /* long flag */     "listener",
+            /* description */   "One listening socket shared by all threads, or an SO_REUSEPORT socket per thread "
+                                "with connections spread by hash or to the thread pinned to the receiving CPU "
+                                "(needs --placement)",
+            /* required */      false,
+            /* default */       "shared",
+            /* constraint */    &listener_mode_constraint
+        );
+        cmd.add(listener_mode_arg);
+
+        std::vector<std::string> placement_policies = { "none", "compact", "numa_spread" };
+        TCLAP::ValuesConstraint<std::string> placement_policy_constraint(placement_policies);
+        TCLAP::ValueArg<std::string> placement_policy_arg(
+            /* short flag */    "P",
+            /* long flag */     "placement",
+            /* description */   "Pin event loop and SQPOLL threads to allowed CPUs filling NUMA nodes one by one "
+                                "or round robin over them, or leave them floating",
+            /* required */      false,
+            /* default */       "none",
+            /* constraint */    &placement_policy_constraint
+        );
+        cmd.add(placement_policy_arg);
+
         cmd.parse(argc, argv);
         unsigned threads_count = threads_count_arg.getValue();
         in_port_t port = port_arg.getValue();
-        bool kernel_polling = kernel_polling_arg.getValue();
+        in_port_t metrics_port = metrics_port_arg.getValue();
+        hw2::ServerOptions server_options;
+        ListenerMode listener_mode = ListenerMode::SHARED;
+        if (listener_mode_arg.getValue() == "reuse_port")
+            listener_mode = ListenerMode::REUSE_PORT;
+        else if (listener_mode_arg.getValue() == "reuse_port_cpu")
+            listener_mode = ListenerMode::REUSE_PORT_CPU;
+        hw2::PlacementPolicy placement_policy = hw2::PlacementPolicy::NONE;
+        if (placement_policy_arg.getValue() == "compact")
+            placement_policy = hw2::PlacementPolicy::COMPACT;
+        else if (placement_policy_arg.getValue() == "numa_spread")
+            placement_policy = hw2::PlacementPolicy::NUMA_SPREAD;
+        // steering by CPU only hands a connection to the thread on that CPU if threads are pinned
+        if (listener_mode == ListenerMode::REUSE_PORT_CPU && placement_policy == hw2::PlacementPolicy::NONE)
+        {
+            throw std::invalid_argument("The reuse_port_cpu listener needs compact or numa_spread placement");
+        }
+        server_options.kernel_polling = kernel_polling_arg.getValue();
+        server_options.fixed_files = fixed_files_arg.getValue();
+        server_options.multishot_accept = !single_shot_accept_arg.getValue();
+        server_options.adaptive_buffers = !static_buffers_arg.getValue();
+        server_options.sessions_per_64k_buffer = sessions_per_64k_buffer_arg.getValue();
+        server_options.sessions_per_256k_buffer = sessions_per_256k_buffer_arg.getValue();
+        if (relay_mode_arg.getValue() == "splice")
+            server_options.relay_mode = hw2::RelayMode::SPLICE;
+        else if (relay_mode_arg.getValue() == "buffer_ring")
+            server_options.relay_mode = hw2::RelayMode::BUFFER_RING;
+        else if (relay_mode_arg.getValue() == "pipelined")
+            server_options.relay_mode = hw2::RelayMode::PIPELINED;
+        server_options.buffer_ring_entries = buffer_ring_entries_arg.getValue();
+        if (server_options.buffer_ring_entries == 0
+            || server_options.buffer_ring_entries > hw2::BufferRing::MAX_ENTRIES
+            || !std::has_single_bit(server_options.buffer_ring_entries))
+        {
+            throw std::invalid_argument("Buffer ring size must be a power of 2 not greater than 32768");
+        }
+        server_options.pipeline_depth = pipeline_depth_arg.getValue();
+        if (server_options.pipeline_depth == 0 || server_options.pipeline_depth > hw2::RelayPipeline::MAX_DEPTH)
+        {
+            throw std::invalid_argument("Pipeline depth must be within 1-16");
+        }
+        server_options.zero_copy_threshold = zero_copy_threshold_arg.getValue();
+        if (huge_pages_arg.getValue() == "none")
+            server_options.huge_pages = hw2::HugePages::NONE;
+        else if (huge_pages_arg.getValue() == "explicit")
+            server_options.huge_pages = hw2::HugePages::EXPLICIT;
+        if (ring_setup_arg.getValue() == "plain")
+            server_options.ring_setup = hw2::RingSetup::PLAIN;
+        else if (ring_setup_arg.getValue() == "single_issuer")
+            server_options.ring_setup = hw2::RingSetup::SINGLE_ISSUER;
+        else if (ring_setup_arg.getValue() == "coop_taskrun")
+            server_options.ring_setup = hw2::RingSetup::COOP_TASKRUN;
+        server_options.sq_entries = sq_entries_arg.getValue();
+        server_options.cq_entries = cq_entries_arg.getValue();
+        server_options.handshake_timeout = handshake_timeout_arg.getValue();
+        server_options.connect_timeout = connect_timeout_arg.getValue();
+        server_options.idle_timeout = idle_timeout_arg.getValue();
+        bool fast_open = fast_open_arg.getValue();
+        if (fast_open)
+        {
+            unsigned sysctl = tcp_fastopen_sysctl();
+            if (!(sysctl & TCP_FASTOPEN_SERVER))
+                hw2::logger()->warn("net.ipv4.tcp_fastopen lacks the server bit 0x2, clients cannot send data in the SYN");
+            // without the client bit sendmsg with MSG_FASTOPEN fails instead of falling back to a plain SYN
+            if (sysctl & TCP_FASTOPEN_CLIENT)
+                server_options.fast_open = true;
+            else
+                hw2::logger()->warn("net.ipv4.tcp_fastopen lacks the client bit 0x1, destinations are connected without Fast Open");
+        }
+        unsigned defer_accept_seconds = defer_accept_arg.getValue();
 
         if (threads_count == 0)
             threads_count = default_thread_count;
 
         hw2::logger()->info("Using {0:d} threads", threads_count);
         hw2::logger()->info("Using port {0:d}", port);
-        if (kernel_polling)
+        if (metrics_port != 0)
+            hw2::logger()->info("Using metrics port {0:d}", metrics_port);
+        if (server_options.kernel_polling)
             hw2::logger()->info("Using kernel polling");
-     
-        return Params{ .threads_count = threads_count, .port = port, .kerlen_polling = kernel_polling };
+        if (server_options.fixed_files)
+            hw2::logger()->info("Using fixed files");
+        hw2::logger()->info("Using {0} relay mode", relay_mode_arg.getValue());
+        hw2::logger()->info("Huge pages for buffers: {0}", huge_pages_arg.getValue());
+        hw2::logger()->info("Using {0} ring setup", ring_setup_arg.getValue());
+        if (server_options.zero_copy_threshold != 0)
+            hw2::logger()->info("Using zero-copy sends from {0:d} bytes", server_options.zero_copy_threshold);
+        hw2::logger()->info("Using {0} listener", listener_mode_arg.getValue());
+        if (fast_open)
+            hw2::logger()->info("Using TCP Fast Open");
+        if (defer_accept_seconds != 0)
+            hw2::logger()->info("Deferring accept by up to {0:d} seconds", defer_accept_seconds);
+        hw2::logger()->info("Using {0} placement", placement_policy_arg.getValue());
+
+        hw2::ResolverConfig resolver_config = hw2::ResolverConfig::from_system();
+        if (dns_server_arg.isSet())
+            resolver_config.set_nameserver(dns_server_arg.getValue());
+        resolver_config.cache_capacity = dns_cache_size_arg.getValue();
+        char nameserver_string[INET_ADDRSTRLEN];
+        ::inet_ntop(AF_INET, &resolver_config.nameserver.sin_addr, nameserver_string, INET_ADDRSTRLEN);
+        hw2::logger()->info("Using nameserver {0}:{1:d}", nameserver_string, ::ntohs(resolver_config.nameserver.sin_port));
+
+        return Params{ .threads_count = threads_count, .port = port, .metrics_port = metrics_port,
+                       .listener_mode = listener_mode, .fast_open = fast_open,
+                       .defer_accept_seconds = defer_accept_seconds,
+                       .placement_policy = placement_policy, .server_options = server_options, .resolver_config = std::move(resolver_config) };
     }
     catch (TCLAP::ArgException& e)
     {
         hw2::logger()->error("Parsing command line arguments failed: '{0}' for arg {1}", e.error(), e.argId());
         return std::nullopt;
     }
+    catch (std::invalid_argument& e)
+    {
+        hw2::logger()->error("Parsing command line arguments failed: {0}", e.what());
+        return std::nullopt;
+    }
 }
 
 static void signal_handler_sigint(int /* signum */)
@@ -113,28 +496,144 @@ int main(int argc, char* argv[]) try
 
         constexpr int max_connections = 1 << 15;
         unsigned one_thread_connections = max_connections / params->threads_count;
-        hw2::MainSocket server_socket(params->port, max_connections);
 
+        std::vector<hw2::WorkerPlacement> placements = hw2::plan_placement(
+            params->placement_policy, params->threads_count, params->server_options.kernel_polling);
+        for (unsigned i = 0; i < placements.size(); ++i)
+        {
+            if (placements[i].cpu != -1)
+            {
+                hw2::logger()->info("Thread {0}: CPU {1}, SQPOLL CPU {2}, NUMA node {3}", i, placements[i].cpu,
+                                    placements[i].sq_thread_cpu, placements[i].numa_node);
+            }
+        }
+
+        // bound in thread order, so that the index of a socket within the SO_REUSEPORT group
+        // is the index of its thread
+        std::vector<std::unique_ptr<hw2::MainSocket>> server_sockets;
+        if (params->listener_mode == ListenerMode::SHARED)
+        {
+            server_sockets.push_back(std::make_unique<hw2::MainSocket>(params->port, max_connections));
+        }
+        else
+        {
+            for (unsigned i = 0; i < params->threads_count; ++i)
+            {
+                server_sockets.push_back(std::make_unique<hw2::MainSocket>(
+                    params->port, static_cast<int>(one_thread_connections), true));
+            }
+            if (params->listener_mode == ListenerMode::REUSE_PORT_CPU)
+            {
+                server_sockets.front()->steer_reuseport_group_by_cpu(hw2::listener_index_by_cpu(placements));
+            }
+        }
+        // as many pending Fast Open connections as the accept queue holds
+        int fast_open_queue_length = params->listener_mode == ListenerMode::SHARED
+            ? max_connections
+            : static_cast<int>(one_thread_connections);
+        for (const std::unique_ptr<hw2::MainSocket>& server_socket : server_sockets)
+        {
+            if (params->fast_open)
+            {
+                server_socket->enable_fast_open(fast_open_queue_length);
+            }
+            if (params->defer_accept_seconds != 0)
+            {
+                server_socket->defer_accept(static_cast<int>(params->defer_accept_seconds));
+            }
+        }
+
+        // io_uring refuses fixed file tables larger than RLIMIT_NOFILE
         rlimit file_limit = hw2::syscall_wrapper::getrlimit_nofile();
-        file_limit.rlim_cur = max_connections * 2;
+        rlim_t file_table_size = hw2::IoUring::file_table_size(one_thread_connections);
+        if (params->server_options.fixed_files && ::geteuid() != 0 && file_limit.rlim_max != RLIM_INFINITY
+            && file_limit.rlim_max < file_table_size)
+        {
+            hw2::logger()->warn("RLIMIT_NOFILE hard limit of {0} is below {1} fixed file slots per thread, "
+                                "using plain descriptors", file_limit.rlim_max, file_table_size);
+            params->server_options.fixed_files = false;
+        }
+        // plus the listening sockets, rings, resolver sockets and the like
+        rlim_t needed_files = params->threads_count * one_thread_connections
+            * hw2::IoUring::descriptors_per_session(params->server_options) + 256;
+        if (params->server_options.fixed_files)
+        {
+            needed_files = std::max(needed_files, file_table_size);
+        }
+        if (file_limit.rlim_max != RLIM_INFINITY && file_limit.rlim_max < needed_files)
+        {
+            if (::geteuid() == 0)
+            {
+                file_limit.rlim_max = needed_files;
+            }
+            else
+            {
+                hw2::logger()->warn("RLIMIT_NOFILE hard limit of {0} is below {1} descriptors, "
+                                    "connections over it will fail", file_limit.rlim_max, needed_files);
+            }
+        }
+        if (file_limit.rlim_cur != RLIM_INFINITY)
+        {
+            file_limit.rlim_cur = std::max(file_limit.rlim_cur, std::min(needed_files, file_limit.rlim_max));
+        }
         hw2::syscall_wrapper::setrlimit_nofile(file_limit);
 
+        // buffer pools are registered with io_uring, which pins them and charges them to the
+        // RLIMIT_MEMLOCK of the user unless it has CAP_IPC_LOCK
+        rlim_t buffer_memory = params->threads_count
+            * hw2::IoUring::buffer_memory_size(one_thread_connections, params->server_options);
+        rlim_t needed_memory = buffer_memory + (1 << 16);
         rlimit memory_limit = hw2::syscall_wrapper::getrlimit_memlock();
-        memory_limit.rlim_cur = 1 << 16;
+        if (memory_limit.rlim_max != RLIM_INFINITY && memory_limit.rlim_max < needed_memory)
+        {
+            if (::geteuid() == 0)
+            {
+                memory_limit.rlim_max = needed_memory;
+            }
+            else
+            {
+                hw2::logger()->warn("RLIMIT_MEMLOCK hard limit of {0} KiB is below {1} KiB of buffers, "
+                                    "some threads will use unregistered buffers", memory_limit.rlim_max >> 10,
+                                    needed_memory >> 10);
+            }
+        }
+        if (memory_limit.rlim_cur != RLIM_INFINITY)
+        {
+            memory_limit.rlim_cur = std::max(memory_limit.rlim_cur, std::min(needed_memory, memory_limit.rlim_max));
+        }
         hw2::syscall_wrapper::setrlimit_memlock(memory_limit);
 
-        auto thread_function = [&server_socket, one_thread_connections, &params]()
+        // written by event loop threads, read by the metrics endpoint
+        std::vector<hw2::Metrics> metrics(params->threads_count);
+        std::unique_ptr<hw2::MetricsEndpoint> metrics_endpoint;
+        std::thread metrics_thread;
+        if (params->metrics_port != 0)
         {
-            hw2::IoUring uring(server_socket, one_thread_connections, params->kerlen_polling);
+            metrics_endpoint = std::make_unique<hw2::MetricsEndpoint>(params->metrics_port, metrics);
+            metrics_thread = std::thread([&metrics_endpoint]() { metrics_endpoint->serve(); });
+        }
+
+        auto thread_function = [&server_sockets, one_thread_connections, &params, &placements, &metrics](unsigned thread_index)
+        {
+            // pools of the IoUring are first touched after pinning, so they land on the local node
+            hw2::apply_placement(placements[thread_index]);
+            hw2::ServerOptions server_options = params->server_options;
+            server_options.sq_thread_cpu = placements[thread_index].sq_thread_cpu;
+
+            const hw2::MainSocket& server_socket = server_sockets.size() == 1
+                ? *server_sockets.front()
+                : *server_sockets[thread_index];
+            hw2::IoUring uring(server_socket, one_thread_connections, params->resolver_config, server_options,
+                               metrics[thread_index]);
             uring.event_loop();
         };
 
         std::vector<std::thread> threads(params->threads_count - 1);
-        for (std::thread& thread : threads)
+        for (unsigned i = 0; i < threads.size(); ++i)
         {
-            thread = std::thread(thread_function);
+            threads[i] = std::thread(thread_function, i + 1);
         }
-        thread_function();
+        thread_function(0);
     }
     catch (const std::exception& e)
     {
@@ -0,0 +1,116 @@
+#include <memory_arena.hpp>
+#include <syscall.hpp>
+#include <utils.hpp>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+
+namespace hw2
+{
+
+namespace
+{
+
+std::size_t page_size()
+{
+    static const auto size = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+    return size;
+}
+
+std::size_t round_up(std::size_t size, std::size_t alignment)
+{
+    return (size + alignment - 1) / alignment * alignment;
+}
+
+}  // namespace
+
+MemoryArena::MemoryArena(std::size_t size, HugePages huge_pages)
+    : m_size(mapped_size(size, huge_pages))
+    , m_huge_pages(huge_pages)
+{
+    if (m_size == 0)
+    {
+        return;
+    }
+    this->map_pages();
+    this->prefault();
+}
+
+MemoryArena::~MemoryArena()
+{
+    if (m_data != nullptr)
+    {
+        ::munmap(m_data, m_size);
+    }
+}
+
+std::size_t MemoryArena::mapped_size(std::size_t size, HugePages huge_pages)
+{
+    return round_up(size, huge_pages == HugePages::NONE ? page_size() : HUGE_PAGE_SIZE);
+}
+
+void MemoryArena::map_pages()
+{
+    if (m_huge_pages == HugePages::EXPLICIT)
+    {
+        void* data = ::mmap(nullptr, m_size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (data != MAP_FAILED)
+        {
+            m_data = static_cast<unsigned char*>(data);
+            return;
+        }
+        logger()->warn("Cannot map {0} MiB of explicit huge pages: {1}, using transparent ones",
+                       m_size >> 20, std::strerror(errno));
+        m_huge_pages = HugePages::TRANSPARENT;
+    }
+
+    // only ranges aligned to a huge page can be backed by one, so the mapping is trimmed to
+    // an aligned start
+    std::size_t alignment = m_huge_pages == HugePages::TRANSPARENT ? HUGE_PAGE_SIZE : page_size();
+    std::size_t reserved_size = m_size + alignment - page_size();
+    void* reserved = ::mmap(nullptr, reserved_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (reserved == MAP_FAILED)
+    {
+        std::perror("mmap");
+        throw syscall_wrapper::Error("mmap", errno);
+    }
+    auto reserved_start = reinterpret_cast<std::uintptr_t>(reserved);
+    std::uintptr_t start = round_up(reserved_start, alignment);
+    if (start != reserved_start)
+    {
+        ::munmap(reserved, start - reserved_start);
+    }
+    if (std::size_t tail_size = reserved_start + reserved_size - (start + m_size); tail_size != 0)
+    {
+        ::munmap(reinterpret_cast<void*>(start + m_size), tail_size);
+    }
+    m_data = reinterpret_cast<unsigned char*>(start);
+
+    if (m_huge_pages == HugePages::TRANSPARENT && ::madvise(m_data, m_size, MADV_HUGEPAGE) != 0)
+    {
+        logger()->warn("Transparent huge pages are unavailable: {0}", std::strerror(errno));
+        m_huge_pages = HugePages::NONE;
+    }
+}
+
+void MemoryArena::prefault()
+{
+    // Linux 5.14+, otherwise every page is written once
+    if (::madvise(m_data, m_size, MADV_POPULATE_WRITE) == 0)
+    {
+        return;
+    }
+    std::size_t stride = m_huge_pages == HugePages::EXPLICIT ? HUGE_PAGE_SIZE : page_size();
+    volatile unsigned char* data = m_data;
+    for (std::size_t offset = 0; offset < m_size; offset += stride)
+    {
+        data[offset] = 0;
+    }
+}
+
+}  // namespace hw2
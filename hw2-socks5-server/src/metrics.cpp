@@ -0,0 +1,183 @@
+#include <metrics.hpp>
+#include <syscall.hpp>
+#include <utils.hpp>
+
+#include <spdlog/fmt/fmt.h>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <iterator>
+#include <numeric>
+#include <string_view>
+
+namespace hw2
+{
+
+namespace
+{
+
+std::uint64_t sum(std::span<const Metrics> metrics, const Counter Metrics::* counter)
+{
+    return std::accumulate(metrics.begin(), metrics.end(), std::uint64_t{ 0 },
+                           [counter](std::uint64_t total, const Metrics& m) { return total + (m.*counter).value(); });
+}
+
+void append_metric(std::string& out, std::string_view name, std::string_view type, std::string_view help,
+                   std::uint64_t value)
+{
+    fmt::format_to(std::back_inserter(out), "# HELP {0} {1}\n# TYPE {0} {2}\n{0} {3}\n", name, help, type, value);
+}
+
+bool send_all(int fd, std::string_view data)
+{
+    while (!data.empty())
+    {
+        ssize_t nsent = ::send(fd, data.data(), data.size(), MSG_NOSIGNAL);
+        if (nsent <= 0)
+        {
+            return false;
+        }
+        data.remove_prefix(static_cast<std::size_t>(nsent));
+    }
+    return true;
+}
+
+}  // namespace
+
+std::string format_prometheus(std::span<const Metrics> metrics)
+{
+    std::string out;
+    append_metric(out, "socks5_accepts_total", "counter", "Accepted client connections.",
+                  sum(metrics, &Metrics::accepts));
+    std::uint64_t opened = sum(metrics, &Metrics::sessions_opened);
+    std::uint64_t closed = sum(metrics, &Metrics::sessions_closed);
+    // closes are summed after opens, so a session opened and closed in between may be counted only as closed
+    append_metric(out, "socks5_sessions_active", "gauge", "Sessions from accept until close.",
+                  opened >= closed ? opened - closed : 0);
+    append_metric(out, "socks5_sessions_rejected_total", "counter",
+                  "Connections closed on accept because the server capacity was exceeded.",
+                  sum(metrics, &Metrics::sessions_rejected));
+    append_metric(out, "socks5_buffer_pool_exhaustions_total", "counter",
+                  "Sessions which could not obtain buffers from the buffer pool.",
+                  sum(metrics, &Metrics::buffer_pool_exhaustions));
+
+    out += "# HELP socks5_proxied_bytes_total Payload bytes relayed.\n"
+           "# TYPE socks5_proxied_bytes_total counter\n";
+    fmt::format_to(std::back_inserter(out), "socks5_proxied_bytes_total{{direction=\"upstream\"}} {0}\n",
+                   sum(metrics, &Metrics::upstream_bytes));
+    fmt::format_to(std::back_inserter(out), "socks5_proxied_bytes_total{{direction=\"downstream\"}} {0}\n",
+                   sum(metrics, &Metrics::downstream_bytes));
+
+    append_metric(out, "socks5_greeting_failures_total", "counter",
+                  "Malformed greetings and greetings without the no authentication method.",
+                  sum(metrics, &Metrics::greeting_failures));
+    out += "# HELP socks5_request_failures_total Connection requests answered with a failure reply.\n"
+           "# TYPE socks5_request_failures_total counter\n";
+    for (unsigned code = 1; code < Metrics::REPLY_CODES_COUNT; ++code)
+    {
+        std::uint64_t count = std::accumulate(metrics.begin(), metrics.end(), std::uint64_t{ 0 },
+            [code](std::uint64_t total, const Metrics& m) { return total + m.request_failures[code].value(); });
+        fmt::format_to(std::back_inserter(out), "socks5_request_failures_total{{reply=\"{0}\"}} {1}\n", code, count);
+    }
+
+    append_metric(out, "socks5_cqe_errors_total", "counter", "Failed io_uring requests of sessions.",
+                  sum(metrics, &Metrics::cqe_errors));
+    out += "# HELP socks5_session_timeouts_total Sessions aborted because a phase exceeded its timeout.\n"
+           "# TYPE socks5_session_timeouts_total counter\n";
+    fmt::format_to(std::back_inserter(out), "socks5_session_timeouts_total{{phase=\"handshake\"}} {0}\n",
+                   sum(metrics, &Metrics::handshake_timeouts));
+    fmt::format_to(std::back_inserter(out), "socks5_session_timeouts_total{{phase=\"connect\"}} {0}\n",
+                   sum(metrics, &Metrics::connect_timeouts));
+    fmt::format_to(std::back_inserter(out), "socks5_session_timeouts_total{{phase=\"idle\"}} {0}\n",
+                   sum(metrics, &Metrics::idle_timeouts));
+    append_metric(out, "socks5_zero_copy_sends_total", "counter",
+                  "Writes to clients sent without copying the payload into the socket buffer.",
+                  sum(metrics, &Metrics::zero_copy_sends));
+    append_metric(out, "socks5_io_uring_cq_overflows_total", "counter",
+                  "Event loop wakeups which found the completion queue overflowed.",
+                  sum(metrics, &Metrics::cq_overflows));
+    return out;
+}
+
+MetricsEndpoint::MetricsEndpoint(in_port_t port, std::span<const Metrics> metrics)
+    : m_fd(syscall_wrapper::socket_ipv4())
+    , m_metrics(metrics)
+{
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = ::htonl(INADDR_LOOPBACK);
+    address.sin_port = ::htons(port);
+    try
+    {
+        syscall_wrapper::setsockopt_reuseaddr(m_fd);
+        syscall_wrapper::bind(m_fd, address);
+        syscall_wrapper::listen(m_fd, 16);
+    }
+    catch (...)
+    {
+        ::close(m_fd);
+        throw;
+    }
+}
+
+MetricsEndpoint::~MetricsEndpoint()
+{
+    ::close(m_fd);
+}
+
+void MetricsEndpoint::serve()
+{
+    for (;;)
+    {
+        int fd = ::accept4(m_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd == -1)
+        {
+            if (errno != EINTR && errno != ECONNABORTED)
+            {
+                logger()->error("Metrics endpoint accept failed: {0}", std::strerror(errno));
+            }
+            continue;
+        }
+        this->handle_connection(fd);
+        ::close(fd);
+    }
+}
+
+void MetricsEndpoint::handle_connection(int fd)
+{
+    // a silent client must not stall the endpoint for other scrapers
+    timeval timeout = { .tv_sec = 1, .tv_usec = 0 };
+    ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    // only the request line matters, it fits the first segment
+    char request[1024];
+    ssize_t nread = ::recv(fd, request, sizeof(request), 0);
+    if (nread <= 0)
+    {
+        return;
+    }
+    std::string_view request_line(request, static_cast<std::size_t>(nread));
+    request_line = request_line.substr(0, request_line.find("\r\n"));
+
+    std::string response;
+    if (request_line.starts_with("GET /metrics ") || request_line.starts_with("GET / "))
+    {
+        std::string body = format_prometheus(m_metrics);
+        response = fmt::format("HTTP/1.1 200 OK\r\n"
+                               "Content-Type: text/plain; version=0.0.4\r\n"
+                               "Content-Length: {0}\r\n"
+                               "Connection: close\r\n\r\n", body.size());
+        response += body;
+    }
+    else
+    {
+        response = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    }
+    send_all(fd, response);
+}
+
+}  // namespace hw2
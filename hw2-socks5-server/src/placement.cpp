@@ -0,0 +1,226 @@
+#include <placement.hpp>
+#include <syscall.hpp>
+#include <utils.hpp>
+
+#include <sched.h>
+
+#include <algorithm>
+#include <charconv>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <string_view>
+
+namespace hw2
+{
+
+namespace
+{
+
+// parses sysfs CPU lists like "0-3,8-11"
+std::vector<int> parse_cpu_list(std::string_view list)
+{
+    std::vector<int> cpus;
+    while (!list.empty())
+    {
+        std::size_t comma = list.find(',');
+        std::string_view range = list.substr(0, comma);
+        list.remove_prefix(comma == std::string_view::npos ? list.size() : comma + 1);
+
+        int from = 0;
+        auto [end, ec] = std::from_chars(range.data(), range.data() + range.size(), from);
+        if (ec != std::errc())
+        {
+            continue;
+        }
+        int to = from;
+        if (end != range.data() + range.size() && *end == '-')
+        {
+            std::from_chars(end + 1, range.data() + range.size(), to);
+        }
+        for (int cpu = from; cpu <= to; ++cpu)
+        {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+// allowed CPUs grouped by NUMA node, a single node 0 if sysfs has no NUMA information
+std::map<int, std::vector<int>> allowed_cpus_by_node()
+{
+    cpu_set_t allowed = syscall_wrapper::sched_getaffinity();
+    std::map<int, std::vector<int>> nodes;
+
+    std::error_code error;
+    for (const auto& entry : std::filesystem::directory_iterator("/sys/devices/system/node", error))
+    {
+        std::string name = entry.path().filename().string();
+        int node = 0;
+        if (!name.starts_with("node")
+            || std::from_chars(name.data() + 4, name.data() + name.size(), node).ec != std::errc())
+        {
+            continue;
+        }
+        std::ifstream cpulist_file(entry.path() / "cpulist");
+        std::string cpulist;
+        std::getline(cpulist_file, cpulist);
+        for (int cpu : parse_cpu_list(cpulist))
+        {
+            if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))
+            {
+                nodes[node].push_back(cpu);
+            }
+        }
+    }
+
+    if (nodes.empty())
+    {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+        {
+            if (CPU_ISSET(cpu, &allowed))
+            {
+                nodes[0].push_back(cpu);
+            }
+        }
+    }
+    return nodes;
+}
+
+}  // namespace
+
+std::vector<WorkerPlacement> plan_placement(PlacementPolicy policy, unsigned threads_count, bool kernel_polling)
+{
+    std::vector<WorkerPlacement> placements(threads_count);
+    if (policy == PlacementPolicy::NONE)
+    {
+        return placements;
+    }
+
+    std::map<int, std::vector<int>> nodes = allowed_cpus_by_node();
+    std::vector<std::pair<int, int>> order;  // {cpu, node} in assignment order
+    if (policy == PlacementPolicy::COMPACT)
+    {
+        for (const auto& [node, cpus] : nodes)
+        {
+            for (int cpu : cpus)
+                order.emplace_back(cpu, node);
+        }
+    }
+    else
+    {
+        for (std::size_t i = 0;; ++i)
+        {
+            std::size_t added = 0;
+            for (const auto& [node, cpus] : nodes)
+            {
+                if (i < cpus.size())
+                {
+                    order.emplace_back(cpus[i], node);
+                    ++added;
+                }
+            }
+            if (added == 0)
+                break;
+        }
+    }
+
+    if (order.size() < threads_count)
+    {
+        logger()->warn("{0} threads share {1} CPUs", threads_count, order.size());
+    }
+    // CPUs left after the workers, for SQPOLL threads on the node of their worker, so that
+    // the rings are not accessed across the interconnect
+    std::map<int, std::vector<int>> spare_cpus;
+    for (std::size_t i = threads_count; i < order.size(); ++i)
+    {
+        spare_cpus[order[i].second].push_back(order[i].first);
+    }
+    std::map<int, std::size_t> used_spare_cpus;
+    unsigned shared_sq_threads = 0;
+
+    for (unsigned i = 0; i < threads_count; ++i)
+    {
+        const auto& [cpu, node] = order[i % order.size()];
+        placements[i].cpu = cpu;
+        placements[i].numa_node = node;
+        if (kernel_polling)
+        {
+            const std::vector<int>& node_spare_cpus = spare_cpus[node];
+            std::size_t& used = used_spare_cpus[node];
+            if (used < node_spare_cpus.size())
+            {
+                placements[i].sq_thread_cpu = node_spare_cpus[used++];
+            }
+            else
+            {
+                placements[i].sq_thread_cpu = cpu;
+                ++shared_sq_threads;
+            }
+        }
+    }
+    if (shared_sq_threads != 0)
+    {
+        logger()->warn("Not enough CPUs on their NUMA nodes for {0} SQPOLL threads, they share CPUs with workers",
+                       shared_sq_threads);
+    }
+    return placements;
+}
+
+std::vector<int> listener_index_by_cpu(const std::vector<WorkerPlacement>& placements)
+{
+    std::map<int, std::vector<int>> nodes = allowed_cpus_by_node();
+    int max_cpu = -1;
+    for (const auto& [node, cpus] : nodes)
+    {
+        max_cpu = std::max(max_cpu, *std::max_element(cpus.begin(), cpus.end()));
+    }
+    std::vector<int> listeners(static_cast<std::size_t>(max_cpu + 1), -1);
+
+    std::map<int, std::vector<int>> workers_by_node;
+    for (unsigned i = 0; i < placements.size(); ++i)
+    {
+        if (placements[i].cpu == -1)
+        {
+            continue;
+        }
+        auto& listener = listeners[static_cast<std::size_t>(placements[i].cpu)];
+        if (listener == -1)
+        {
+            listener = static_cast<int>(i);
+        }
+        workers_by_node[placements[i].numa_node].push_back(static_cast<int>(i));
+    }
+    // CPUs without a worker, e.g. ones handling NIC interrupts, stay on their node
+    for (const auto& [node, cpus] : nodes)
+    {
+        const std::vector<int>& node_workers = workers_by_node[node];
+        std::size_t next = 0;
+        for (int cpu : cpus)
+        {
+            auto& listener = listeners[static_cast<std::size_t>(cpu)];
+            if (listener == -1 && !node_workers.empty())
+            {
+                listener = node_workers[next++ % node_workers.size()];
+            }
+        }
+    }
+    return listeners;
+}
+
+void apply_placement(const WorkerPlacement& placement)
+{
+    if (placement.cpu == -1)
+    {
+        return;
+    }
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(placement.cpu, &cpus);
+    syscall_wrapper::sched_setaffinity(cpus);
+    // the default policy already allocates on the local node, unless the process
+    // was started e.g. under numactl --interleave
+    syscall_wrapper::set_mempolicy_local();
+}
+
+}  // namespace hw2
@@ -0,0 +1,57 @@
+#include <relay_pipeline.hpp>
+
+#include <cassert>
+
+namespace hw2
+{
+
+RelayPipeline::RelayPipeline(unsigned depth, unsigned slice_size)
+    : m_depth(depth)
+    , m_slice_size(slice_size)
+{
+    assert(depth != 0 && depth <= MAX_DEPTH);
+}
+
+unsigned RelayPipeline::start_read()
+{
+    assert(this->can_read());
+    m_reading = true;
+    return m_read_slice * m_slice_size;
+}
+
+void RelayPipeline::complete_read(unsigned nread)
+{
+    assert(m_reading);
+    m_reading = false;
+    m_lengths[m_read_slice] = nread;
+    m_read_slice = (m_read_slice + 1) % m_depth;
+    ++m_filled;
+}
+
+void RelayPipeline::set_eof()
+{
+    m_reading = false;
+    m_eof = true;
+}
+
+std::pair<unsigned, unsigned> RelayPipeline::start_write()
+{
+    assert(this->can_write());
+    m_writing = true;
+    return { m_lengths[m_write_slice] - m_write_offset, m_write_slice * m_slice_size + m_write_offset };
+}
+
+void RelayPipeline::complete_write(unsigned nwrite)
+{
+    assert(m_writing);
+    m_writing = false;
+    m_write_offset += nwrite;
+    if (m_write_offset == m_lengths[m_write_slice])
+    {
+        m_write_offset = 0;
+        m_write_slice = (m_write_slice + 1) % m_depth;
+        --m_filled;
+    }
+}
+
+}  // namespace hw2
@@ -0,0 +1,496 @@
+#include <async_logger.hpp>
+#include <resolver.hpp>
+#include <server.hpp>
+#include <syscall.hpp>
+#include <utils.hpp>
+
+#include <arpa/inet.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cctype>
+#include <charconv>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+namespace hw2
+{
+
+namespace
+{
+
+constexpr std::uint16_t DNS_TYPE_A = 1;
+constexpr std::uint16_t DNS_TYPE_AAAA = 28;
+constexpr std::uint16_t DNS_CLASS_IN = 1;
+constexpr std::uint16_t DNS_FLAG_RESPONSE = 0x8000;
+constexpr std::uint16_t DNS_FLAG_RECURSION_DESIRED = 0x0100;
+constexpr std::uint16_t DNS_RCODE_MASK = 0x000F;
+constexpr std::uint16_t DNS_RCODE_NAME_ERROR = 3;
+constexpr unsigned DNS_HEADER_SIZE = 12;
+
+std::uint16_t read_uint16(const byte_t* data)
+{
+    return static_cast<std::uint16_t>((data[0] << 8) | data[1]);
+}
+
+std::uint32_t read_uint32(const byte_t* data)
+{
+    return (static_cast<std::uint32_t>(data[0]) << 24) | (static_cast<std::uint32_t>(data[1]) << 16) |
+           (static_cast<std::uint32_t>(data[2]) << 8) | static_cast<std::uint32_t>(data[3]);
+}
+
+void write_uint16(byte_t* data, std::uint16_t value)
+{
+    data[0] = static_cast<byte_t>(value >> 8);
+    data[1] = static_cast<byte_t>(value & 0xFF);
+}
+
+// returns packet size or 0 if name cannot be encoded
+unsigned encode_query(std::span<byte_t> packet, std::uint16_t id, std::string_view name, std::uint16_t type)
+{
+    if (!name.empty() && name.back() == '.')
+        name.remove_suffix(1);
+    if (name.empty() || name.size() > 253)
+        return 0;
+
+    std::memset(packet.data(), 0, DNS_HEADER_SIZE);
+    write_uint16(packet.data() + 0, id);
+    write_uint16(packet.data() + 2, DNS_FLAG_RECURSION_DESIRED);
+    write_uint16(packet.data() + 4, 1);  // QDCOUNT
+
+    unsigned offset = DNS_HEADER_SIZE;
+    while (!name.empty())
+    {
+        std::size_t label_end = std::min(name.find('.'), name.size());
+        if (label_end == 0 || label_end > 63)
+            return 0;
+        packet[offset++] = static_cast<byte_t>(label_end);
+        std::memcpy(packet.data() + offset, name.data(), label_end);
+        offset += static_cast<unsigned>(label_end);
+        name.remove_prefix(std::min(label_end + 1, name.size()));
+    }
+    packet[offset++] = 0;
+    write_uint16(packet.data() + offset, type);
+    write_uint16(packet.data() + offset + 2, DNS_CLASS_IN);
+    return offset + 4;
+}
+
+// returns offset right after the (possibly compressed) name or 0 if it is malformed
+unsigned skip_name(std::span<const byte_t> packet, unsigned offset)
+{
+    while (offset < packet.size())
+    {
+        byte_t length = packet[offset];
+        if (length == 0)
+            return offset + 1;
+        if ((length & 0xC0) == 0xC0)
+            return offset + 2 <= packet.size() ? offset + 2 : 0;
+        if ((length & 0xC0) != 0)
+            return 0;
+        offset += length + 1u;
+    }
+    return 0;
+}
+
+bool equal_ignoring_case(std::span<const byte_t> lhs, std::span<const byte_t> rhs)
+{
+    return std::equal(lhs.begin(), lhs.end(), rhs.begin(), rhs.end(), [](byte_t a, byte_t b)
+    {
+        return std::tolower(a) == std::tolower(b);
+    });
+}
+
+// question is the question section of the query we have sent, it must be echoed back
+DnsAnswer parse_response(std::span<const byte_t> packet, std::span<const byte_t> question)
+{
+    DnsAnswer answer;
+    std::uint16_t flags = read_uint16(packet.data() + 2);
+    std::uint16_t question_count = read_uint16(packet.data() + 4);
+    std::uint16_t answer_count = read_uint16(packet.data() + 6);
+
+    if ((flags & DNS_FLAG_RESPONSE) == 0 || question_count != 1 ||
+        packet.size() < DNS_HEADER_SIZE + question.size() ||
+        !equal_ignoring_case(packet.subspan(DNS_HEADER_SIZE, question.size()), question))
+    {
+        return answer;
+    }
+
+    switch (flags & DNS_RCODE_MASK)
+    {
+    case 0:
+        break;
+    case DNS_RCODE_NAME_ERROR:
+        answer.status = DnsAnswer::Status::NAME_ERROR;
+        return answer;
+    default:
+        return answer;
+    }
+
+    std::uint32_t ttl = UINT32_MAX;
+    unsigned offset = DNS_HEADER_SIZE + static_cast<unsigned>(question.size());
+    for (unsigned i = 0; i < answer_count; ++i)
+    {
+        offset = skip_name(packet, offset);
+        if (offset == 0 || offset + 10 > packet.size())
+            return answer;
+        std::uint16_t type = read_uint16(packet.data() + offset);
+        std::uint16_t record_class = read_uint16(packet.data() + offset + 2);
+        std::uint32_t record_ttl = read_uint32(packet.data() + offset + 4);
+        std::uint16_t data_length = read_uint16(packet.data() + offset + 8);
+        offset += 10;
+        if (offset + data_length > packet.size())
+            return answer;
+
+        // CNAME records preceding the addresses also bound the TTL
+        ttl = std::min(ttl, record_ttl);
+        if (type == DNS_TYPE_A && record_class == DNS_CLASS_IN && data_length == sizeof(in_addr) &&
+            answer.ipv4_count < DnsAnswer::MAX_ADDRESSES)
+        {
+            std::memcpy(&answer.ipv4_addresses[answer.ipv4_count++], packet.data() + offset, sizeof(in_addr));
+        }
+        else if (type == DNS_TYPE_AAAA && record_class == DNS_CLASS_IN && data_length == sizeof(in6_addr) &&
+                 answer.ipv6_count < DnsAnswer::MAX_ADDRESSES)
+        {
+            std::memcpy(&answer.ipv6_addresses[answer.ipv6_count++], packet.data() + offset, sizeof(in6_addr));
+        }
+        offset += data_length;
+    }
+
+    if (answer.ipv4_count == 0 && answer.ipv6_count == 0)
+    {
+        answer.status = DnsAnswer::Status::NAME_ERROR;
+        return answer;
+    }
+    answer.status = DnsAnswer::Status::SUCCESS;
+    answer.ttl = ttl;
+    return answer;
+}
+
+using NameBuffer = std::array<char, Resolver::MAX_NAME_LENGTH + 1>;
+
+// lowercases the name and strips the trailing dot, the result is null-terminated
+// inside the buffer; returns an empty view if the name is too long
+std::string_view normalize_name(std::string_view name, NameBuffer& buffer)
+{
+    if (!name.empty() && name.back() == '.')
+        name.remove_suffix(1);
+    if (name.size() > Resolver::MAX_NAME_LENGTH)
+        return {};
+    std::transform(name.begin(), name.end(), buffer.begin(), [](unsigned char c)
+    {
+        return static_cast<char>(std::tolower(c));
+    });
+    buffer[name.size()] = '\0';
+    return { buffer.data(), name.size() };
+}
+
+}  // namespace
+
+ResolverConfig ResolverConfig::from_system()
+{
+    ResolverConfig config;
+    config.set_nameserver("127.0.0.1");
+
+    std::ifstream resolv_conf("/etc/resolv.conf");
+    std::string line;
+    while (std::getline(resolv_conf, line))
+    {
+        std::istringstream stream(line);
+        std::string keyword;
+        std::string address;
+        in_addr parsed;
+        if (stream >> keyword >> address && keyword == "nameserver" &&
+            ::inet_pton(AF_INET, address.c_str(), &parsed) == 1)
+        {
+            config.set_nameserver(address);
+            break;
+        }
+    }
+
+    std::ifstream hosts("/etc/hosts");
+    while (std::getline(hosts, line))
+    {
+        line.erase(std::find(line.begin(), line.end(), '#'), line.end());
+        std::istringstream stream(line);
+        std::string address;
+        in_addr parsed;
+        if (!(stream >> address) || ::inet_pton(AF_INET, address.c_str(), &parsed) != 1)
+            continue;
+        std::string name;
+        NameBuffer buffer;
+        while (stream >> name)
+            config.hosts.emplace(normalize_name(name, buffer), parsed);
+    }
+
+    return config;
+}
+
+void ResolverConfig::set_nameserver(std::string_view address)
+{
+    in_port_t port = 53;
+    std::size_t colon = address.find(':');
+    if (colon != std::string_view::npos)
+    {
+        std::string_view port_string = address.substr(colon + 1);
+        auto [ptr, error] = std::from_chars(port_string.data(), port_string.data() + port_string.size(), port);
+        if (error != std::errc() || ptr != port_string.data() + port_string.size())
+            throw std::invalid_argument("Invalid nameserver port");
+        address = address.substr(0, colon);
+    }
+
+    std::memset(&nameserver, 0, sizeof(nameserver));
+    nameserver.sin_family = AF_INET;
+    nameserver.sin_port = ::htons(port);
+    if (::inet_pton(AF_INET, std::string(address).c_str(), &nameserver.sin_addr) != 1)
+        throw std::invalid_argument("Invalid nameserver address");
+}
+
+Resolver::Resolver(IoUring& server, const ResolverConfig& config)
+    : m_server(server)
+    , m_config(config)
+    , m_fd(syscall_wrapper::socket_udp_ipv4())
+    , m_cache(config.cache_capacity)
+    , m_random_engine(std::random_device{}())
+{
+    try
+    {
+        // connected UDP socket only accepts datagrams from the nameserver
+        syscall_wrapper::connect(m_fd, m_config.nameserver);
+    }
+    catch (...)
+    {
+        syscall_wrapper::close(m_fd);
+        throw;
+    }
+}
+
+Resolver::~Resolver()
+{
+    try
+    {
+        syscall_wrapper::close(m_fd);
+    }
+    catch (...)
+    {
+        logger()->critical("Unhandled exception in Resolver::~Resolver");
+        std::exit(EXIT_FAILURE);
+    }
+}
+
+std::optional<DnsAnswer> Resolver::resolve_locally(std::string_view name)
+{
+    DnsAnswer answer;
+    // SOCKS5 names carry their length, so "1.2.3.4\0evil" must not pass as the literal below
+    if (name.find('\0') != std::string_view::npos)
+    {
+        answer.status = DnsAnswer::Status::NAME_ERROR;
+        return answer;
+    }
+    NameBuffer buffer;
+    std::string_view normalized_name = normalize_name(name, buffer);
+    if (normalized_name.empty())
+    {
+        answer.status = DnsAnswer::Status::NAME_ERROR;
+        return answer;
+    }
+
+    answer.status = DnsAnswer::Status::SUCCESS;
+    if (::inet_pton(AF_INET6, buffer.data(), &answer.ipv6_addresses[0]) == 1)
+    {
+        answer.ipv6_count = 1;
+        return answer;
+    }
+    answer.ipv4_count = 1;
+    if (::inet_pton(AF_INET, buffer.data(), &answer.ipv4_addresses[0]) == 1)
+        return answer;
+
+    auto it = m_config.hosts.find(normalized_name);
+    if (it != m_config.hosts.end())
+    {
+        answer.ipv4_addresses[0] = it->second;
+        return answer;
+    }
+
+    if (const DnsAnswer* cached = m_cache.find(normalized_name, DnsCache::clock_type::now()))
+    {
+        LOG_DEBUG("DNS cache hit for '{0}'", normalized_name);
+        return *cached;
+    }
+
+    return std::nullopt;
+}
+
+bool Resolver::resolve(Session* client, std::string_view name)
+{
+    NameBuffer buffer;
+    std::string_view normalized_name = normalize_name(name, buffer);
+
+    auto existing = m_queries.find(normalized_name);
+    if (existing != m_queries.end())
+    {
+        LOG_DEBUG("Joining in-flight query for '{0}'", normalized_name);
+        ++client->awaiting_events_count;
+        existing->second->clients.push_back(client);
+        return true;
+    }
+
+    auto query = std::make_unique<Query>();
+    const std::uint16_t types[] = { DNS_TYPE_A, DNS_TYPE_AAAA };
+    for (unsigned i = 0; i < query->questions.size(); ++i)
+    {
+        Question& question = query->questions[i];
+        question.id = this->generate_query_id();
+        question.packet_size = encode_query(question.packet, question.id, normalized_name, types[i]);
+        if (question.packet_size == 0)
+        {
+            for (unsigned j = 0; j < i; ++j)
+                m_queries_by_id.erase(query->questions[j].id);
+            return false;
+        }
+        question.attempts = 0;
+        question.answered = false;
+        // reserved right away, so that the second question gets another id
+        m_queries_by_id.emplace(question.id, query.get());
+    }
+
+    ++client->awaiting_events_count;
+    query->clients.push_back(client);
+    query->name = normalized_name;
+    for (Question& question : query->questions)
+        this->send_question(question);
+    m_queries.emplace(query->name, std::move(query));
+    return true;
+}
+
+void Resolver::send_question(Question& question)
+{
+    ++question.attempts;
+    question.deadline = std::chrono::steady_clock::now() + QUERY_TIMEOUT;
+    ++m_sends_in_flight;
+    m_server.add_dns_send_request(question.packet.data(), question.packet_size);
+}
+
+void Resolver::record_answer(Query& query, Question& question, const DnsAnswer& answer)
+{
+    question.answered = true;
+    question.status = answer.status;
+    m_queries_by_id.erase(question.id);
+    if (answer.status != DnsAnswer::Status::SUCCESS)
+        return;
+
+    DnsAnswer& merged = query.answer;
+    merged.ttl = merged.ipv4_count + merged.ipv6_count == 0 ? answer.ttl : std::min(merged.ttl, answer.ttl);
+    for (unsigned i = 0; i < answer.ipv4_count && merged.ipv4_count < DnsAnswer::MAX_ADDRESSES; ++i)
+        merged.ipv4_addresses[merged.ipv4_count++] = answer.ipv4_addresses[i];
+    for (unsigned i = 0; i < answer.ipv6_count && merged.ipv6_count < DnsAnswer::MAX_ADDRESSES; ++i)
+        merged.ipv6_addresses[merged.ipv6_count++] = answer.ipv6_addresses[i];
+}
+
+void Resolver::complete_query(QueryMap::iterator it)
+{
+    std::unique_ptr<Query> query = std::move(it->second);
+    m_queries.erase(it);
+
+    // a name with addresses of one family succeeds, even if the other question failed
+    DnsAnswer& answer = query->answer;
+    bool any_failed = false;
+    bool all_name_errors = true;
+    for (const Question& question : query->questions)
+    {
+        any_failed = any_failed || question.status == DnsAnswer::Status::FAILURE;
+        all_name_errors = all_name_errors && question.status == DnsAnswer::Status::NAME_ERROR;
+    }
+    if (answer.ipv4_count + answer.ipv6_count != 0)
+        answer.status = DnsAnswer::Status::SUCCESS;
+    else
+        answer.status = all_name_errors ? DnsAnswer::Status::NAME_ERROR : DnsAnswer::Status::FAILURE;
+    // a partial answer is not cached, the failed family would be missing for the whole TTL
+    if (!any_failed)
+        m_cache.insert(query->name, answer, DnsCache::clock_type::now());
+
+    // clients may fail and be deleted inside the callback, but the query itself stays intact
+    for (Session* client : query->clients)
+        m_server.handle_resolved(client, answer);
+
+    if (m_sends_in_flight != 0)
+        m_retired_queries.push_back(std::move(query));
+}
+
+std::uint16_t Resolver::generate_query_id()
+{
+    std::uniform_int_distribution<std::uint16_t> distribution;
+    std::uint16_t id;
+    do
+    {
+        id = distribution(m_random_engine);
+    } while (m_queries_by_id.contains(id));
+    return id;
+}
+
+void Resolver::handle_receive(unsigned nread)
+{
+    std::span<const byte_t> packet(m_receive_buffer.data(), nread);
+    if (nread < DNS_HEADER_SIZE)
+    {
+        LOG_ERROR("Truncated DNS response of {0} bytes", nread);
+        return;
+    }
+
+    std::uint16_t id = read_uint16(packet.data());
+    auto it = m_queries_by_id.find(id);
+    if (it == m_queries_by_id.end())
+    {
+        LOG_DEBUG("Unexpected DNS response, probably for an expired query");
+        return;
+    }
+
+    Query& query = *it->second;
+    Question& question = query.questions[0].id == id ? query.questions[0] : query.questions[1];
+    std::span<const byte_t> question_section(question.packet.data() + DNS_HEADER_SIZE,
+                                             question.packet_size - DNS_HEADER_SIZE);
+    DnsAnswer answer = parse_response(packet, question_section);
+    LOG_DEBUG("DNS response for '{0}': {1} IPv4 and {2} IPv6 addresses", query.name, answer.ipv4_count,
+              answer.ipv6_count);
+    this->record_answer(query, question, answer);
+    if (query.is_answered())
+        this->complete_query(m_queries.find(query.name));
+}
+
+void Resolver::handle_send()
+{
+    assert(m_sends_in_flight != 0);
+    if (--m_sends_in_flight == 0)
+        m_retired_queries.clear();
+}
+
+void Resolver::handle_tick()
+{
+    auto now = std::chrono::steady_clock::now();
+    for (auto it = m_queries.begin(); it != m_queries.end();)
+    {
+        auto current = it++;
+        Query& query = *current->second;
+        for (Question& question : query.questions)
+        {
+            if (question.answered || question.deadline > now)
+                continue;
+
+            if (question.attempts < MAX_ATTEMPTS)
+            {
+                LOG_DEBUG("DNS query for '{0}' timed out, retrying", query.name);
+                this->send_question(question);
+            }
+            else
+            {
+                LOG_ERROR("DNS query for '{0}' timed out", query.name);
+                this->record_answer(query, question, DnsAnswer{});
+            }
+        }
+        if (query.is_answered())
+            this->complete_query(current);
+    }
+}
+
+}  // namespace hw2
@@ -1,3 +1,4 @@
+#include <async_logger.hpp>
 #include <server.hpp>
 #include <socket.hpp>
 #include <syscall.hpp>
@@ -6,58 +7,97 @@
 #include <spdlog/fmt/bin_to_hex.h>
 
 #include <arpa/inet.h>
+#include <fcntl.h>
 #include <liburing.h>
-#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
 
 #include <algorithm>
+#include <bit>
 #include <cassert>
+#include <exception>
+#include <fstream>
 #include <functional>
 #include <memory>
+#include <optional>
 #include <queue>
 #include <span>
+#include <string>
+#include <utility>
 #include <vector>
 
 namespace hw2
 {
 
-EventPool::EventPool(std::size_t nconnections)
-    : total_events_count(4 * nconnections)  // read & write for client & destination
-    , m_events(total_events_count)
+BufferPool::InsufficientBuffersException::~InsufficientBuffersException() = default;
+
+std::vector<BufferPool::SizeClass> BufferPool::single_class(unsigned nconnections, unsigned buffer_size)
+{
+    return { SizeClass{ buffer_size, 2 * nconnections } };
+}
+
+std::vector<BufferPool::SizeClass> BufferPool::adaptive_classes(unsigned nconnections, unsigned sessions_per_64k_buffer,
+                                                                unsigned sessions_per_256k_buffer)
 {
-    for (std::size_t i = 0; i < total_events_count; ++i)
+    // most directions of most sessions are interactive or short-lived, only bulk transfers climb up
+    std::vector<SizeClass> size_classes = {
+        SizeClass{ 1u << 12, 2 * nconnections },
+        SizeClass{ 1u << 14, nconnections },
+    };
+    // a larger class is left out too once a smaller one is, sessions climb one class at a time
+    for (auto [buffer_size, sessions_per_buffer] : { std::pair{ 1u << 16, sessions_per_64k_buffer },
+                                                     std::pair{ 1u << 18, sessions_per_256k_buffer } })
     {
-        m_events[i].id = i;
-        m_free_events.push(i);
+        if (sessions_per_buffer == 0)
+            break;
+        size_classes.push_back(SizeClass{ buffer_size, std::max(nconnections / sessions_per_buffer, 1u) });
     }
+    return size_classes;
 }
 
-Event& EventPool::obtain_event()
+namespace
 {
-    assert(!m_free_events.empty());
-    std::size_t free_event_index = m_free_events.front();
-    m_free_events.pop();
-    return m_events[free_event_index];
-}
 
-void EventPool::return_event(const Event &event)
+constexpr std::size_t CLASS_ALIGNMENT = 1 << 12;
+
+std::size_t class_memory_size(const BufferPool::SizeClass& size_class)
 {
-    m_free_events.push(event.id);
+    std::size_t size = std::size_t{ size_class.buffer_count } * size_class.buffer_size;
+    return (size + CLASS_ALIGNMENT - 1) / CLASS_ALIGNMENT * CLASS_ALIGNMENT;
 }
 
-BufferPool::InsufficientBuffersException::~InsufficientBuffersException() = default;
+}  // namespace
+
+std::size_t BufferPool::memory_size(const std::vector<SizeClass>& size_classes)
+{
+    std::size_t size = 0;
+    for (const SizeClass& size_class : size_classes)
+    {
+        size += class_memory_size(size_class);
+    }
+    return size;
+}
 
-BufferPool::BufferPool(unsigned nconnections)
-    : total_buffer_count(nconnections)
-    , m_buffers(total_buffer_count * BUFFER_SIZE)
-    , m_iovecs(2 * total_buffer_count)
+BufferPool::BufferPool(const std::vector<SizeClass>& size_classes, HugePages huge_pages)
+    : m_arena(memory_size(size_classes), huge_pages)
 {
-    for (unsigned i = 0; i < total_buffer_count; ++i)
+    unsigned first_buffer_id = 0;
+    byte_t* memory = m_arena.data();
+    for (const SizeClass& size_class : size_classes)
     {
-        m_free_buffers.push(i);
-        m_iovecs[2 * i].iov_base = m_buffers.data() + 2 * i * HALF_BUFFER_SIZE;
-        m_iovecs[2 * i].iov_len = HALF_BUFFER_SIZE;
-        m_iovecs[2 * i + 1].iov_base = m_buffers.data() + (2 * i + 1) * HALF_BUFFER_SIZE;
-        m_iovecs[2 * i + 1].iov_len = HALF_BUFFER_SIZE;
+        assert(m_classes.empty() || m_classes.back().buffer_size < size_class.buffer_size);
+        Class& c = m_classes.emplace_back();
+        c.buffer_size = size_class.buffer_size;
+        c.buffer_count = size_class.buffer_count;
+        c.first_buffer_id = first_buffer_id;
+        c.memory = memory;
+        for (unsigned i = 0; i < c.buffer_count; ++i)
+        {
+            c.free_buffers.push(first_buffer_id + i);
+        }
+        m_iovecs.push_back(iovec{ c.memory, std::size_t{c.buffer_count} * c.buffer_size });
+        first_buffer_id += c.buffer_count;
+        memory += class_memory_size(size_class);
     }
 }
 
@@ -71,811 +111,2314 @@ std::span<iovec> BufferPool::get_iovecs()
     return { m_iovecs.data(), m_iovecs.size() };
 }
 
-unsigned BufferPool::obtain_free_buffer()
+unsigned BufferPool::obtain_buffer(unsigned size_class)
 {
-    if (UNLIKELY(m_free_buffers.empty()))
+    std::optional<unsigned> buffer_id = this->try_obtain_buffer(size_class);
+    if (UNLIKELY(!buffer_id))
     {
         throw InsufficientBuffersException("");
     }
-    unsigned free_buffer_index = m_free_buffers.front();
-    m_free_buffers.pop();
-    return free_buffer_index;
+    return *buffer_id;
 }
 
-void BufferPool::return_buffer(unsigned buffer_index)
+std::optional<unsigned> BufferPool::try_obtain_buffer(unsigned size_class)
 {
-    m_free_buffers.push(buffer_index);
+    std::queue<unsigned>& free_buffers = m_classes[size_class].free_buffers;
+    if (free_buffers.empty())
+    {
+        return std::nullopt;
+    }
+    unsigned buffer_id = free_buffers.front();
+    free_buffers.pop();
+    return buffer_id;
 }
 
-std::span<const byte_t> BufferPool::buffer_half0(unsigned buffer_index) const
+void BufferPool::return_buffer(unsigned buffer_id)
 {
-    return { m_buffers.data() + buffer_index * BUFFER_SIZE, m_buffers.data() + buffer_index * BUFFER_SIZE + HALF_BUFFER_SIZE };
+    m_classes[this->size_class_of(buffer_id)].free_buffers.push(buffer_id);
 }
 
-std::span<byte_t> BufferPool::buffer_half0(unsigned buffer_index)
+std::span<const byte_t> BufferPool::buffer(unsigned buffer_id) const
 {
-    return { m_buffers.data() + buffer_index * BUFFER_SIZE, m_buffers.data() + buffer_index * BUFFER_SIZE + HALF_BUFFER_SIZE };
+    const Class& c = m_classes[this->size_class_of(buffer_id)];
+    return { c.memory + std::size_t{buffer_id - c.first_buffer_id} * c.buffer_size, c.buffer_size };
 }
 
-std::span<const byte_t> BufferPool::buffer_half1(unsigned buffer_index) const
+std::span<byte_t> BufferPool::buffer(unsigned buffer_id)
 {
-    return { m_buffers.data() + buffer_index * BUFFER_SIZE + HALF_BUFFER_SIZE, m_buffers.data() + (buffer_index + 1) * BUFFER_SIZE };
+    Class& c = m_classes[this->size_class_of(buffer_id)];
+    return { c.memory + std::size_t{buffer_id - c.first_buffer_id} * c.buffer_size, c.buffer_size };
 }
 
-std::span<byte_t> BufferPool::buffer_half1(unsigned buffer_index)
+unsigned BufferPool::size_class_of(unsigned buffer_id) const
 {
-    return { m_buffers.data() + buffer_index * BUFFER_SIZE + HALF_BUFFER_SIZE, m_buffers.data() + (buffer_index + 1) * BUFFER_SIZE };
+    unsigned size_class = 0;
+    while (size_class + 1 < m_classes.size() && buffer_id >= m_classes[size_class + 1].first_buffer_id)
+    {
+        ++size_class;
+    }
+    return size_class;
 }
 
-IoUring::IoUring(const MainSocket& socket, unsigned nconnections, bool kernel_polling)
-    : m_socket(socket)
-    , m_event_pool(nconnections)
-    , m_buffer_pool(nconnections)
-    , m_is_root(::geteuid() == 0 ? true : false)
+unsigned BufferPool::in_use_count(unsigned size_class) const
+{
+    const Class& c = m_classes[size_class];
+    return c.buffer_count - static_cast<unsigned>(c.free_buffers.size());
+}
+
+void BufferSizePolicy::record_read(unsigned nread, unsigned buffer_size, unsigned smaller_buffer_size)
 {
-    if (kernel_polling)
+    if (nread == buffer_size)
     {
-        if (!m_is_root)
-        {
-            throw std::runtime_error("You need root privileges to do kernel polling.");
-        }
+        ++m_full_reads;
+        m_small_reads = 0;
     }
-
-    struct io_uring_params params;
-    std::memset(&params, 0, sizeof(io_uring_params));
-    params.flags = kernel_polling ? IORING_SETUP_SQPOLL | IORING_SETUP_SQ_AFF : 0;
-    params.sq_thread_idle = 5'000;
-    if (io_uring_queue_init_params(nconnections, &m_ring, &params) != 0)
+    else if (nread <= smaller_buffer_size / 2)
     {
-        std::perror("io_uring_queue_init_params");
-        throw std::runtime_error("io_uring_queue_init_params");
+        ++m_small_reads;
+        m_full_reads = 0;
     }
-
-    if (m_is_root)
+    else
     {
-        std::span<const iovec> iovecs = m_buffer_pool.get_iovecs();
-        int res = io_uring_register_buffers(&m_ring, iovecs.data(), static_cast<unsigned>(iovecs.size()));
-        if (res != 0)
-        {
-            std::perror("io_uring_register_buffers");
-            throw std::runtime_error("io_uring_register_buffers");
-        }
+        m_full_reads = 0;
+        m_small_reads = 0;
     }
 }
 
-IoUring::~IoUring()
+int BufferSizePolicy::take_decision()
 {
-    io_uring_queue_exit(&m_ring);
+    int decision = 0;
+    if (m_full_reads >= PROMOTE_AFTER_FULL_READS)
+        decision = 1;
+    else if (m_small_reads >= DEMOTE_AFTER_SMALL_READS)
+        decision = -1;
+    if (decision != 0)
+    {
+        m_full_reads = 0;
+        m_small_reads = 0;
+    }
+    return decision;
 }
 
-void IoUring::handle_accept(const io_uring_cqe* cqe)
+BufferRing::BufferRing(io_uring& ring, unsigned entries_, unsigned buffer_size_)
+    : entries(entries_)
+    , buffer_size(buffer_size_)
+    , m_ring(ring)
 {
-    this->add_client_accept_request(&m_client_addr, &m_client_addr_len);
-    int fd = cqe->res;
-    Session* client;
-    try
+    assert(entries != 0 && entries <= MAX_ENTRIES && std::has_single_bit(entries));
+    m_buffers.reset(new byte_t[std::size_t{entries} * buffer_size]);
+
+    int res = 0;
+    m_buf_ring = io_uring_setup_buf_ring(&m_ring, entries, GROUP_ID, 0, &res);
+    if (m_buf_ring == nullptr)
     {
-        client = new Session{fd, *this, m_buffer_pool};
+        logger()->error("io_uring_setup_buf_ring failed: {0}", std::strerror(-res));
+        throw syscall_wrapper::Error("io_uring_setup_buf_ring", -res);
     }
-    catch (const BufferPool::InsufficientBuffersException&)
+    int mask = io_uring_buf_ring_mask(entries);
+    for (unsigned i = 0; i < entries; ++i)
     {
-        logger()->error("Server capacity exceeded");
-        syscall_wrapper::close(fd);
-        return;
+        io_uring_buf_ring_add(m_buf_ring, m_buffers.get() + std::size_t{i} * buffer_size, buffer_size,
+                              static_cast<unsigned short>(i), mask, static_cast<int>(i));
     }
-    client->awaiting_events_count = 1;
-    client->read_some_from_client(3);
+    io_uring_buf_ring_advance(m_buf_ring, static_cast<int>(entries));
 }
 
-void IoUring::event_loop()
+BufferRing::~BufferRing()
 {
-    this->add_client_accept_request(&m_client_addr, &m_client_addr_len);
+    io_uring_free_buf_ring(&m_ring, m_buf_ring, entries, GROUP_ID);
+}
 
-    for (;;)
-    {
-        io_uring_cqe* cqe;
-        if (UNLIKELY(io_uring_wait_cqe(&m_ring, &cqe) < 0))
-        {
-            int error_code = errno;
-            logger()->error("io_uring_wait_cqe failed: {0}", std::strerror(error_code));
-            throw syscall_wrapper::Error("io_uring_wait_cqe", error_code);
-        }
+std::span<byte_t> BufferRing::buffer(unsigned short buffer_id)
+{
+    assert(buffer_id < entries);
+    return { m_buffers.get() + std::size_t{buffer_id} * buffer_size, buffer_size };
+}
 
-        if (UNLIKELY(cqe->res < 0))
-        {
-            logger()->error("CQE fail: {0}", std::strerror(-cqe->res));
-            if (cqe->user_data != 0)
-            {
-                Event* event = reinterpret_cast<Event*>(cqe->user_data);
-                --event->client->awaiting_events_count;
-                if (event->client->awaiting_events_count == 0)
-                    delete event->client;
-                else
-                    event->client->fail_immediately();
-                m_event_pool.return_event(*event);
-            }
-        }
-        else
-        {
-            if (cqe->user_data == 0) // accept
-            {
-                this->handle_accept(cqe);
-            }
-            else
-            {
-                Event* event = reinterpret_cast<Event*>(cqe->user_data);
-                --event->client->awaiting_events_count;
-                if (event->client->is_failed())
-                {
-                    if (event->client->awaiting_events_count == 0)
-                    {
-                        delete event->client;
-                    }
-                }
-                else
-                {
-                    switch (event->type)
-                    {
-#ifndef NDEBUG
-                    case EventType::CLIENT_ACCEPT:
-                        assert(false);
-                        break;
-#endif
-                    case EventType::CLIENT_READ:
-                        if (LIKELY(cqe->res != 0))
-                        {
-                            event->client->handle_client_read(static_cast<unsigned>(cqe->res));
-                        }
-                        else  // empty read indicates that client disconnected
-                        {
-                            event->client->fail_immediately();
-                        }
-                        break;
-                    case EventType::CLIENT_WRITE:
-                        event->client->handle_client_write(static_cast<unsigned>(cqe->res));
-                        break;
-                    case EventType::DESTINATION_CONNECT:
-                        event->client->handle_destination_connect();
-                        break;
-                    case EventType::DESTINATION_READ:
-                        if (LIKELY(cqe->res != 0))
-                        {
-                            event->client->handle_destination_read(static_cast<unsigned>(cqe->res));
-                        }
-                        else  // empty read indicates that destination disconnected
-                        {
-                            event->client->fail_immediately();
-                        }
-                        break;
-                    case EventType::DESTINATION_WRITE:
-                        event->client->handle_destination_write(static_cast<unsigned>(cqe->res));
-                        break;
-                    }
-                    if (event->client->is_failed() && event->client->awaiting_events_count == 0)
-                    {
-                        delete event->client;
-                    }
-                }
-                m_event_pool.return_event(*event);
-            }
-        }
-        io_uring_cqe_seen(&m_ring, cqe);
-    }
+void BufferRing::take_buffer([[maybe_unused]] unsigned short buffer_id)
+{
+    assert(buffer_id < entries);
+    ++m_in_use_count;
 }
 
-void IoUring::add_client_accept_request(struct sockaddr_in* client_addr, socklen_t* client_addr_len)
+void BufferRing::return_buffer(unsigned short buffer_id)
 {
-    io_uring_sqe* sqe = io_uring_get_sqe(&m_ring);
-    io_uring_prep_accept(sqe, m_socket.fd(), reinterpret_cast<struct sockaddr*>(client_addr), client_addr_len, 0);
-    io_uring_sqe_set_data(sqe, nullptr);
-    io_uring_submit(&m_ring);
+    assert(m_in_use_count != 0);
+    io_uring_buf_ring_add(m_buf_ring, this->buffer(buffer_id).data(), buffer_size, buffer_id,
+                          io_uring_buf_ring_mask(entries), 0);
+    io_uring_buf_ring_advance(m_buf_ring, 1);
+    --m_in_use_count;
+    ++m_returned_count;
 }
 
-void IoUring::add_client_read_request(Session* client)
+unsigned BufferRing::take_returned_count()
 {
-    ++client->awaiting_events_count;
-    io_uring_sqe* sqe = io_uring_get_sqe(&m_ring);
-    if (m_is_root)
+    return std::exchange(m_returned_count, 0);
+}
+
+FileTable::FileTable(io_uring& ring, unsigned accept_slots_, unsigned size_)
+    : accept_slots(accept_slots_)
+    , size(size_)
+{
+    assert(accept_slots <= size);
+    int res = io_uring_register_files_sparse(&ring, size);
+    if (res != 0)
     {
-        io_uring_prep_read_fixed(sqe, client->fd(), client->buffer0().data(), BufferPool::HALF_BUFFER_SIZE,
-                                 0, static_cast<int>(client->buffer0_index));
+        logger()->error("io_uring_register_files_sparse failed: {0}", std::strerror(-res));
+        throw syscall_wrapper::Error("io_uring_register_files_sparse", -res);
     }
-    else
+    res = io_uring_register_file_alloc_range(&ring, 0, accept_slots);
+    if (res != 0)
+    {
+        logger()->error("io_uring_register_file_alloc_range failed: {0}", std::strerror(-res));
+        throw syscall_wrapper::Error("io_uring_register_file_alloc_range", -res);
+    }
+    for (unsigned i = accept_slots; i < size; ++i)
     {
-        io_uring_prep_read(sqe, client->fd(), client->buffer0().data(),
-                           BufferPool::BUFFER_SIZE, 0);
+        m_free_slots.push(i);
     }
-    Event& event = m_event_pool.obtain_event();
-    event.client = client;
-    event.type = EventType::CLIENT_READ;
-    io_uring_sqe_set_data(sqe, &event);
-    io_uring_submit(&m_ring);
 }
 
-void IoUring::add_client_write_request(Session* client, unsigned nbytes, unsigned offset)
+unsigned FileTable::obtain_slot()
 {
-    ++client->awaiting_events_count;
-    io_uring_sqe* sqe = io_uring_get_sqe(&m_ring);
-    if (m_is_root)
-    {
-        io_uring_prep_write_fixed(sqe, client->fd(), client->buffer1().data(),
-                                  nbytes, offset, static_cast<int>(client->buffer1_index));
-    }
-    else
+    assert(!m_free_slots.empty());
+    unsigned slot = m_free_slots.front();
+    m_free_slots.pop();
+    return slot;
+}
+
+void FileTable::return_slot(unsigned slot)
+{
+    if (slot < accept_slots)
     {
-        io_uring_prep_write(sqe, client->fd(), client->buffer1().data(), nbytes, offset);
+        return;  // the kernel reuses it once close_direct completes
     }
-    Event& event = m_event_pool.obtain_event();
-    event.client = client;
-    event.type = EventType::CLIENT_WRITE;
-    io_uring_sqe_set_data(sqe, &event);
-    io_uring_submit(&m_ring);
+    m_free_slots.push(slot);
 }
 
-void IoUring::add_destination_connect_request(Session* client)
+namespace
 {
-    io_uring_sqe* sqe = io_uring_get_sqe(&m_ring);
-    io_uring_prep_connect(sqe, client->destination_socket()->fd(),
-                          client->destination_socket()->address(),
-                          client->destination_socket()->address_length());
-    Event& event = m_event_pool.obtain_event();
-    event.client = client;
-    event.type = EventType::DESTINATION_CONNECT;
-    io_uring_sqe_set_data(sqe, &event);
-    io_uring_submit(&m_ring);
+
+std::vector<BufferPool::SizeClass> buffer_size_classes(unsigned nconnections, const ServerOptions& options)
+{
+    switch (options.relay_mode)
+    {
+    case RelayMode::COPY:
+        if (options.adaptive_buffers)
+            return BufferPool::adaptive_classes(nconnections, options.sessions_per_64k_buffer,
+                                                options.sessions_per_256k_buffer);
+        return BufferPool::single_class(nconnections, BufferPool::DEFAULT_BUFFER_SIZE);
+    case RelayMode::BUFFER_RING:
+        return BufferPool::single_class(nconnections, BufferPool::HANDSHAKE_BUFFER_SIZE);
+    case RelayMode::PIPELINED:
+        return BufferPool::single_class(nconnections, options.pipeline_depth * BufferPool::DEFAULT_BUFFER_SIZE);
+    default:
+        return BufferPool::single_class(nconnections, BufferPool::DEFAULT_BUFFER_SIZE);
+    }
 }
 
-void IoUring::add_destination_read_request(Session* client)
+unsigned ring_setup_flags(RingSetup setup)
 {
-    ++client->awaiting_events_count;
-    io_uring_sqe* sqe = io_uring_get_sqe(&m_ring);
-    if (m_is_root)
+    switch (setup)
     {
-        io_uring_prep_read_fixed(sqe, client->destination_socket()->fd(), client->buffer1().data(),
-                                 BufferPool::HALF_BUFFER_SIZE, 0, static_cast<int>(client->buffer1_index));
+    case RingSetup::PLAIN:
+        return 0;
+    case RingSetup::SINGLE_ISSUER:
+        return IORING_SETUP_SINGLE_ISSUER;
+    case RingSetup::COOP_TASKRUN:
+        return IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+    case RingSetup::DEFER_TASKRUN:
+        return IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN | IORING_SETUP_DEFER_TASKRUN;
     }
-    else
+    return 0;
+}
+
+// name of the flag a level adds to the one below
+const char* ring_setup_name(RingSetup setup)
+{
+    switch (setup)
     {
-        io_uring_prep_read(sqe, client->destination_socket()->fd(), client->buffer1().data(),
-                           BufferPool::HALF_BUFFER_SIZE, 0);
+    case RingSetup::PLAIN:
+        return "plain setup";
+    case RingSetup::SINGLE_ISSUER:
+        return "IORING_SETUP_SINGLE_ISSUER";
+    case RingSetup::COOP_TASKRUN:
+        return "IORING_SETUP_COOP_TASKRUN";
+    case RingSetup::DEFER_TASKRUN:
+        return "IORING_SETUP_DEFER_TASKRUN";
     }
-    Event& event = m_event_pool.obtain_event();
-    event.client = client;
-    event.type = EventType::DESTINATION_READ;
-    io_uring_sqe_set_data(sqe, &event);
-    io_uring_submit(&m_ring);
+    return "";
 }
 
-void IoUring::add_destination_write_request(Session* client, unsigned nbytes, unsigned offset)
+}  // namespace
+
+IoUring::IoUring(const MainSocket& socket, unsigned nconnections, const ResolverConfig& resolver_config,
+                 const ServerOptions& options, Metrics& metrics)
+    : m_socket(socket)
+    , m_options(options)
+    , m_buffer_pool(buffer_size_classes(nconnections, options), options.huge_pages)
+    , m_session_pool(nconnections)
+    , m_is_root(::geteuid() == 0 ? true : false)
+    , m_resolver(*this, resolver_config)
+    , m_metrics(metrics)
 {
-    ++client->awaiting_events_count;
-    io_uring_sqe* sqe = io_uring_get_sqe(&m_ring);
-    if (m_is_root)
+    if (m_options.kernel_polling)
+    {
+        if (!m_is_root)
+        {
+            throw std::runtime_error("You need root privileges to do kernel polling.");
+        }
+    }
+
+    unsigned sq_entries = m_options.sq_entries != 0 ? m_options.sq_entries : nconnections;
+    unsigned cq_entries = m_options.cq_entries != 0
+        ? m_options.cq_entries
+        : cq_entries_per_session(m_options) * nconnections + SERVICE_CQ_ENTRIES;
+    RingSetup setup = m_options.kernel_polling ? std::min(m_options.ring_setup, RingSetup::SINGLE_ISSUER)
+                                               : m_options.ring_setup;
+    struct io_uring_params params;
+    for (;;)
+    {
+        std::memset(&params, 0, sizeof(io_uring_params));
+        // sizes above the kernel maximum are clamped to it
+        params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP | ring_setup_flags(setup);
+        params.cq_entries = cq_entries;
+        if (m_options.kernel_polling)
+        {
+            params.flags |= IORING_SETUP_SQPOLL;
+            params.sq_thread_idle = 5'000;
+        }
+        if (m_options.kernel_polling && m_options.sq_thread_cpu >= 0)
+        {
+            params.flags |= IORING_SETUP_SQ_AFF;
+            params.sq_thread_cpu = static_cast<__u32>(m_options.sq_thread_cpu);
+        }
+        int res = io_uring_queue_init_params(sq_entries, &m_ring, &params);
+        if (res == 0)
+        {
+            break;
+        }
+        // unknown flags are rejected with EINVAL
+        if (res != -EINVAL || setup == RingSetup::PLAIN)
+        {
+            errno = -res;
+            std::perror("io_uring_queue_init_params");
+            throw std::runtime_error("io_uring_queue_init_params");
+        }
+        logger()->warn("io_uring rejected {0}, falling back", ring_setup_name(setup));
+        setup = static_cast<RingSetup>(static_cast<int>(setup) - 1);
+    }
+    if (!(params.features & IORING_FEAT_NODROP))
+    {
+        logger()->warn("io_uring drops completions which overflow the CQ, consider a larger CQ");
+    }
+
+    // registered pages are pinned and, without CAP_IPC_LOCK, charged to RLIMIT_MEMLOCK of the
+    // user, which main() raises to the size of all pools; plain reads and writes work regardless
+    std::span<const iovec> iovecs = m_buffer_pool.get_iovecs();
+    int res = io_uring_register_buffers(&m_ring, iovecs.data(), static_cast<unsigned>(iovecs.size()));
+    if (res == 0)
     {
-        io_uring_prep_write_fixed(sqe, client->destination_socket()->fd(), client->buffer0().data(),
-                                  nbytes, offset, static_cast<int>(client->buffer0_index));
+        m_fixed_buffers = true;
     }
     else
     {
-        io_uring_prep_write(sqe, client->destination_socket()->fd(),
-                            client->buffer0().data(), nbytes, offset);
+        logger()->warn("io_uring_register_buffers failed: {0}, using unregistered buffers", std::strerror(-res));
+    }
+
+    if (m_options.zero_copy_threshold != 0)
+    {
+        io_uring_probe* probe = io_uring_get_probe_ring(&m_ring);
+        if (probe != nullptr && io_uring_opcode_supported(probe, IORING_OP_SEND_ZC))
+        {
+            m_zero_copy_threshold = m_options.zero_copy_threshold;
+        }
+        else
+        {
+            logger()->warn("io_uring lacks zero-copy send, writes to clients are copied");
+        }
+        io_uring_free_probe(probe);
+    }
+
+    if (m_options.relay_mode == RelayMode::BUFFER_RING)
+    {
+        m_buffer_ring.emplace(m_ring, m_options.buffer_ring_entries, BufferPool::DEFAULT_BUFFER_SIZE);
+    }
+
+    if (m_options.fixed_files)
+    {
+        m_file_table.emplace(m_ring, ACCEPT_SLOTS_PER_SESSION * nconnections, file_table_size(nconnections));
     }
-    Event& event = m_event_pool.obtain_event();
-    event.client = client;
-    event.type = EventType::DESTINATION_WRITE;
-    io_uring_sqe_set_data(sqe, &event);
-    io_uring_submit(&m_ring);
 }
 
-Session::Session(int fd, IoUring& server, BufferPool& buffer_pool)
-    : m_fd(fd)
-    , m_server(server)
-    , m_buffer_pool(buffer_pool)
-    , m_buffer_index(m_buffer_pool.obtain_free_buffer())
-    , buffer0_index(static_cast<unsigned>(2 * m_buffer_index + 0))
-    , buffer1_index(static_cast<unsigned>(2 * m_buffer_index + 1))
-    , m_buffer0(m_buffer_pool.buffer_half0(m_buffer_index))
-    , m_buffer1(m_buffer_pool.buffer_half1(m_buffer_index))
+std::size_t IoUring::buffer_memory_size(unsigned nconnections, const ServerOptions& options)
 {
-    m_is_read_completed = [](){ return true; };
+    return MemoryArena::mapped_size(BufferPool::memory_size(buffer_size_classes(nconnections, options)),
+                                    options.huge_pages);
 }
 
-int Session::fd() const
+unsigned IoUring::file_table_size(unsigned nconnections)
 {
-    return m_fd;
+    return (ACCEPT_SLOTS_PER_SESSION + DESTINATION_SLOTS_PER_SESSION) * nconnections;
 }
 
-void Session::fail_delayed()
+unsigned IoUring::descriptors_per_session(const ServerOptions& options)
 {
-    m_is_failed = true;
-    m_destination_socket.reset();
+    unsigned sockets = options.fixed_files ? 0 : 2;
+    unsigned pipe_ends = options.relay_mode == RelayMode::SPLICE ? 4 : 0;
+    return sockets + pipe_ends;
 }
 
-void Session::fail_immediately()
+unsigned IoUring::cq_entries_per_session(const ServerOptions& options)
 {
-    this->fail_delayed();
-    int fd = m_fd;
-    m_fd = -1;
-    syscall_wrapper::close(fd);
+    // the connect race and the relay do not overlap; the race has a connect per attempt in flight,
+    // the Fast Open sendmsg of attempt 0 and the delay before the next attempt
+    unsigned connecting = DESTINATION_SLOTS_PER_SESSION + (options.fast_open ? 1 : 0) + 1;
+    // the relay has a read and a write per direction, and the notification of a zero-copy send to
+    // the client trails it; notifications left by partial sends and failed cancels of an aborted
+    // session may exceed that, the kernel keeps such an overflow until the CQ is reaped
+    unsigned relaying = 4 + (options.zero_copy_threshold != 0 ? 1 : 0);
+    return std::max(connecting, relaying);
 }
 
-bool Session::is_failed() const
+IoUring::~IoUring()
 {
-    return m_is_failed;
+    m_buffer_ring.reset();  // unregisters itself from the ring
+    io_uring_queue_exit(&m_ring);
 }
 
-void Session::read_from_client()
+void IoUring::handle_accept(const io_uring_cqe* cqe)
 {
-    m_is_read_completed = [this](){ return !m_read_buffer.empty(); };
-    if (m_is_read_completed())
+    if (UNLIKELY(cqe->res < 0))
+    {
+        LOG_ERROR("Accept failed: {0}", std::strerror(-cqe->res));
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+        {
+            m_accept_paused = true;
+        }
+        return;
+    }
+    if (!m_options.multishot_accept || !(cqe->flags & IORING_CQE_F_MORE))
     {
-        handle_client_read(0);
+        // single shot, or the kernel terminated the multishot request (e.g. on CQ overflow)
+        this->add_client_accept_request(&m_client_addr, &m_client_addr_len);
     }
-    else
+
+    int fd = cqe->res;  // a FileTable slot if fixed files are used
+    m_metrics.accepts.add();
+    Session* client = nullptr;
+    try
     {
-        m_server.add_client_read_request(this);
+        client = m_session_pool.create(fd, *this, m_buffer_pool);
+    }
+    catch (const BufferPool::InsufficientBuffersException&)
+    {
+        m_metrics.buffer_pool_exhaustions.add();
+    }
+    if (UNLIKELY(client == nullptr))
+    {
+        LOG_ERROR("Server capacity exceeded");
+        m_metrics.sessions_rejected.add();
+        if (m_file_table)
+            this->close_file_slot(static_cast<unsigned>(fd));
+        else
+            syscall_wrapper::close(fd);
+        return;
+    }
+    m_metrics.sessions_opened.add();
+    client->start_handshake();
+    // e.g. a malformed greeting which arrived with the connection
+    if (client->is_failed() && client->awaiting_events_count == 0)
+    {
+        this->destroy_session(client);
     }
 }
 
-void Session::read_some_from_client(unsigned n)
+void IoUring::handle_send_notification(Session* client)
 {
-    m_is_read_completed = [n, this](){ return m_read_buffer.size() >= n; };
-    if (m_is_read_completed())
+    // the session and its buffers outlive every notification, the kernel may read them until then
+    --client->awaiting_events_count;
+    if (client->is_failed())
     {
-        handle_client_read(0);
-    }
-    else
-    {
-        m_server.add_client_read_request(this);
+        if (client->awaiting_events_count == 0)
+        {
+            this->destroy_session(client);
+        }
+        return;
     }
+    client->handle_send_notification();
 }
 
-// write function for common case, when client may
-// intend to write more data than one buffer can contain
-void Session::write_to_client()
+void IoUring::destroy_session(Session* client)
 {
-    unsigned cnt = std::min(BufferPool::HALF_BUFFER_SIZE, static_cast<unsigned>(m_write_client_buffer.size()));
-    std::memcpy(m_buffer1.data(), m_write_client_buffer.data(), cnt);
-    m_server.add_client_write_request(this, cnt);
+    m_timer_wheel.cancel(client->timer_entry());
+    m_session_pool.destroy(client);
+    m_metrics.sessions_closed.add();
 }
 
-void Session::read_client_greeting()
+void IoUring::close_file_slot(unsigned slot)
 {
-    logger()->debug("Reading client greeting");
-    byte_t version = m_read_buffer[0];
-    if (version != 0x05)
-    {
-        this->fail_immediately();
-        return;
-    }
-    m_auth_methods_count = m_read_buffer[1];
-    if (m_auth_methods_count == 0)
-    {
-        this->fail_immediately();
-        return;
-    }
-    this->consume_bytes_from_read_buffer(2);
-    m_state = State::READING_AUTH_METHODS;
-    this->read_some_from_client(m_auth_methods_count);
+    io_uring_sqe* sqe = this->get_sqe();
+    io_uring_prep_close_direct(sqe, slot);
+    io_uring_sqe_set_flags(sqe, IOSQE_CQE_SKIP_SUCCESS);
+    io_uring_sqe_set_data64(sqe, UNTRACKED_USER_DATA);
+    // requests queued after the close and targeting this slot see the new socket
+    m_file_table->return_slot(slot);
 }
 
-void Session::read_auth_methods()
+void IoUring::shutdown_socket(int fd)
 {
-    logger()->debug("Reading auth methods");
-    byte_t* from = m_read_buffer.data();
-    byte_t* to = m_read_buffer.data() + m_auth_methods_count;
-    // only 0x00 (no auth) is supported
-    if (std::find(from, to, 0x00) == to)
+    if (m_file_table)
     {
-        m_auth_method = 0xFF;  // no acceptable methods were offered
-        this->fail_delayed();
+        // the slot is resolved on submission, a close queued after it does not affect the shutdown
+        io_uring_sqe* sqe = this->get_sqe();
+        io_uring_prep_shutdown(sqe, fd, SHUT_RDWR);
+        sqe->flags |= IOSQE_FIXED_FILE | IOSQE_CQE_SKIP_SUCCESS;
+        io_uring_sqe_set_data64(sqe, UNTRACKED_USER_DATA);
     }
     else
     {
-        m_auth_method = 0x00;
+        ::shutdown(fd, SHUT_RDWR);  // fails only if the peer reset the connection already
     }
-    this->consume_bytes_from_read_buffer(m_auth_methods_count);
-    m_write_client_buffer.resize(2);
-    m_write_client_buffer[0] = 0x05;
-    m_write_client_buffer[1] = 0x00;
-    this->write_to_client();
 }
 
-void Session::read_client_connection_request()
+void IoUring::cancel_requests(const Session* client)
 {
-    logger()->debug("Reading client connection request");
-    byte_t version = m_read_buffer[0];
-    if (version != 0x05)
-    {
-        logger()->error("Version is not equal to 0x05");
-        this->send_fail_message(0x07);
-        return;
-    }
-
-    byte_t command = m_read_buffer[1];
-    if (command != COMMAND_CONNECT)
+    for (EventType type : { EventType::CLIENT_READ, EventType::CLIENT_WRITE, EventType::DESTINATION_CONNECT,
+                            EventType::DESTINATION_FAST_OPEN, EventType::DESTINATION_READ,
+                            EventType::DESTINATION_WRITE })
     {
-        logger()->error("Command not supported");
-        this->send_fail_message(0x07);
-        return;
+        this->cancel_request(client, type, 0, IORING_ASYNC_CANCEL_ALL);
     }
-    m_command = COMMAND_CONNECT;
+}
 
-    byte_t reserved = m_read_buffer[2];
-    if (reserved != 0x00)
+void IoUring::cancel_socket_requests(int fd)
+{
+    io_uring_sqe* sqe = this->get_sqe();
+    unsigned flags = IORING_ASYNC_CANCEL_ALL;
+    if (m_file_table)
+        flags |= IORING_ASYNC_CANCEL_FD_FIXED;
+    io_uring_prep_cancel_fd(sqe, fd, flags);
+    io_uring_sqe_set_flags(sqe, IOSQE_CQE_SKIP_SUCCESS);
+    io_uring_sqe_set_data64(sqe, UNTRACKED_USER_DATA);
+    if (!m_file_table)
     {
-        logger()->error("Reserved byte is expected to be 0x00");
-        this->send_fail_message(0x07);
-        return;
+        // a plain fd is looked up when the cancel is issued, which must happen before it is closed;
+        // a slot is looked up the same way, but the close of the slot is queued after the cancel
+        this->submit_pending();
     }
+}
 
-    byte_t address_type = m_read_buffer[3];
-
-    this->consume_bytes_from_read_buffer(4);
+void IoUring::cancel_request(const Session* client, EventType type, unsigned index, int flags)
+{
+    io_uring_sqe* sqe = this->get_sqe();
+    io_uring_prep_cancel64(sqe, this->event_tag(client, type, index).encode(), flags);
+    io_uring_sqe_set_flags(sqe, IOSQE_CQE_SKIP_SUCCESS);
+    io_uring_sqe_set_data64(sqe, UNTRACKED_USER_DATA);
+}
 
-    switch (address_type)
+void IoUring::schedule_timeout(Session* client)
+{
+    unsigned timeout = 0;
+    switch (client->timeout())
     {
-    case ADDRESS_TYPE_IPV4:  // IPv4
-        m_address_type = ADDRESS_TYPE_IPV4;
-        m_state = State::READING_ADDRESS;
-        this->read_some_from_client(6);
+    case Session::Timeout::HANDSHAKE:
+        timeout = m_options.handshake_timeout;
         break;
-    case ADDRESS_TYPE_DOMAIN_NAME:  // Domain name
-        m_address_type = ADDRESS_TYPE_DOMAIN_NAME;
-        m_state = State::READING_DOMAIN_NAME_LENGTH;
-        this->read_some_from_client(1);
+    case Session::Timeout::CONNECT:
+        timeout = m_options.connect_timeout;
         break;
-    case ADDRESS_TYPE_IPV6:  // IPv6
-        m_address_type = ADDRESS_TYPE_IPV6;
-        m_state = State::READING_ADDRESS;
-        this->read_some_from_client(18);
-        break;
-    default:
-        logger()->error("Address type is not supported");
-        this->send_fail_message(0x08);
+    case Session::Timeout::IDLE:
+        timeout = m_options.idle_timeout;
         break;
     }
+    this->schedule_timeout(client, timeout);
 }
 
-void Session::read_domain_name_length()
+void IoUring::schedule_timeout(Session* client, std::uint32_t ticks)
 {
-    m_domain_name_length = m_read_buffer[0];
-    this->consume_bytes_from_read_buffer(1);
-    m_state = State::READING_ADDRESS;
-    this->read_some_from_client(m_domain_name_length + 2);
+    if (ticks == 0)
+    {
+        m_timer_wheel.cancel(client->timer_entry());
+        return;
+    }
+    client->touch(m_ticks_count);
+    m_timer_wheel.schedule(client->timer_entry(), m_ticks_count + ticks);
 }
 
-void Session::send_fail_message(byte_t error_code)
+std::uint32_t IoUring::timeout_ticks_left(Session* client) const
 {
-    this->fail_delayed();
-    m_write_client_buffer.resize(10);
-    m_write_client_buffer[0] = 0x05;  // protocol version
-    m_write_client_buffer[1] = error_code;
-    m_write_client_buffer[2] = 0x00;  // reserved
-    m_write_client_buffer[3] = 0x01;  // IPv4
-    std::memset(m_write_client_buffer.data() + 4, 0, 6);
-    this->write_to_client();
+    const TimerWheel::Entry& entry = client->timer_entry();
+    // a scheduled deadline is always ahead, expired ones are unlinked by the tick reaching them
+    return entry.is_scheduled() ? entry.deadline - m_ticks_count : 0;
 }
 
-void Session::translate_errno(int error_code)
+void IoUring::handle_resolved(Session* client, const DnsAnswer& answer)
 {
-    switch (error_code)
+    --client->awaiting_events_count;
+    if (!client->is_failed())
     {
-    case ENETUNREACH:
-        logger()->error("Network unreachable");
-        this->send_fail_message(0x03);
-        break;
-    case EHOSTUNREACH:
-        logger()->error("Host is unreachable");
-        this->send_fail_message(0x04);
-        break;
-    case ECONNREFUSED:
-        logger()->error("Connection refused");
-        this->send_fail_message(0x05);
-        break;
-    default:
-        logger()->error("General failure");
-        this->send_fail_message();
-        break;
+        client->handle_domain_resolved(answer);
+    }
+    if (client->is_failed() && client->awaiting_events_count == 0)
+    {
+        this->destroy_session(client);
     }
 }
 
-void Session::connect_ipv4_destination()
+void IoUring::handle_tick()
 {
-    try
-    {
-        m_destination_socket = std::make_unique<SocketIPv4>(m_ipv4_address, m_port);
-    }
-    catch (syscall_wrapper::Error& e)
+    if (m_accept_paused)
     {
-        this->translate_errno(e.error_code);
+        m_accept_paused = false;
+        this->add_client_accept_request(&m_client_addr, &m_client_addr_len);
     }
-    catch (...)
+    m_resolver.handle_tick();
+    ++m_ticks_count;
+    m_timer_wheel.expire(m_ticks_count, [this](TimerWheel::Entry& entry) { this->handle_timeout(entry.session); });
+    if (m_ticks_count % STATISTICS_INTERVAL_TICKS == 0)
     {
-        logger()->error("General failure");
-        this->send_fail_message();
-        return;
+        this->log_statistics();
     }
-    m_state = State::CONNECTING_TO_DESTINATION;
-    m_server.add_destination_connect_request(this);
 }
 
-void Session::connect_ipv6_destination()
+void IoUring::handle_timeout(Session* client)
 {
-    try
+    if (client->timeout() == Session::Timeout::IDLE && !client->is_failed())
     {
-        m_destination_socket = std::make_unique<SocketIPv6>(m_ipv6_address, m_port);
+        std::uint32_t deadline = client->last_activity_tick() + m_options.idle_timeout;
+        if (deadline > m_ticks_count)
+        {
+            m_timer_wheel.schedule(client->timer_entry(), deadline);
+            return;
+        }
     }
-    catch (syscall_wrapper::Error& e)
+
+    switch (client->timeout())
     {
-        this->translate_errno(e.error_code);
+    case Session::Timeout::HANDSHAKE:
+        LOG_INFO("Handshake timed out");
+        m_metrics.handshake_timeouts.add();
+        break;
+    case Session::Timeout::CONNECT:
+        LOG_INFO("Connecting to destination timed out");
+        m_metrics.connect_timeouts.add();
+        break;
+    case Session::Timeout::IDLE:
+        LOG_INFO("Session idle timeout");
+        m_metrics.idle_timeouts.add();
+        break;
     }
-    catch (...)
+    client->abort();
+    if (client->awaiting_events_count == 0)
     {
-        logger()->error("General failure");
-        this->send_fail_message();
-        return;
+        this->destroy_session(client);
     }
-    m_state = State::CONNECTING_TO_DESTINATION;
-    m_server.add_destination_connect_request(this);
 }
 
-void Session::read_address()
+namespace
 {
-    logger()->debug("Reading address");
-    switch (m_address_type)
-    {
-    case ADDRESS_TYPE_IPV4:
-        std::memcpy(&m_ipv4_address, m_read_buffer.data(), 4);
-        std::memcpy(&m_port, m_read_buffer.data() + 4, 2);
-        logger()->info("Got IPv4 address {0}, port {1}", ::inet_ntoa(m_ipv4_address), m_port);
-        this->consume_bytes_from_read_buffer(6);
-        this->connect_ipv4_destination();
-        break;
 
-    case ADDRESS_TYPE_DOMAIN_NAME:
+// resident set size in KiB or 0 if it cannot be read
+std::size_t resident_set_size_kib()
+{
+    std::ifstream statm("/proc/self/statm");
+    std::size_t size_pages = 0;
+    std::size_t resident_pages = 0;
+    if (!(statm >> size_pages >> resident_pages))
     {
-        m_domain_name = std::string(m_read_buffer.data(), m_read_buffer.data() + m_domain_name_length);
-        std::memcpy(&m_port, m_read_buffer.data() + m_domain_name_length, 2);
-        logger()->info("Got domain name {0}, port {1}", m_domain_name, m_port);
-        this->consume_bytes_from_read_buffer(m_domain_name_length + 2);
+        return 0;
+    }
+    return resident_pages * static_cast<std::size_t>(::sysconf(_SC_PAGESIZE)) / 1024;
+}
 
-        hostent* he;
-        he = ::gethostbyname(m_domain_name.c_str());
-        if (he == nullptr || he->h_addr_list[0] == nullptr)
-        {
-            logger()->error("gethostbyname from '{0}' fail: {1}", m_domain_name, ::hstrerror(h_errno));
-            this->send_fail_message(0x04);  // Host unreachable
-            return;
-        }
+}  // namespace
 
-        switch (he->h_addrtype)
-        {
-        case AF_INET:
+void IoUring::log_statistics() const
+{
+    std::uint64_t proxied_bytes = m_metrics.upstream_bytes.value() + m_metrics.downstream_bytes.value();
+    double submit_calls_per_kib = proxied_bytes == 0
+        ? 0.0
+        : static_cast<double>(m_statistics.submit_calls) * 1024.0 / static_cast<double>(proxied_bytes);
+    logger()->info("io_uring: {0} submit calls, {1} bytes proxied, {2:.4f} submit calls per KiB",
+                   m_statistics.submit_calls, proxied_bytes, submit_calls_per_kib);
+
+    std::string histogram = fmt::format("0: {0}", m_statistics.cqes_per_wakeup[0]);
+    for (unsigned i = 1; i < Statistics::CQE_HISTOGRAM_SIZE; ++i)
+    {
+        unsigned from = 1u << (i - 1);
+        unsigned to = (1u << i) - 1;
+        if (from == to)
+            histogram += fmt::format(", {0}: {1}", from, m_statistics.cqes_per_wakeup[i]);
+        else
+            histogram += fmt::format(", {0}-{1}: {2}", from, to, m_statistics.cqes_per_wakeup[i]);
+    }
+    logger()->info("io_uring: CQEs per wakeup {{{0}}}", histogram);
+
+    const DnsCache& cache = m_resolver.cache();
+    logger()->info("DNS cache: {0} entries, {1} hits, {2} misses", cache.size(), cache.hits(), cache.misses());
+
+    if (m_buffer_ring)
+    {
+        logger()->info("memory: RSS {0} KiB, {1} of {2} ring buffers in use, {3} starved reads",
+                       resident_set_size_kib(), m_buffer_ring->in_use_count(), m_buffer_ring->entries,
+                       m_starved_reads.size());
+    }
+    else
+    {
+        logger()->info("memory: RSS {0} KiB", resident_set_size_kib());
+    }
+
+    std::string occupancy;
+    for (unsigned size_class = 0; size_class < m_buffer_pool.size_classes_count(); ++size_class)
+    {
+        occupancy += fmt::format("{0}{1} KiB: {2}/{3}", size_class == 0 ? "" : ", ",
+                                 m_buffer_pool.buffer_size(size_class) / 1024.0, m_buffer_pool.in_use_count(size_class),
+                                 m_buffer_pool.buffer_count(size_class));
+    }
+    logger()->info("buffers: {{{0}}}", occupancy);
+    logger()->info("sessions: {0} of {1} in use, {2} bytes each", m_session_pool.in_use_count(),
+                   m_session_pool.capacity, sizeof(Session));
+}
+
+void IoUring::handle_service_event(EventType type, int result)
+{
+    switch (type)
+    {
+    case EventType::DNS_SEND:
+        if (UNLIKELY(result < 0))
+        {
+            LOG_ERROR("Sending DNS query failed: {0}", std::strerror(-result));
+        }
+        m_resolver.handle_send();
+        break;
+    case EventType::DNS_RECEIVE:
+        if (LIKELY(result > 0))
+        {
+            m_resolver.handle_receive(static_cast<unsigned>(result));
+        }
+        else if (result < 0)
+        {
+            LOG_ERROR("Receiving DNS response failed: {0}", std::strerror(-result));
+        }
+        this->add_dns_receive_request();
+        break;
+    case EventType::TIMER:
+        this->handle_tick();
+        this->add_timer_request();
+        break;
+    default:
+        assert(false);
+        break;
+    }
+}
+
+void IoUring::submit_pending()
+{
+    if (io_uring_sq_ready(&m_ring) != 0)
+    {
+        int res = io_uring_submit(&m_ring);
+        ++m_statistics.submit_calls;
+        if (UNLIKELY(res < 0 && res != -EINTR))
+        {
+            logger()->error("io_uring_submit failed: {0}", std::strerror(-res));
+            throw syscall_wrapper::Error("io_uring_submit", -res);
+        }
+    }
+}
+
+void IoUring::handle_selected_buffer(const io_uring_cqe* cqe)
+{
+    auto buffer_id = static_cast<unsigned short>(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    m_buffer_ring->take_buffer(buffer_id);
+    EventTag tag = EventTag::decode(cqe->user_data);
+    Session* client = this->session_of(tag);
+    if (LIKELY(cqe->res > 0 && !client->is_failed()))
+    {
+        client->attach_selected_buffer(tag.type, buffer_id);
+    }
+    else  // EOF or the session is going away, nobody will write this buffer out
+    {
+        m_buffer_ring->return_buffer(buffer_id);
+    }
+}
+
+bool IoUring::is_starved_read(const io_uring_cqe* cqe, EventType type, const Session* client) const
+{
+    if (cqe->res != -ENOBUFS || !m_buffer_ring)
+    {
+        return false;
+    }
+    return (type == EventType::CLIENT_READ || type == EventType::DESTINATION_READ) && !client->is_failed();
+}
+
+void IoUring::resume_starved_reads()
+{
+    unsigned returned_count = m_buffer_ring->take_returned_count();
+    while (returned_count != 0 && !m_starved_reads.empty())
+    {
+        StarvedRead read = m_starved_reads.front();
+        m_starved_reads.pop_front();
+        --read.client->awaiting_events_count;
+        if (read.client->is_failed())
+        {
+            if (read.client->awaiting_events_count == 0)
+            {
+                this->destroy_session(read.client);
+            }
+            continue;
+        }
+
+        --returned_count;
+        if (read.type == EventType::CLIENT_READ)
+            this->add_client_buffer_ring_read_request(read.client);
+        else
+            this->add_destination_buffer_ring_read_request(read.client);
+    }
+}
+
+void IoUring::handle_cqe(const io_uring_cqe* cqe)
+{
+    if (cqe->user_data == UNTRACKED_USER_DATA)
+    {
+        return;
+    }
+
+    EventTag tag = EventTag::decode(cqe->user_data);
+    if (tag.slot == EventTag::SERVICE_SLOT)
+    {
+        if (tag.type == EventType::CLIENT_ACCEPT)
+            this->handle_accept(cqe);
+        else
+            this->handle_service_event(tag.type, cqe->res);
+        return;
+    }
+
+    if (cqe->flags & IORING_CQE_F_BUFFER)
+    {
+        this->handle_selected_buffer(cqe);
+    }
+
+    Session* client = this->session_of(tag);
+    if (UNLIKELY(cqe->flags & IORING_CQE_F_NOTIF))
+    {
+        this->handle_send_notification(client);
+        return;
+    }
+    if (tag.type == EventType::CLIENT_WRITE && (cqe->flags & IORING_CQE_F_MORE))
+    {
+        // a zero-copy send, failed or not; counted before the send itself is accounted below
+        client->expect_send_notification();
+    }
+
+    if (UNLIKELY(this->is_starved_read(cqe, tag.type, client)))
+    {
+        // all ring buffers are in flight; the read is re-issued once some of them come back
+        m_starved_reads.push_back({ client, tag.type });
+    }
+    // failed connect attempts and elapsed attempt delays are steps of the connect race
+    else if (UNLIKELY(cqe->res < 0) && tag.type != EventType::DESTINATION_CONNECT
+             && tag.type != EventType::DESTINATION_CONNECT_DELAY && tag.type != EventType::DESTINATION_FAST_OPEN)
+    {
+        LOG_ERROR("CQE fail: {0}", std::strerror(-cqe->res));
+        m_metrics.cqe_errors.add();
+        --client->awaiting_events_count;
+        if (client->awaiting_events_count == 0)
+            this->destroy_session(client);
+        else
+            client->fail_immediately();
+    }
+    else
+    {
+        --client->awaiting_events_count;
+        client->touch(m_ticks_count);
+        if (client->is_failed())
+        {
+            if (client->awaiting_events_count == 0)
+            {
+                this->destroy_session(client);
+            }
+            return;
+        }
+
+        switch (tag.type)
+        {
+        case EventType::CLIENT_ACCEPT:
+        case EventType::DNS_SEND:
+        case EventType::DNS_RECEIVE:
+        case EventType::TIMER:
+            assert(false);  // service events are dispatched before the session lookup
+            break;
+        case EventType::CLIENT_READ:
+            if (LIKELY(cqe->res != 0))
+            {
+                client->handle_client_read(static_cast<unsigned>(cqe->res));
+            }
+            else  // empty read indicates that client disconnected
+            {
+                client->handle_client_eof();
+            }
+            break;
+        case EventType::CLIENT_WRITE:
+            client->handle_client_write(static_cast<unsigned>(cqe->res));
+            break;
+        case EventType::DESTINATION_CONNECT:
+            client->handle_destination_connect(tag.index, cqe->res);
+            break;
+        case EventType::DESTINATION_CONNECT_DELAY:
+            client->handle_connect_delay();
+            break;
+        case EventType::DESTINATION_FAST_OPEN:
+            client->handle_fast_open(cqe->res);
+            break;
+        case EventType::DESTINATION_READ:
+            if (LIKELY(cqe->res != 0))
+            {
+                client->handle_destination_read(static_cast<unsigned>(cqe->res));
+            }
+            else  // empty read indicates that destination disconnected
+            {
+                client->handle_destination_eof();
+            }
+            break;
+        case EventType::DESTINATION_WRITE:
+            client->handle_destination_write(static_cast<unsigned>(cqe->res));
+            break;
+        }
+        if (client->is_failed() && client->awaiting_events_count == 0)
+        {
+            this->destroy_session(client);
+        }
+    }
+}
+
+EventTag IoUring::event_tag(const Session* client, EventType type, unsigned index) const
+{
+    assert(index <= UINT8_MAX);
+    unsigned slot = m_session_pool.slot_of(client);
+    return { type, slot, m_session_pool.generation(slot), static_cast<std::uint8_t>(index) };
+}
+
+void IoUring::set_event(io_uring_sqe* sqe, const Session* client, EventType type, unsigned index)
+{
+    io_uring_sqe_set_data64(sqe, this->event_tag(client, type, index).encode());
+}
+
+void IoUring::set_service_event(io_uring_sqe* sqe, EventType type)
+{
+    io_uring_sqe_set_data64(sqe, EventTag{ type }.encode());
+}
+
+Session* IoUring::session_of(const EventTag& tag)
+{
+    assert(tag.generation == m_session_pool.generation(tag.slot) && "completion for a recycled session");
+    return m_session_pool.session_at(tag.slot);
+}
+
+void IoUring::event_loop()
+{
+    this->add_client_accept_request(&m_client_addr, &m_client_addr_len);
+    this->add_dns_receive_request();
+    this->add_timer_request();
+
+    for (;;)
+    {
+        // everything queued while handling the previous batch goes to the kernel in one call
+        int res = io_uring_submit_and_wait(&m_ring, 1);
+        ++m_statistics.submit_calls;
+        // EBUSY: older kernels refuse submissions while completions overflow, reaping makes room
+        if (UNLIKELY(res < 0 && res != -EINTR && res != -EBUSY))
+        {
+            logger()->error("io_uring_submit_and_wait failed: {0}", std::strerror(-res));
+            throw syscall_wrapper::Error("io_uring_submit_and_wait", -res);
+        }
+
+        unsigned count = io_uring_peek_batch_cqe(&m_ring, m_cqes.data(), CQE_BATCH_SIZE);
+        for (unsigned i = 0; i < count; ++i)
+        {
+            this->handle_cqe(m_cqes[i]);
+        }
+        io_uring_cq_advance(&m_ring, count);
+        ++m_statistics.cqes_per_wakeup[std::bit_width(count)];
+        if (UNLIKELY(io_uring_cq_has_overflow(&m_ring)))
+        {
+            // the kernel keeps what did not fit and posts it on the next io_uring_enter(), which
+            // waits for completions; frequent overflows ask for larger ServerOptions::cq_entries
+            m_metrics.cq_overflows.add();
+        }
+
+        if (m_buffer_ring)
+        {
+            this->resume_starved_reads();
+        }
+    }
+}
+
+io_uring_sqe* IoUring::get_sqe(unsigned reserve)
+{
+    while (UNLIKELY(io_uring_sq_space_left(&m_ring) < reserve))
+    {
+        // submission queue is full, flush it without waiting for completions
+        this->submit_pending();
+        if (m_options.kernel_polling)
+        {
+            // submitting only published the entries, the SQPOLL thread frees them as it consumes them
+            int res = io_uring_sqring_wait(&m_ring);
+            if (UNLIKELY(res < 0 && res != -EINTR))
+            {
+                logger()->error("io_uring_sqring_wait failed: {0}", std::strerror(-res));
+                throw syscall_wrapper::Error("io_uring_sqring_wait", -res);
+            }
+        }
+    }
+    io_uring_sqe* sqe = io_uring_get_sqe(&m_ring);
+    assert(sqe != nullptr);
+    return sqe;
+}
+
+void IoUring::mark_fixed_file(io_uring_sqe* sqe) const
+{
+    if (m_file_table)
+    {
+        sqe->flags |= IOSQE_FIXED_FILE;
+    }
+}
+
+void IoUring::add_client_accept_request(struct sockaddr_in* client_addr, socklen_t* client_addr_len)
+{
+    io_uring_sqe* sqe = this->get_sqe();
+    auto* address = reinterpret_cast<struct sockaddr*>(client_addr);
+    // with fixed files the kernel picks a free slot within FileTable::accept_slots for every client
+    if (m_options.multishot_accept)
+    {
+        if (m_file_table)
+            io_uring_prep_multishot_accept_direct(sqe, m_socket.fd(), address, client_addr_len, 0);
+        else
+            io_uring_prep_multishot_accept(sqe, m_socket.fd(), address, client_addr_len, 0);
+    }
+    else
+    {
+        if (m_file_table)
+            io_uring_prep_accept_direct(sqe, m_socket.fd(), address, client_addr_len, 0, IORING_FILE_INDEX_ALLOC);
+        else
+            io_uring_prep_accept(sqe, m_socket.fd(), address, client_addr_len, 0);
+    }
+    this->set_service_event(sqe, EventType::CLIENT_ACCEPT);
+}
+
+void IoUring::add_client_read_request(Session* client)
+{
+    this->add_client_read_request(client, static_cast<unsigned>(client->buffer0().size()), 0);
+}
+
+void IoUring::add_client_read_request(Session* client, unsigned nbytes, unsigned offset)
+{
+    ++client->awaiting_events_count;
+    io_uring_sqe* sqe = this->get_sqe();
+    if (client->buffer0_fixed_index() >= 0)
+    {
+        io_uring_prep_read_fixed(sqe, client->fd(), client->buffer0().data() + offset, nbytes,
+                                 0, client->buffer0_fixed_index());
+    }
+    else
+    {
+        io_uring_prep_read(sqe, client->fd(), client->buffer0().data() + offset, nbytes, 0);
+    }
+    this->mark_fixed_file(sqe);
+    this->set_event(sqe, client, EventType::CLIENT_READ);
+}
+
+void IoUring::add_client_write_request(Session* client, unsigned nbytes, unsigned offset)
+{
+    ++client->awaiting_events_count;
+    io_uring_sqe* sqe = this->get_sqe();
+    if (client->buffer1_fixed_index() >= 0)
+    {
+        io_uring_prep_write_fixed(sqe, client->fd(), client->buffer1().data() + offset,
+                                  nbytes, 0, client->buffer1_fixed_index());
+    }
+    else
+    {
+        io_uring_prep_write(sqe, client->fd(), client->buffer1().data() + offset, nbytes, 0);
+    }
+    this->mark_fixed_file(sqe);
+    this->set_event(sqe, client, EventType::CLIENT_WRITE);
+}
+
+void IoUring::add_client_send_zc_request(Session* client, unsigned nbytes, unsigned offset)
+{
+    ++client->awaiting_events_count;
+    io_uring_sqe* sqe = this->get_sqe();
+    const byte_t* data = client->buffer1().data() + offset;
+    if (client->buffer1_fixed_index() >= 0)
+    {
+        io_uring_prep_send_zc_fixed(sqe, client->fd(), data, nbytes, MSG_NOSIGNAL, 0,
+                                    static_cast<unsigned>(client->buffer1_fixed_index()));
+    }
+    else
+    {
+        io_uring_prep_send_zc(sqe, client->fd(), data, nbytes, MSG_NOSIGNAL, 0);
+    }
+    this->mark_fixed_file(sqe);
+    this->set_event(sqe, client, EventType::CLIENT_WRITE);
+}
+
+void IoUring::add_destination_connect_request(Session* client, const Socket& socket, int fd, unsigned attempt)
+{
+    ++client->awaiting_events_count;
+    io_uring_sqe* sqe;
+    if (m_file_table)
+    {
+        // the socket is created right in its slot, the linked connect is cancelled if that fails
+        sqe = this->get_sqe(2);
+        io_uring_prep_socket_direct(sqe, socket.address()->sa_family, SOCK_STREAM, 0, static_cast<unsigned>(fd), 0);
+        io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS);
+        io_uring_sqe_set_data64(sqe, UNTRACKED_USER_DATA);
+    }
+    sqe = this->get_sqe();
+    io_uring_prep_connect(sqe, fd, socket.address(), socket.address_length());
+    this->mark_fixed_file(sqe);
+    this->set_event(sqe, client, EventType::DESTINATION_CONNECT, attempt);
+}
+
+void IoUring::add_destination_fast_open_request(Session* client, int fd, msghdr* message, unsigned attempt)
+{
+    client->awaiting_events_count += 2;
+    // without a cookie of the destination the kernel sends a plain SYN and queues nothing, the
+    // sendmsg fails with EINPROGRESS then; the hard link issues the poll regardless
+    io_uring_sqe* sqe = this->get_sqe(2);
+    io_uring_prep_sendmsg(sqe, fd, message, MSG_FASTOPEN | MSG_NOSIGNAL);
+    io_uring_sqe_set_flags(sqe, IOSQE_IO_HARDLINK);
+    this->set_event(sqe, client, EventType::DESTINATION_FAST_OPEN, attempt);
+    sqe = this->get_sqe();
+    io_uring_prep_poll_add(sqe, fd, POLLOUT);
+    this->set_event(sqe, client, EventType::DESTINATION_CONNECT, attempt);
+}
+
+void IoUring::add_connect_delay_request(Session* client)
+{
+    ++client->awaiting_events_count;
+    io_uring_sqe* sqe = this->get_sqe();
+    io_uring_prep_timeout(sqe, &m_connect_attempt_delay, 0, 0);
+    this->set_event(sqe, client, EventType::DESTINATION_CONNECT_DELAY);
+}
+
+void IoUring::add_destination_read_request(Session* client)
+{
+    this->add_destination_read_request(client, static_cast<unsigned>(client->buffer1().size()), 0);
+}
+
+void IoUring::add_destination_read_request(Session* client, unsigned nbytes, unsigned offset)
+{
+    ++client->awaiting_events_count;
+    io_uring_sqe* sqe = this->get_sqe();
+    if (client->buffer1_fixed_index() >= 0)
+    {
+        io_uring_prep_read_fixed(sqe, client->destination_fd(), client->buffer1().data() + offset, nbytes,
+                                 0, client->buffer1_fixed_index());
+    }
+    else
+    {
+        io_uring_prep_read(sqe, client->destination_fd(), client->buffer1().data() + offset, nbytes, 0);
+    }
+    this->mark_fixed_file(sqe);
+    this->set_event(sqe, client, EventType::DESTINATION_READ);
+}
+
+void IoUring::add_destination_write_request(Session* client, unsigned nbytes, unsigned offset)
+{
+    ++client->awaiting_events_count;
+    io_uring_sqe* sqe = this->get_sqe();
+    if (client->buffer0_fixed_index() >= 0)
+    {
+        io_uring_prep_write_fixed(sqe, client->destination_fd(), client->buffer0().data() + offset,
+                                  nbytes, 0, client->buffer0_fixed_index());
+    }
+    else
+    {
+        io_uring_prep_write(sqe, client->destination_fd(),
+                            client->buffer0().data() + offset, nbytes, 0);
+    }
+    this->mark_fixed_file(sqe);
+    this->set_event(sqe, client, EventType::DESTINATION_WRITE);
+}
+
+void IoUring::add_splice_request(Session* client, EventType type, int poll_fd, unsigned poll_mask,
+                                 int fd_in, int fd_out, unsigned nbytes)
+{
+    ++client->awaiting_events_count;
+    io_uring_sqe* sqe = this->get_sqe(2);
+    io_uring_prep_poll_add(sqe, poll_fd, poll_mask);
+    // if poll fails, the linked splice is cancelled and reports the failure itself
+    io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS);
+    io_uring_sqe_set_data64(sqe, UNTRACKED_USER_DATA);
+    this->mark_fixed_file(sqe);
+
+    sqe = this->get_sqe();
+    // the socket is fd_in when waiting for POLLIN and fd_out otherwise, the pipe is always a plain fd
+    unsigned splice_flags = SPLICE_F_MOVE;
+    if (m_file_table && poll_mask == POLLIN)
+        splice_flags |= SPLICE_F_FD_IN_FIXED;
+    io_uring_prep_splice(sqe, fd_in, -1, fd_out, -1, nbytes, splice_flags);
+    if (poll_mask == POLLOUT)
+        this->mark_fixed_file(sqe);
+    this->set_event(sqe, client, type);
+}
+
+void IoUring::add_client_splice_in_request(Session* client)
+{
+    this->add_splice_request(client, EventType::CLIENT_READ, client->fd(), POLLIN,
+                             client->fd(), client->upstream_pipe()[1], SPLICE_CHUNK_SIZE);
+}
+
+void IoUring::add_client_splice_out_request(Session* client, unsigned nbytes)
+{
+    this->add_splice_request(client, EventType::CLIENT_WRITE, client->fd(), POLLOUT,
+                             client->downstream_pipe()[0], client->fd(), nbytes);
+}
+
+void IoUring::add_destination_splice_in_request(Session* client)
+{
+    int fd = client->destination_fd();
+    this->add_splice_request(client, EventType::DESTINATION_READ, fd, POLLIN,
+                             fd, client->downstream_pipe()[1], SPLICE_CHUNK_SIZE);
+}
+
+void IoUring::add_destination_splice_out_request(Session* client, unsigned nbytes)
+{
+    int fd = client->destination_fd();
+    this->add_splice_request(client, EventType::DESTINATION_WRITE, fd, POLLOUT,
+                             client->upstream_pipe()[0], fd, nbytes);
+}
+
+void IoUring::add_buffer_ring_read_request(Session* client, EventType type, int fd)
+{
+    ++client->awaiting_events_count;
+    io_uring_sqe* sqe = this->get_sqe();
+    // the kernel picks a buffer from the ring once data arrives, length comes from the ring
+    io_uring_prep_recv(sqe, fd, nullptr, 0, 0);
+    io_uring_sqe_set_flags(sqe, IOSQE_BUFFER_SELECT);
+    this->mark_fixed_file(sqe);
+    sqe->buf_group = BufferRing::GROUP_ID;
+    this->set_event(sqe, client, type);
+}
+
+void IoUring::add_client_buffer_ring_read_request(Session* client)
+{
+    this->add_buffer_ring_read_request(client, EventType::CLIENT_READ, client->fd());
+}
+
+void IoUring::add_destination_buffer_ring_read_request(Session* client)
+{
+    this->add_buffer_ring_read_request(client, EventType::DESTINATION_READ, client->destination_fd());
+}
+
+void IoUring::add_dns_send_request(const byte_t* data, unsigned nbytes)
+{
+    io_uring_sqe* sqe = this->get_sqe();
+    io_uring_prep_send(sqe, m_resolver.fd(), data, nbytes, 0);
+    this->set_service_event(sqe, EventType::DNS_SEND);
+}
+
+void IoUring::add_dns_receive_request()
+{
+    io_uring_sqe* sqe = this->get_sqe();
+    std::span<byte_t> buffer = m_resolver.receive_buffer();
+    io_uring_prep_recv(sqe, m_resolver.fd(), buffer.data(), buffer.size(), 0);
+    this->set_service_event(sqe, EventType::DNS_RECEIVE);
+}
+
+void IoUring::add_timer_request()
+{
+    io_uring_sqe* sqe = this->get_sqe();
+    io_uring_prep_timeout(sqe, &m_tick_interval, 0, 0);
+    this->set_service_event(sqe, EventType::TIMER);
+}
+
+SessionPool::SessionPool(unsigned capacity_)
+    : capacity(capacity_)
+    , m_slots(new Slot[capacity])
+#ifndef NDEBUG
+    , m_generations(capacity)
+#endif
+{
+    assert(capacity < EventTag::SERVICE_SLOT);
+    m_free_slots.reserve(capacity);
+    for (unsigned i = capacity; i != 0; --i)
+    {
+        m_free_slots.push_back(i - 1);
+    }
+}
+
+void SessionPool::destroy(Session* session)
+{
+    Slot* slot = reinterpret_cast<Slot*>(session);
+    assert(slot >= m_slots.get() && slot < m_slots.get() + capacity);
+    session->~Session();
+    unsigned index = static_cast<unsigned>(slot - m_slots.get());
+#ifndef NDEBUG
+    ++m_generations[index];
+#endif
+    m_free_slots.push_back(index);
+}
+
+void IoOperation::await_suspend(std::coroutine_handle<>)
+{
+    // the handle is kept by Session::m_handshake, its completion handlers resume it
+    switch (m_type)
+    {
+    case EventType::CLIENT_READ:
+        m_server.add_client_read_request(&m_client, m_nbytes, m_offset);
+        break;
+    case EventType::CLIENT_WRITE:
+        m_server.add_client_write_request(&m_client, m_nbytes, m_offset);
+        break;
+    default:
+        assert(false);
+        break;
+    }
+}
+
+int IoOperation::await_resume() const noexcept
+{
+    return m_client.m_handshake->result;
+}
+
+bool ResolveOperation::await_suspend(std::coroutine_handle<>)
+{
+    m_client.m_handshake->answer = DnsAnswer{};
+    if (m_server.resolver().resolve(&m_client, m_name))
+    {
+        return true;
+    }
+    LOG_ERROR("Invalid domain name '{0}'", m_name);
+    return false;
+}
+
+const DnsAnswer& ResolveOperation::await_resume() const noexcept
+{
+    return m_client.m_handshake->answer;
+}
+
+bool ConnectOperation::await_suspend(std::coroutine_handle<>)
+{
+    return m_client.start_connect_race();
+}
+
+int ConnectOperation::await_resume() const noexcept
+{
+    return m_client.m_handshake->result;
+}
+
+Session::Session(int fd, IoUring& server, BufferPool& buffer_pool)
+    : m_server(server)
+    , m_fd(fd)
+    , m_buffer_pool(buffer_pool)
+    , m_buffer0_id(m_buffer_pool.obtain_buffer(0))
+{
+    try
+    {
+        m_buffer1_id = m_buffer_pool.obtain_buffer(0);
+    }
+    catch (const BufferPool::InsufficientBuffersException&)
+    {
+        m_buffer_pool.return_buffer(m_buffer0_id);
+        throw;
+    }
+    this->set_buffer0(m_buffer_pool.buffer(m_buffer0_id), this->pool_fixed_index(m_buffer0_id));
+    this->set_buffer1(m_buffer_pool.buffer(m_buffer1_id), this->pool_fixed_index(m_buffer1_id));
+    m_handshake = std::make_unique<Handshake>();
+    m_timer_entry.session = this;
+}
+
+void Session::fail_delayed()
+{
+    // otherwise a queued request may be submitted after its fd was closed and reused
+    m_server.submit_pending();
+    m_is_failed = true;
+    this->close_destination();
+}
+
+void Session::fail_immediately()
+{
+    this->fail_delayed();
+    this->close_client();
+}
+
+void Session::abort()
+{
+    if (m_handshake && m_handshake->race.in_flight != 0 && !m_handshake->race.finished)
+    {
+        this->finish_connect_race();
+    }
+    // closing alone would leave e.g. a read from a silent peer pending forever;
+    // after a shutdown reads complete with 0 and writes and connects with errors
+    if (m_fd != -1)
+        m_server.shutdown_socket(m_fd);
+    if (m_destination_fd != -1)
+        m_server.shutdown_socket(m_destination_fd);
+    if (m_is_failed)
+    {
+        // sockets closed on failure may still have requests in flight
+        m_server.cancel_requests(this);
+    }
+    this->fail_immediately();
+}
+
+void Session::set_timeout(Timeout timeout)
+{
+    m_timeout = timeout;
+    m_server.schedule_timeout(this);
+}
+
+void Session::resume_timeout(Timeout timeout, std::uint32_t ticks_left)
+{
+    m_timeout = timeout;
+    m_server.schedule_timeout(this, ticks_left);
+}
+
+void Session::close_client()
+{
+    if (m_fd == -1)
+    {
+        return;  // already closed
+    }
+    int fd = m_fd;
+    m_fd = -1;
+    // a request in flight keeps the socket open past the close, e.g. a poll for a silent peer forever
+    if (awaiting_events_count != 0)
+        m_server.cancel_socket_requests(fd);
+    if (m_server.uses_fixed_files())
+        m_server.close_file_slot(static_cast<unsigned>(fd));
+    else
+        syscall_wrapper::close(fd);
+}
+
+void Session::close_destination()
+{
+    if (m_destination_fd != -1 && awaiting_events_count != 0)
+        m_server.cancel_socket_requests(m_destination_fd);
+    m_destination_socket.reset();
+    if (m_server.uses_fixed_files() && m_destination_fd != -1)
+    {
+        m_server.close_file_slot(static_cast<unsigned>(m_destination_fd));
+    }
+    m_destination_fd = -1;
+}
+
+void Session::start_handshake()
+{
+    this->set_timeout(Timeout::HANDSHAKE);
+    try
+    {
+        m_handshake->task = this->negotiate();
+    }
+    catch (const std::bad_alloc&)
+    {
+        LOG_ERROR("Cannot allocate the handshake coroutine");
+        this->fail_immediately();
+        return;
+    }
+    this->resume_handshake();
+}
+
+void Session::resume_handshake()
+{
+    Task& task = m_handshake->task;
+    task.resume();
+    if (!task.done())
+    {
+        return;
+    }
+    if (UNLIKELY(task.exception() != nullptr))
+    {
+        // ends this session only, the event loop goes on with the others
+        try
+        {
+            std::rethrow_exception(task.exception());
+        }
+        catch (const std::exception& e)
+        {
+            LOG_ERROR("Handshake failed: {0}", e.what());
+        }
+        catch (...)
+        {
+            LOG_ERROR("Handshake failed with an unknown exception");
+        }
+        this->fail_immediately();
+        return;
+    }
+    if (task.result() && !m_is_failed)
+    {
+        this->start_proxying();
+    }
+}
+
+// GCC flags the frame code it generates for any coroutine with -Wzero-as-null-pointer-constant
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wzero-as-null-pointer-constant"
+#endif
+Task Session::negotiate()
+{
+    Socks5Parser& parser = m_handshake->parser;
+    Socks5Parser::Result result;
+    while ((result = this->parse_handshake_message()) == Socks5Parser::Result::INCOMPLETE)
+    {
+        LOG_DEBUG("Partial message received, re-add read request");
+        unsigned buffered = m_handshake->buffered;
+        m_handshake->buffered += co_await IoOperation(m_server, *this, EventType::CLIENT_READ,
+                                                      m_buffer0_size - buffered, buffered);
+    }
+    if (result == Socks5Parser::Result::INVALID_GREETING)
+    {
+        LOG_ERROR("Invalid client greeting");
+        m_server.metrics().greeting_failures.add();
+        this->fail_immediately();
+        co_return false;
+    }
+
+    LOG_DEBUG("Got client greeting");
+    // only 0x00 (no auth) is supported
+    if (!parser.no_auth_offered())
+    {
+        m_server.metrics().greeting_failures.add();
+        this->fail_delayed();
+        const byte_t reply[] = { Socks5Parser::VERSION, Socks5Parser::METHOD_NOT_ACCEPTABLE };
+        m_server.add_client_write_request(this, this->copy_to_buffer1(reply));
+        co_return false;
+    }
+    {
+        const byte_t reply[] = { Socks5Parser::VERSION, Socks5Parser::METHOD_NO_AUTH };
+        unsigned reply_size = this->copy_to_buffer1(reply);
+        for (unsigned offset = 0; offset != reply_size;)
+        {
+            offset += co_await IoOperation(m_server, *this, EventType::CLIENT_WRITE, reply_size - offset, offset);
+        }
+    }
+
+    // the request may have been pipelined with the greeting and be buffered already
+    while ((result = this->parse_handshake_message()) == Socks5Parser::Result::INCOMPLETE)
+    {
+        LOG_DEBUG("Partial message received, re-add read request");
+        unsigned buffered = m_handshake->buffered;
+        m_handshake->buffered += co_await IoOperation(m_server, *this, EventType::CLIENT_READ,
+                                                      m_buffer0_size - buffered, buffered);
+    }
+    if (result == Socks5Parser::Result::INVALID_REQUEST)
+    {
+        LOG_ERROR("Client connection request is not supported");
+        this->send_fail_message(parser.reply_code());
+        co_return false;
+    }
+
+    // addresses to connect to, literal ones included
+    DnsAnswer& answer = m_handshake->answer;
+    switch (parser.address_type())
+    {
+    case Socks5Parser::AddressType::IPV4:
+        LOG_INFO("Got IPv4 address {0}, port {1}", ::inet_ntoa(parser.ipv4_address()), parser.port());
+        answer.ipv4_addresses[0] = parser.ipv4_address();
+        answer.ipv4_count = 1;
+        break;
+
+    case Socks5Parser::AddressType::DOMAIN_NAME:
+    {
+        LOG_INFO("Got domain name {0}, port {1}", parser.domain_name(), parser.port());
+        std::optional<DnsAnswer> local_answer = m_server.resolver().resolve_locally(parser.domain_name());
+        if (local_answer)
+        {
+            answer = *local_answer;
+        }
+        else
+        {
+            co_await ResolveOperation(m_server, *this, parser.domain_name());
+        }
+        if (answer.status != DnsAnswer::Status::SUCCESS)
+        {
+            LOG_ERROR("Resolving '{0}' failed", parser.domain_name());
+            this->send_fail_message(0x04);  // Host unreachable
+            co_return false;
+        }
+        break;
+    }
+
+    case Socks5Parser::AddressType::IPV6:
+    {
+#ifndef NDEBUG
+        char address_string[INET6_ADDRSTRLEN];
+        const char* res = ::inet_ntop(AF_INET6, &parser.ipv6_address(), address_string, INET6_ADDRSTRLEN);
+        assert(res == address_string);
+        LOG_INFO("Got IPv6 address {0}, port {1}", address_string, parser.port());
+#endif
+        answer.ipv6_addresses[0] = parser.ipv6_address();
+        answer.ipv6_count = 1;
+        break;
+    }
+    }
+
+    // connecting has a budget of its own, the handshake deadline is paused meanwhile
+    std::uint32_t handshake_ticks_left = m_server.timeout_ticks_left(this);
+    this->set_timeout(Timeout::CONNECT);
+    if (int error = co_await ConnectOperation(*this); error != 0)
+    {
+        this->translate_errno(error);
+        co_return false;
+    }
+    this->resume_timeout(Timeout::HANDSHAKE, handshake_ticks_left);
+
+    std::array<byte_t, 22> reply = {
+        Socks5Parser::VERSION,
+        0x00,  // request granted
+        0x00,  // reserved
+    };
+    // the address which won the connect race
+    std::size_t reply_size;
+    in_port_t port;
+    const sockaddr* address = m_destination_socket->address();
+    if (address->sa_family == AF_INET6)
+    {
+        const auto* ipv6_address = reinterpret_cast<const sockaddr_in6*>(address);
+        reply[3] = 0x04;  // IPv6
+        std::memcpy(reply.data() + 4, &ipv6_address->sin6_addr, 16);
+        reply_size = 20;
+        port = ipv6_address->sin6_port;
+    }
+    else
+    {
+        const auto* ipv4_address = reinterpret_cast<const sockaddr_in*>(address);
+        reply[3] = 0x01;  // IPv4
+        std::memcpy(reply.data() + 4, &ipv4_address->sin_addr, 4);
+        reply_size = 8;
+        port = ipv4_address->sin_port;
+    }
+    std::memcpy(reply.data() + reply_size, &port, 2);
+    reply_size += 2;
+    unsigned write_size = this->copy_to_buffer1({ reply.data(), reply_size });
+    for (unsigned offset = 0; offset != write_size;)
+    {
+        offset += co_await IoOperation(m_server, *this, EventType::CLIENT_WRITE, write_size - offset, offset);
+    }
+    co_return true;
+}
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+Socks5Parser::Result Session::parse_handshake_message()
+{
+    Socks5Parser& parser = m_handshake->parser;
+    Socks5Parser::Result result = parser.parse({ m_buffer0_data, m_handshake->buffered });
+    if (result == Socks5Parser::Result::INCOMPLETE)
+    {
+        // unparsed bytes never exceed the largest message, which fits any pool buffer
+        assert(m_handshake->buffered < m_buffer0_size);
+    }
+    else if (result == Socks5Parser::Result::GREETING || result == Socks5Parser::Result::REQUEST)
+    {
+        // pipelined messages or early payload which follow the parsed message
+        m_handshake->buffered -= static_cast<unsigned>(parser.consumed());
+        std::memmove(m_buffer0_data, m_buffer0_data + parser.consumed(), m_handshake->buffered);
+    }
+    return result;
+}
+
+unsigned Session::copy_to_buffer1(std::span<const byte_t> message)
+{
+    assert(message.size() <= m_buffer1_size);
+    std::memcpy(m_buffer1_data, message.data(), message.size());
+    return static_cast<unsigned>(message.size());
+}
+
+void Session::send_fail_message(byte_t error_code)
+{
+    if (error_code < Metrics::REPLY_CODES_COUNT)
+    {
+        m_server.metrics().request_failures[error_code].add();
+    }
+    this->fail_delayed();
+    const byte_t reply[] = {
+        Socks5Parser::VERSION,
+        error_code,
+        0x00,  // reserved
+        0x01,  // IPv4
+        0x00, 0x00, 0x00, 0x00,  // address
+        0x00, 0x00,  // port
+    };
+    m_server.add_client_write_request(this, this->copy_to_buffer1(reply));
+}
+
+void Session::translate_errno(int error_code)
+{
+    switch (error_code)
+    {
+    case ENETUNREACH:
+        LOG_ERROR("Network unreachable");
+        this->send_fail_message(0x03);
+        break;
+    case EHOSTUNREACH:
+        LOG_ERROR("Host is unreachable");
+        this->send_fail_message(0x04);
+        break;
+    case ECONNREFUSED:
+        LOG_ERROR("Connection refused");
+        this->send_fail_message(0x05);
+        break;
+    default:
+        LOG_ERROR("General failure");
+        this->send_fail_message();
+        break;
+    }
+}
+
+namespace
+{
+
+// socket for the n-th address of the answer in RFC 8305 order: IPv6 first, then the families
+// alternate until one of them runs out; fd -1 leaves the socket to the io_uring file table
+std::unique_ptr<Socket> make_attempt_socket(const DnsAnswer& answer, unsigned n, in_port_t port, bool fixed_files)
+{
+    unsigned common_count = std::min(answer.ipv4_count, answer.ipv6_count);
+    bool is_ipv6;
+    unsigned index;
+    if (n < 2 * common_count)
+    {
+        is_ipv6 = n % 2 == 0;
+        index = n / 2;
+    }
+    else
+    {
+        is_ipv6 = answer.ipv6_count > common_count;
+        index = n - common_count;
+    }
+
+    if (is_ipv6)
+    {
+        return fixed_files ? std::make_unique<SocketIPv6>(-1, answer.ipv6_addresses[index], port)
+                           : std::make_unique<SocketIPv6>(answer.ipv6_addresses[index], port);
+    }
+    return fixed_files ? std::make_unique<SocketIPv4>(-1, answer.ipv4_addresses[index], port)
+                       : std::make_unique<SocketIPv4>(answer.ipv4_addresses[index], port);
+}
+
+// connect result of a socket whose SYN went out with sendmsg(MSG_FASTOPEN), from the poll mask
+int fast_open_connect_result(int fd, int poll_mask)
+{
+    if (!(poll_mask & (POLLERR | POLLHUP)))
+    {
+        return 0;
+    }
+    int error = 0;
+    socklen_t error_length = sizeof(error);
+    if (::getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_length) == -1)
+    {
+        return -errno;
+    }
+    return error != 0 ? -error : -ECONNRESET;
+}
+
+}  // namespace
+
+bool Session::start_connect_race()
+{
+    ConnectRace& race = m_handshake->race;
+    this->start_connect_attempt();
+    if (race.in_flight == 0)
+    {
+        race.finished = true;
+        m_handshake->result = race.error != 0 ? race.error : EHOSTUNREACH;
+        return false;
+    }
+    return true;
+}
+
+void Session::start_connect_attempt()
+{
+    ConnectRace& race = m_handshake->race;
+    const DnsAnswer& answer = m_handshake->answer;
+    unsigned candidates_count = answer.ipv4_count + answer.ipv6_count;
+    bool fixed_files = m_server.uses_fixed_files();
+    while (race.next < candidates_count)
+    {
+        unsigned attempt = race.next++;
+        if (fixed_files && !m_server.has_free_file_slot())
         {
-            m_address_type = ADDRESS_TYPE_IPV4;
-            in_addr* addr = reinterpret_cast<in_addr*>(he->h_addr_list[0]);
-            std::memcpy(&m_ipv4_address, addr, sizeof(in_addr));
-            this->connect_ipv4_destination();
-            break;
+            race.error = EMFILE;
+            continue;
         }
-        case AF_INET6:
+        try
         {
-            m_address_type = ADDRESS_TYPE_IPV6;
-            in6_addr* addr = reinterpret_cast<in6_addr*>(he->h_addr_list[0]);
-            std::memcpy(&m_ipv6_address, addr, sizeof(in6_addr));
-            this->connect_ipv6_destination();
-            break;
+            race.sockets[attempt] = make_attempt_socket(answer, attempt, m_handshake->parser.port(), fixed_files);
         }
-#ifndef NDEBUG
-        default:
-            assert(false);
-            break;
-#endif
+        catch (const syscall_wrapper::Error& e)
+        {
+            race.error = e.error_code;
+            continue;
+        }
+        catch (...)
+        {
+            race.error = EIO;
+            continue;
+        }
+        race.fds[attempt] = fixed_files ? static_cast<int>(m_server.obtain_file_slot()) : race.sockets[attempt]->fd();
+        // later attempts would send the same payload once more, so only the first one carries it
+        if (attempt == 0 && m_server.options().fast_open && !fixed_files && m_handshake->buffered != 0)
+        {
+            race.fast_open = true;
+            race.fast_open_iovec = { .iov_base = m_buffer0_data, .iov_len = m_handshake->buffered };
+            race.fast_open_message = {};
+            race.fast_open_message.msg_name = race.sockets[attempt]->address();
+            race.fast_open_message.msg_namelen = race.sockets[attempt]->address_length();
+            race.fast_open_message.msg_iov = &race.fast_open_iovec;
+            race.fast_open_message.msg_iovlen = 1;
+            m_server.add_destination_fast_open_request(this, race.fds[attempt], &race.fast_open_message, attempt);
+        }
+        else
+        {
+            m_server.add_destination_connect_request(this, *race.sockets[attempt], race.fds[attempt], attempt);
         }
+        ++race.in_flight;
         break;
     }
+    if (race.in_flight != 0 && race.next < candidates_count && !race.delay_armed)
+    {
+        race.delay_armed = true;
+        m_server.add_connect_delay_request(this);
+    }
+}
 
-    case ADDRESS_TYPE_IPV6:
+void Session::finish_connect_race()
+{
+    ConnectRace& race = m_handshake->race;
+    race.finished = true;
+    if (race.delay_armed)
     {
-        std::memcpy(&m_ipv6_address, m_read_buffer.data(), 16);
-        std::memcpy(&m_port, m_read_buffer.data() + 16, 2);
-#ifndef NDEBUG
-        char address_string[INET6_ADDRSTRLEN];
-        const char* res = ::inet_ntop(AF_INET6, &m_ipv6_address, address_string, INET6_ADDRSTRLEN);
-        assert(res == address_string);
-        logger()->info("Got IPv6 address {0}, port {1}", address_string, m_port);
-#endif
-        this->consume_bytes_from_read_buffer(18);
-        this->connect_ipv6_destination();
-        break;
+        m_server.cancel_request(this, EventType::DESTINATION_CONNECT_DELAY);
+    }
+    for (unsigned attempt = 0; attempt < race.next; ++attempt)
+    {
+        if (race.sockets[attempt])
+        {
+            m_server.cancel_request(this, EventType::DESTINATION_CONNECT, attempt);
+        }
+    }
+    // a connect started in this batch must reach the kernel before its fd is closed and reused;
+    // the cancelled ones still complete and are ignored by handle_destination_connect
+    m_server.submit_pending();
+    for (unsigned attempt = 0; attempt < race.next; ++attempt)
+    {
+        this->close_connect_attempt(attempt);
     }
+}
 
-#ifndef NDEBUG
-    default:
-        assert(false);
-        break;
-#endif
+void Session::close_connect_attempt(unsigned attempt)
+{
+    ConnectRace& race = m_handshake->race;
+    if (!race.sockets[attempt])
+    {
+        return;  // failed or won
+    }
+    if (m_server.uses_fixed_files())
+    {
+        m_server.close_file_slot(static_cast<unsigned>(race.fds[attempt]));
     }
+    race.sockets[attempt].reset();
+}
+
+void Session::handle_domain_resolved(const DnsAnswer& answer)
+{
+    assert(m_state == State::NEGOTIATING);
+    m_handshake->answer = answer;
+    this->resume_handshake();
 }
 
 void Session::handle_client_read(unsigned nread)
 {
-    logger()->debug("CQE: read from client, nread = {}", nread);
-    if (m_state == State::PROXYING_REQUESTS)
+    LOG_DEBUG("CQE: read from client, nread = {}", nread);
+    if (LIKELY(m_state == State::PROXYING_REQUESTS))
     {
+        m_server.metrics().upstream_bytes.add(nread);
+        if (m_server.options().relay_mode == RelayMode::PIPELINED)
+        {
+            m_upstream_pipeline.complete_read(nread);
+            this->pump_upstream();
+            return;
+        }
+        this->record_read_size(nread, m_buffer0_id, m_buffer0_size_policy);
         m_destination_write_offset = 0;
         m_destination_write_size = nread;
-        m_server.add_destination_write_request(this, nread);
+        this->relay_to_destination();
+        return;
+    }
+
+    assert(m_state == State::NEGOTIATING);
+    m_handshake->result = static_cast<int>(nread);
+    this->resume_handshake();
+}
+
+void Session::handle_client_write(unsigned nwrite)
+{
+    LOG_DEBUG("CQE: write to client, nwrite = {}", nwrite);
+    if (LIKELY(m_state == State::PROXYING_REQUESTS))
+    {
+        if (m_server.options().relay_mode == RelayMode::PIPELINED)
+        {
+            m_downstream_pipeline.complete_write(nwrite);
+            this->pump_downstream();
+            return;
+        }
+        if (LIKELY(nwrite + m_client_write_offset == m_client_write_size))
+        {
+            LOG_DEBUG("Whole write to client completed");
+            if (UNLIKELY(m_pending_send_notifications != 0))
+            {
+                m_destination_read_deferred = true;
+                return;
+            }
+            this->relay_from_destination();
+        }
+        else
+        {
+            LOG_DEBUG("Partial write to client occurred, re-add write request");
+            m_client_write_offset += nwrite;
+            this->relay_to_client();
+        }
         return;
     }
 
-    if (nread != 0)
+    assert(m_state == State::NEGOTIATING);
+    m_handshake->result = static_cast<int>(nwrite);
+    this->resume_handshake();
+}
+
+void Session::handle_destination_connect(unsigned attempt, int result)
+{
+    if (!m_handshake || m_handshake->race.finished)
     {
-        m_read_buffer.insert(m_read_buffer.end(), m_buffer0.data(), m_buffer0.data() + nread);
+        return;  // lost the race, its socket is closed already
     }
-    if (!m_is_read_completed())
+    ConnectRace& race = m_handshake->race;
+    --race.in_flight;
+    if (attempt == 0 && race.fast_open && result >= 0)
     {
-        logger()->debug("Partial read occurred, re-add read request");
-        m_server.add_client_read_request(this);
+        result = race.fast_open_error != 0 ? -race.fast_open_error
+                                           : fast_open_connect_result(race.fds[attempt], result);
+    }
+    if (result == 0)
+    {
+        LOG_DEBUG("Connect attempt {0} succeeded", attempt);
+        if (attempt == 0 && race.fast_open_sent != 0)
+        {
+            // the socket sends these bytes once connected, whether the destination took them with the SYN or not
+            m_server.metrics().upstream_bytes.add(race.fast_open_sent);
+            m_handshake->buffered -= race.fast_open_sent;
+            std::memmove(m_buffer0_data, m_buffer0_data + race.fast_open_sent, m_handshake->buffered);
+        }
+        m_destination_socket = std::move(race.sockets[attempt]);
+        m_destination_fd = race.fds[attempt];
+        this->finish_connect_race();
+        m_handshake->result = 0;
+        this->resume_handshake();
         return;
     }
-    logger()->debug("Whole read completed");
 
-    switch (m_state)
+    LOG_DEBUG("Connect attempt {0} failed: {1}", attempt, std::strerror(-result));
+    race.error = -result;
+    this->close_connect_attempt(attempt);
+    // the next address does not wait for the delay
+    this->start_connect_attempt();
+    if (race.in_flight == 0)
     {
-    case State::READING_CLIENT_GREETING:
-        this->read_client_greeting();
-        break;
-    case State::READING_AUTH_METHODS:
-        this->read_auth_methods();
-        break;
-    case State::READING_CLIENT_CONNECTION_REQUEST:
-        this->read_client_connection_request();
-        break;
-    case State::READING_DOMAIN_NAME_LENGTH:
-        this->read_domain_name_length();
-        break;
-    case State::READING_ADDRESS:
-        this->read_address();
-        break;
-#ifndef NDEBUG
-    case State::CONNECTING_TO_DESTINATION:
-        assert(false);
-        break;
-    case State::PROXYING_REQUESTS:
-        assert(false);
-        break;
-#endif
+        this->finish_connect_race();
+        m_handshake->result = race.error;
+        this->resume_handshake();
     }
 }
 
-void Session::handle_client_write(unsigned nwrite)
+void Session::handle_fast_open(int result)
 {
-    logger()->debug("CQE: write to client, nwrite = {}", nwrite);
-    if (m_state == State::PROXYING_REQUESTS)
+    if (!m_handshake || m_handshake->race.finished)
     {
-        if (LIKELY(nwrite + m_client_write_offset == m_client_write_size))
+        return;
+    }
+    ConnectRace& race = m_handshake->race;
+    if (result >= 0)
+    {
+        LOG_DEBUG("Fast Open SYN of attempt 0 carries {0} bytes", result);
+        race.fast_open_sent = static_cast<unsigned>(result);
+    }
+    else if (result != -EINPROGRESS)  // a plain SYN was sent otherwise, the payload is relayed as usual
+    {
+        race.fast_open_error = -result;
+    }
+}
+
+void Session::handle_connect_delay()
+{
+    if (!m_handshake || m_handshake->race.finished)
+    {
+        return;  // cancelled when the race finished
+    }
+    ConnectRace& race = m_handshake->race;
+    race.delay_armed = false;
+    LOG_DEBUG("No connection after {0} attempts, starting the next one", race.next);
+    this->start_connect_attempt();
+    // the delay is armed only while an attempt is in flight, otherwise the race has finished
+    assert(race.in_flight != 0);
+}
+
+void Session::handle_destination_read(unsigned nread)
+{
+    LOG_DEBUG("CQE: read from destination, nread = {}", nread);
+    m_server.metrics().downstream_bytes.add(nread);
+    if (m_server.options().relay_mode == RelayMode::PIPELINED)
+    {
+        m_downstream_pipeline.complete_read(nread);
+        this->pump_downstream();
+        return;
+    }
+    this->record_read_size(nread, m_buffer1_id, m_buffer1_size_policy);
+    m_client_write_offset = 0;
+    m_client_write_size = nread;
+    this->relay_to_client();
+}
+
+void Session::handle_destination_write(unsigned nwrite)
+{
+    LOG_DEBUG("CQE: write to destination, nwrite = {}", nwrite);
+    if (m_server.options().relay_mode == RelayMode::PIPELINED)
+    {
+        m_upstream_pipeline.complete_write(nwrite);
+        this->pump_upstream();
+        return;
+    }
+    if (LIKELY(nwrite + m_destination_write_offset == m_destination_write_size))
+    {
+        LOG_DEBUG("Whole write to destination completed");
+        m_writing_early_payload = false;
+        this->relay_from_client();
+    }
+    else
+    {
+        LOG_DEBUG("Partial write to destination occurred, re-add write request");
+        m_destination_write_offset += nwrite;
+        this->relay_to_destination();
+    }
+}
+
+void Session::start_proxying()
+{
+    // payload the client sent without waiting for the reply, it is at the beginning of buffer0
+    unsigned early_payload_size = m_handshake->buffered;
+    m_state = State::PROXYING_REQUESTS;
+    m_handshake.reset();
+    this->set_timeout(Timeout::IDLE);
+    if (m_server.options().relay_mode == RelayMode::SPLICE)
+    {
+        try
         {
-            logger()->debug("Whole write to client completed");
-            m_server.add_destination_read_request(this);
+            m_upstream_pipe = syscall_wrapper::pipe();
+            m_downstream_pipe = syscall_wrapper::pipe();
         }
-        else
+        catch (const syscall_wrapper::Error&)
         {
-            logger()->debug("Partial write to client occurred, re-add write request");
-            m_client_write_offset += nwrite;
-            m_server.add_client_write_request(this, m_client_write_size - m_client_write_offset, m_client_write_offset);
+            LOG_ERROR("Cannot create relay pipes");
+            this->fail_immediately();
+            return;
+        }
+        // a pipe may hold as little as a page, so the payload is not pushed through it, where a
+        // blocking write could stall the event loop
+        m_writing_early_payload = early_payload_size != 0;
+    }
+    else if (m_server.options().relay_mode == RelayMode::PIPELINED)
+    {
+        unsigned depth = m_server.options().pipeline_depth;
+        m_upstream_pipeline = RelayPipeline(depth, m_buffer0_size / depth);
+        m_downstream_pipeline = RelayPipeline(depth, m_buffer1_size / depth);
+        // the handshake may have filled all of buffer0, the slices tile it from its beginning, so
+        // the early payload already sits in as many consecutive slices as it spans
+        unsigned early_payload_offset = 0;
+        while (early_payload_offset != early_payload_size)
+        {
+            [[maybe_unused]] unsigned offset = m_upstream_pipeline.start_read();
+            assert(offset == early_payload_offset);
+            unsigned nread = std::min(early_payload_size - early_payload_offset, m_upstream_pipeline.slice_size());
+            m_upstream_pipeline.complete_read(nread);
+            early_payload_offset += nread;
         }
+        this->pump_downstream();
+        this->pump_upstream();
+        return;
+    }
+    this->relay_from_destination();
+    if (early_payload_size != 0)
+    {
+        m_server.metrics().upstream_bytes.add(early_payload_size);
+        m_destination_write_offset = 0;
+        m_destination_write_size = early_payload_size;
+        this->relay_to_destination();
+    }
+    else
+    {
+        this->relay_from_client();
+    }
+}
+
+void Session::pump_upstream()
+{
+    if (m_upstream_pipeline.can_write())
+    {
+        auto [nbytes, offset] = m_upstream_pipeline.start_write();
+        m_server.add_destination_write_request(this, nbytes, offset);
+    }
+    if (m_upstream_pipeline.can_read())
+    {
+        unsigned offset = m_upstream_pipeline.start_read();
+        m_server.add_client_read_request(this, m_upstream_pipeline.slice_size(), offset);
+    }
+    if (m_upstream_pipeline.is_drained())
+    {
+        this->fail_immediately();
+    }
+}
+
+void Session::pump_downstream()
+{
+    if (m_downstream_pipeline.can_write())
+    {
+        auto [nbytes, offset] = m_downstream_pipeline.start_write();
+        m_server.add_client_write_request(this, nbytes, offset);
+    }
+    if (m_downstream_pipeline.can_read())
+    {
+        unsigned offset = m_downstream_pipeline.start_read();
+        m_server.add_destination_read_request(this, m_downstream_pipeline.slice_size(), offset);
+    }
+    if (m_downstream_pipeline.is_drained())
+    {
+        this->fail_immediately();
+    }
+}
+
+void Session::handle_client_eof()
+{
+    if (m_state == State::PROXYING_REQUESTS && m_server.options().relay_mode == RelayMode::PIPELINED)
+    {
+        // chunks read before EOF may still wait for the destination
+        m_upstream_pipeline.set_eof();
+        this->pump_upstream();
         return;
     }
+    this->fail_immediately();
+}
 
-    m_write_client_buffer.erase(m_write_client_buffer.begin(), m_write_client_buffer.begin() + nwrite);
-    if (!m_write_client_buffer.empty())
+void Session::handle_destination_eof()
+{
+    if (m_server.options().relay_mode == RelayMode::PIPELINED)
     {
-        logger()->debug("Partial write to client occurred, re-add write request");
-        this->write_to_client();
+        m_downstream_pipeline.set_eof();
+        this->pump_downstream();
         return;
     }
-    logger()->debug("Whole write to client completed");
+    this->fail_immediately();
+}
 
-    switch (m_state)
+void Session::relay_from_client()
+{
+    switch (m_server.options().relay_mode)
     {
-    case State::READING_CLIENT_GREETING:
-        assert(false);
-        break;
-    case State::READING_AUTH_METHODS:
-        m_state = State::READING_CLIENT_CONNECTION_REQUEST;
-        this->read_some_from_client(4);
-        break;
-    case State::READING_CLIENT_CONNECTION_REQUEST:
-        assert(false);
-        break;
-    case State::READING_DOMAIN_NAME_LENGTH:
-        assert(false);
+    case RelayMode::COPY:
+        if (this->adapt_buffer_size(m_buffer0_size_policy, m_buffer0_id))
+            this->set_buffer0(m_buffer_pool.buffer(m_buffer0_id), this->pool_fixed_index(m_buffer0_id));
+        m_server.add_client_read_request(this);
         break;
-    case State::READING_ADDRESS:
-        assert(false);
+    case RelayMode::SPLICE:
+        m_server.add_client_splice_in_request(this);
         break;
-    case State::CONNECTING_TO_DESTINATION:
-        m_state = State::PROXYING_REQUESTS;
-        m_server.add_destination_read_request(this);
-        this->read_from_client();
+    case RelayMode::BUFFER_RING:
+        this->release_client_buffer();
+        m_server.add_client_buffer_ring_read_request(this);
         break;
-    case State::PROXYING_REQUESTS:
+    case RelayMode::PIPELINED:
         assert(false);
         break;
     }
 }
 
-void Session::handle_destination_connect()
+void Session::relay_from_destination()
 {
-    assert(m_state == State::CONNECTING_TO_DESTINATION);
-    switch (m_address_type)
+    switch (m_server.options().relay_mode)
     {
-    case ADDRESS_TYPE_IPV4:
-        m_write_client_buffer.resize(10);
-        m_write_client_buffer[0] = 0x05;  // protocol version
-        m_write_client_buffer[1] = 0x00;  // request granted
-        m_write_client_buffer[2] = 0x00;  // reserved
-        m_write_client_buffer[3] = 0x01;  // IPv4
-        std::memcpy(m_write_client_buffer.data() + 4, &m_ipv4_address, 4);
-        std::memcpy(m_write_client_buffer.data() + 8, &m_port, 2);
-        this->write_to_client();
+    case RelayMode::COPY:
+        if (this->adapt_buffer_size(m_buffer1_size_policy, m_buffer1_id))
+            this->set_buffer1(m_buffer_pool.buffer(m_buffer1_id), this->pool_fixed_index(m_buffer1_id));
+        m_server.add_destination_read_request(this);
         break;
-    case ADDRESS_TYPE_IPV6:
-        m_write_client_buffer.resize(22);
-        m_write_client_buffer[0] = 0x05;  // protocol version
-        m_write_client_buffer[1] = 0x00;  // request granted
-        m_write_client_buffer[2] = 0x00;  // reserved
-        m_write_client_buffer[3] = 0x04;  // IPv6
-        std::memcpy(m_write_client_buffer.data() + 4, &m_ipv6_address, 16);
-        std::memcpy(m_write_client_buffer.data() + 20, &m_port, 2);
-        this->write_to_client();
+    case RelayMode::SPLICE:
+        m_server.add_destination_splice_in_request(this);
         break;
-#ifndef NDEBUG
-    default:
+    case RelayMode::BUFFER_RING:
+        this->release_destination_buffer();
+        m_server.add_destination_buffer_ring_read_request(this);
+        break;
+    case RelayMode::PIPELINED:
         assert(false);
         break;
-#endif
     }
 }
 
-void Session::handle_destination_read(unsigned nread)
+void Session::record_read_size(unsigned nread, unsigned buffer_id, BufferSizePolicy& policy)
 {
-    logger()->debug("CQE: read from destination, nread = {}", nread);
-    m_client_write_offset = 0;
-    m_client_write_size = nread;
-    m_server.add_client_write_request(this, nread);
+    if (m_server.options().relay_mode != RelayMode::COPY || m_buffer_pool.size_classes_count() == 1)
+    {
+        return;
+    }
+    unsigned size_class = m_buffer_pool.size_class_of(buffer_id);
+    unsigned smaller_buffer_size = size_class == 0 ? 0 : m_buffer_pool.buffer_size(size_class - 1);
+    policy.record_read(nread, m_buffer_pool.buffer_size(size_class), smaller_buffer_size);
 }
 
-void Session::handle_destination_write(unsigned nwrite)
+bool Session::adapt_buffer_size(BufferSizePolicy& policy, unsigned& buffer_id)
 {
-    logger()->debug("CQE: write to destination, nwrite = {}", nwrite);
-    if (LIKELY(nwrite + m_destination_write_offset == m_destination_write_size))
+    int decision = policy.take_decision();
+    if (LIKELY(decision == 0))
     {
-        logger()->debug("Whole write to destination completed");
-        m_server.add_client_read_request(this);
+        return false;
+    }
+    unsigned size_class = m_buffer_pool.size_class_of(buffer_id);
+    if ((decision < 0 && size_class == 0) || (decision > 0 && size_class + 1 == m_buffer_pool.size_classes_count()))
+    {
+        return false;
+    }
+    // stay in the current class if the neighbouring one is exhausted
+    std::optional<unsigned> new_buffer_id = m_buffer_pool.try_obtain_buffer(decision > 0 ? size_class + 1 : size_class - 1);
+    if (!new_buffer_id)
+    {
+        return false;
+    }
+    LOG_DEBUG("Moving buffer {} to {} bytes", buffer_id, m_buffer_pool.buffer(*new_buffer_id).size());
+    m_buffer_pool.return_buffer(buffer_id);
+    buffer_id = *new_buffer_id;
+    return true;
+}
+
+int Session::pool_fixed_index(unsigned buffer_id) const
+{
+    return m_server.uses_fixed_buffers() ? static_cast<int>(m_buffer_pool.size_class_of(buffer_id)) : -1;
+}
+
+void Session::set_buffer0(std::span<byte_t> buffer, int fixed_index)
+{
+    m_buffer0_data = buffer.data();
+    m_buffer0_size = static_cast<unsigned>(buffer.size());
+    m_buffer0_fixed_index = static_cast<std::int16_t>(fixed_index);
+}
+
+void Session::set_buffer1(std::span<byte_t> buffer, int fixed_index)
+{
+    m_buffer1_data = buffer.data();
+    m_buffer1_size = static_cast<unsigned>(buffer.size());
+    m_buffer1_fixed_index = static_cast<std::int16_t>(fixed_index);
+}
+
+void Session::relay_to_client()
+{
+    unsigned nbytes = m_client_write_size - m_client_write_offset;
+    if (m_server.options().relay_mode == RelayMode::SPLICE)
+    {
+        m_server.add_client_splice_out_request(this, nbytes);
+    }
+    else if (m_server.zero_copy_threshold() != 0 && nbytes >= m_server.zero_copy_threshold())
+    {
+        // pinning the pages and the notification cost more than copying a small write
+        m_server.metrics().zero_copy_sends.add();
+        m_server.add_client_send_zc_request(this, nbytes, m_client_write_offset);
     }
     else
     {
-        logger()->debug("Partial write to destination occurred, re-add write request");
-        m_destination_write_offset += nwrite;
-        m_server.add_destination_write_request(this, m_destination_write_size - m_destination_write_offset, m_destination_write_offset);
+        m_server.add_client_write_request(this, nbytes, m_client_write_offset);
+    }
+}
+
+void Session::expect_send_notification()
+{
+    ++awaiting_events_count;
+    ++m_pending_send_notifications;
+}
+
+void Session::handle_send_notification()
+{
+    --m_pending_send_notifications;
+    if (m_pending_send_notifications == 0 && m_destination_read_deferred)
+    {
+        m_destination_read_deferred = false;
+        this->relay_from_destination();
+    }
+}
+
+void Session::relay_to_destination()
+{
+    unsigned nbytes = m_destination_write_size - m_destination_write_offset;
+    if (m_server.options().relay_mode == RelayMode::SPLICE && !m_writing_early_payload)
+        m_server.add_destination_splice_out_request(this, nbytes);
+    else
+        m_server.add_destination_write_request(this, nbytes, m_destination_write_offset);
+}
+
+void Session::attach_selected_buffer(EventType type, unsigned short buffer_id)
+{
+    std::span<byte_t> buffer = m_server.buffer_ring().buffer(buffer_id);
+    if (type == EventType::CLIENT_READ)
+    {
+        assert(m_client_buffer_id == -1);
+        m_client_buffer_id = buffer_id;
+        this->set_buffer0(buffer, -1);
+    }
+    else
+    {
+        assert(type == EventType::DESTINATION_READ && m_destination_buffer_id == -1);
+        m_destination_buffer_id = buffer_id;
+        this->set_buffer1(buffer, -1);
+    }
+}
+
+void Session::release_client_buffer()
+{
+    if (m_client_buffer_id == -1)
+    {
+        return;
     }
+    m_server.buffer_ring().return_buffer(static_cast<unsigned short>(m_client_buffer_id));
+    m_client_buffer_id = -1;
+    this->set_buffer0(m_buffer_pool.buffer(m_buffer0_id), this->pool_fixed_index(m_buffer0_id));
 }
 
-void Session::consume_bytes_from_read_buffer(unsigned nread)
+void Session::release_destination_buffer()
 {
-    m_read_buffer.erase(m_read_buffer.begin(), m_read_buffer.begin() + nread);
+    if (m_destination_buffer_id == -1)
+    {
+        return;
+    }
+    m_server.buffer_ring().return_buffer(static_cast<unsigned short>(m_destination_buffer_id));
+    m_destination_buffer_id = -1;
+    this->set_buffer1(m_buffer_pool.buffer(m_buffer1_id), this->pool_fixed_index(m_buffer1_id));
 }
 
 Session::~Session()
 {
     try
     {
-        if (m_fd != -1)
-            syscall_wrapper::close(m_fd);
-        m_buffer_pool.return_buffer(m_buffer_index);
+        this->close_client();
+        this->close_destination();
+        for (int pipe_fd : { m_upstream_pipe[0], m_upstream_pipe[1], m_downstream_pipe[0], m_downstream_pipe[1] })
+        {
+            if (pipe_fd != -1)
+                syscall_wrapper::close(pipe_fd);
+        }
+        this->release_client_buffer();
+        this->release_destination_buffer();
+        m_buffer_pool.return_buffer(m_buffer0_id);
+        m_buffer_pool.return_buffer(m_buffer1_id);
     }
     catch (...)
     {
@@ -1,6 +1,9 @@
 #include <socket.hpp>
 #include <utils.hpp>
 
+#include <cstdint>
+#include <vector>
+
 namespace hw2
 {
 
@@ -64,6 +67,12 @@ SocketIPv4::SocketIPv4(in_addr addr, in_port_t port)
 {
 }
 
+SocketIPv4::SocketIPv4(int fd, in_addr addr, in_port_t port)
+    : Socket(fd)
+    , m_address(construct_address_ipv4(addr, port))
+{
+}
+
 SocketIPv4::~SocketIPv4() = default;
 
 const sockaddr* SocketIPv4::address() const
@@ -87,6 +96,12 @@ SocketIPv6::SocketIPv6(in6_addr addr, in_port_t port)
 {
 }
 
+SocketIPv6::SocketIPv6(int fd, in6_addr addr, in_port_t port)
+    : Socket(fd)
+    , m_address(construct_address_ipv6(addr, port))
+{
+}
+
 SocketIPv6::~SocketIPv6() = default;
 
 const sockaddr* SocketIPv6::address() const
@@ -104,14 +119,51 @@ socklen_t SocketIPv6::address_length() const
     return sizeof(m_address);
 }
 
-MainSocket::MainSocket(in_port_t port, int maxqueue)
+MainSocket::MainSocket(in_port_t port, int maxqueue, bool reuse_port)
     : SocketIPv4({INADDR_ANY}, ::htons(port))
 {
     syscall_wrapper::setsockopt_reuseaddr(m_fd);
+    if (reuse_port)
+    {
+        syscall_wrapper::setsockopt_reuseport(m_fd);
+    }
     syscall_wrapper::bind(m_fd, m_address);
     syscall_wrapper::listen(m_fd, maxqueue);
 }
 
 MainSocket::~MainSocket() = default;
 
+void MainSocket::steer_reuseport_group_by_cpu(std::span<const int> listener_by_cpu)
+{
+    std::vector<sock_filter> code;
+    code.push_back({ BPF_LD | BPF_W | BPF_ABS, 0, 0, static_cast<__u32>(SKF_AD_OFF + SKF_AD_CPU) });  // A = current CPU
+    for (std::size_t cpu = 0; cpu < listener_by_cpu.size(); ++cpu)
+    {
+        if (listener_by_cpu[cpu] < 0)
+        {
+            continue;
+        }
+        code.push_back({ BPF_JMP | BPF_JEQ | BPF_K, 0, 1, static_cast<__u32>(cpu) });         // if A == cpu
+        code.push_back({ BPF_RET | BPF_K, 0, 0, static_cast<__u32>(listener_by_cpu[cpu]) });  // return its listener
+    }
+    // an index past the group makes the kernel select by hash
+    code.push_back({ BPF_RET | BPF_K, 0, 0, UINT32_MAX });
+    if (code.size() > BPF_MAXINSNS)
+    {
+        throw std::invalid_argument("Too many CPUs to steer connections by CPU");
+    }
+    sock_fprog program = { .len = static_cast<unsigned short>(code.size()), .filter = code.data() };
+    syscall_wrapper::setsockopt_attach_reuseport_cbpf(m_fd, program);
+}
+
+void MainSocket::enable_fast_open(int queue_length)
+{
+    syscall_wrapper::setsockopt_tcp_fastopen(m_fd, queue_length);
+}
+
+void MainSocket::defer_accept(int timeout_seconds)
+{
+    syscall_wrapper::setsockopt_tcp_defer_accept(m_fd, timeout_seconds);
+}
+
 }  // namespace hw2
@@ -0,0 +1,125 @@
+#include <socks5_parser.hpp>
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+namespace hw2
+{
+
+Socks5Parser::Result Socks5Parser::parse(std::span<const byte_t> data)
+{
+    switch (m_stage)
+    {
+    case Stage::GREETING:
+        return this->parse_greeting(data);
+    case Stage::REQUEST:
+        return this->parse_request(data);
+    case Stage::DONE:
+        break;
+    }
+    assert(false);
+    return Result::INCOMPLETE;
+}
+
+Socks5Parser::Result Socks5Parser::parse_greeting(std::span<const byte_t> data)
+{
+    // +-----+----------+----------+
+    // | VER | NMETHODS | METHODS  |
+    // +-----+----------+----------+
+    // |  1  |    1     | 1 to 255 |
+    // +-----+----------+----------+
+    if (data.size() >= 1 && data[0] != VERSION)
+    {
+        return Result::INVALID_GREETING;
+    }
+    if (data.size() < 2)
+    {
+        return Result::INCOMPLETE;
+    }
+    std::size_t methods_count = data[1];
+    if (methods_count == 0)
+    {
+        return Result::INVALID_GREETING;
+    }
+    if (data.size() < 2 + methods_count)
+    {
+        return Result::INCOMPLETE;
+    }
+    std::span<const byte_t> methods = data.subspan(2, methods_count);
+    m_no_auth_offered = std::find(methods.begin(), methods.end(), METHOD_NO_AUTH) != methods.end();
+    m_consumed = 2 + methods_count;
+    m_stage = Stage::REQUEST;
+    return Result::GREETING;
+}
+
+Socks5Parser::Result Socks5Parser::parse_request(std::span<const byte_t> data)
+{
+    // +-----+-----+-------+------+----------+----------+
+    // | VER | CMD |  RSV  | ATYP | DST.ADDR | DST.PORT |
+    // +-----+-----+-------+------+----------+----------+
+    // |  1  |  1  | X'00' |  1   | Variable |    2     |
+    // +-----+-----+-------+------+----------+----------+
+    constexpr std::size_t HEADER_SIZE = 4;
+    constexpr byte_t COMMAND_CONNECT = 0x01;
+    if (data.size() < HEADER_SIZE)
+    {
+        return Result::INCOMPLETE;
+    }
+    m_consumed = HEADER_SIZE;
+    if (data[0] != VERSION || data[1] != COMMAND_CONNECT || data[2] != 0x00)
+    {
+        m_reply_code = REPLY_COMMAND_NOT_SUPPORTED;
+        return Result::INVALID_REQUEST;
+    }
+
+    std::size_t address_size;
+    std::size_t address_offset = HEADER_SIZE;
+    switch (data[3])
+    {
+    case static_cast<byte_t>(AddressType::IPV4):
+        address_size = sizeof(in_addr);
+        break;
+    case static_cast<byte_t>(AddressType::DOMAIN_NAME):
+        if (data.size() < HEADER_SIZE + 1)
+        {
+            return Result::INCOMPLETE;
+        }
+        address_size = data[HEADER_SIZE];
+        address_offset = HEADER_SIZE + 1;
+        break;
+    case static_cast<byte_t>(AddressType::IPV6):
+        address_size = sizeof(in6_addr);
+        break;
+    default:
+        m_reply_code = REPLY_ADDRESS_TYPE_NOT_SUPPORTED;
+        return Result::INVALID_REQUEST;
+    }
+    std::size_t request_size = address_offset + address_size + sizeof(in_port_t);
+    if (data.size() < request_size)
+    {
+        return Result::INCOMPLETE;
+    }
+
+    m_address_type = static_cast<AddressType>(data[3]);
+    const byte_t* address = data.data() + address_offset;
+    switch (m_address_type)
+    {
+    case AddressType::IPV4:
+        std::memcpy(&m_ipv4_address, address, sizeof(in_addr));
+        break;
+    case AddressType::DOMAIN_NAME:
+        m_domain_name_length = static_cast<std::uint8_t>(address_size);
+        std::memcpy(m_domain_name.data(), address, address_size);
+        break;
+    case AddressType::IPV6:
+        std::memcpy(&m_ipv6_address, address, sizeof(in6_addr));
+        break;
+    }
+    std::memcpy(&m_port, address + address_size, sizeof(in_port_t));
+    m_consumed = request_size;
+    m_stage = Stage::DONE;
+    return Result::REQUEST;
+}
+
+}  // namespace hw2
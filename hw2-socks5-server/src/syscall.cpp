@@ -1,7 +1,10 @@
 #include <syscall.hpp>
 
 #include <fcntl.h>
+#include <linux/mempolicy.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
 namespace hw2::syscall_wrapper
@@ -36,6 +39,17 @@ int socket_ipv6()
     return socket(AF_INET6);
 }
 
+int socket_udp_ipv4()
+{
+    int sfd = ::socket(AF_INET, SOCK_DGRAM, 0);
+    if (sfd == -1)
+    {
+        std::perror("socket");
+        throw Error("socket", errno);
+    }
+    return sfd;
+}
+
 void close(int fd)
 {
     if (::close(fd) == -1)
@@ -45,6 +59,17 @@ void close(int fd)
     }
 }
 
+std::array<int, 2> pipe()
+{
+    std::array<int, 2> fds;
+    if (::pipe2(fds.data(), O_CLOEXEC) == -1)
+    {
+        std::perror("pipe2");
+        throw Error("pipe2", errno);
+    }
+    return fds;
+}
+
 void bind(int fd, const sockaddr_in& address)
 {
     if (::bind(fd, reinterpret_cast<const sockaddr*>(&address), sizeof (address)) == -1)
@@ -63,6 +88,15 @@ void listen(int fd, int maxqueue)
     }
 }
 
+void connect(int fd, const sockaddr_in& address)
+{
+    if (::connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof (address)) == -1)
+    {
+        std::perror("connect");
+        throw Error("connect", errno);
+    }
+}
+
 void setsockopt_reuseaddr(int fd)
 {
     static constexpr int sockoptval = 1;
@@ -73,6 +107,43 @@ void setsockopt_reuseaddr(int fd)
     }
 }
 
+void setsockopt_reuseport(int fd)
+{
+    static constexpr int sockoptval = 1;
+    if (::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &sockoptval, sizeof (sockoptval)) == -1)
+    {
+        std::perror("setsockopt");
+        throw Error("setsockopt", errno);
+    }
+}
+
+void setsockopt_attach_reuseport_cbpf(int fd, const sock_fprog& program)
+{
+    if (::setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof (program)) == -1)
+    {
+        std::perror("setsockopt");
+        throw Error("setsockopt", errno);
+    }
+}
+
+void setsockopt_tcp_fastopen(int fd, int queue_length)
+{
+    if (::setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &queue_length, sizeof (queue_length)) == -1)
+    {
+        std::perror("setsockopt");
+        throw Error("setsockopt", errno);
+    }
+}
+
+void setsockopt_tcp_defer_accept(int fd, int timeout_seconds)
+{
+    if (::setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &timeout_seconds, sizeof (timeout_seconds)) == -1)
+    {
+        std::perror("setsockopt");
+        throw Error("setsockopt", errno);
+    }
+}
+
 rlimit getrlimit_nofile()
 {
     rlimit file_limit;
@@ -113,4 +184,35 @@ void setrlimit_memlock(rlimit memory_limit)
     }
 }
 
+cpu_set_t sched_getaffinity()
+{
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    if (::sched_getaffinity(0, sizeof(cpus), &cpus) != 0)
+    {
+        std::perror("sched_getaffinity");
+        throw Error("sched_getaffinity", errno);
+    }
+    return cpus;
+}
+
+void sched_setaffinity(const cpu_set_t& cpus)
+{
+    if (::sched_setaffinity(0, sizeof(cpus), &cpus) != 0)
+    {
+        std::perror("sched_setaffinity");
+        throw Error("sched_setaffinity", errno);
+    }
+}
+
+void set_mempolicy_local()
+{
+    // glibc has no wrapper, libnuma is not worth a dependency for one call
+    if (::syscall(SYS_set_mempolicy, MPOL_LOCAL, nullptr, 0) != 0)
+    {
+        std::perror("set_mempolicy");
+        throw Error("set_mempolicy", errno);
+    }
+}
+
 }  // namespace hw2::syscall_wrapper
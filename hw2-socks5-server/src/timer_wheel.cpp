@@ -0,0 +1,38 @@
+#include <timer_wheel.hpp>
+
+namespace hw2
+{
+
+TimerWheel::TimerWheel()
+{
+    for (Entry& head : m_slots)
+    {
+        head.prev = &head;
+        head.next = &head;
+    }
+}
+
+void TimerWheel::schedule(Entry& entry, std::uint32_t deadline)
+{
+    this->cancel(entry);
+    Entry& head = m_slots[deadline % SLOTS_COUNT];
+    entry.deadline = deadline;
+    entry.prev = head.prev;
+    entry.next = &head;
+    head.prev->next = &entry;
+    head.prev = &entry;
+}
+
+void TimerWheel::cancel(Entry& entry)
+{
+    if (!entry.is_scheduled())
+    {
+        return;
+    }
+    entry.prev->next = entry.next;
+    entry.next->prev = entry.prev;
+    entry.prev = nullptr;
+    entry.next = nullptr;
+}
+
+}  // namespace hw2
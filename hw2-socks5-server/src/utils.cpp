@@ -6,7 +6,7 @@
 namespace hw2
 {
 
-std::shared_ptr<spdlog::logger> logger()
+const std::shared_ptr<spdlog::logger>& logger()
 {
     class Singleton
     {
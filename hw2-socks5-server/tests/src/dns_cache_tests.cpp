@@ -0,0 +1,130 @@
+#include <dns_cache.hpp>
+
+#include <catch2/catch.hpp>
+
+#include <arpa/inet.h>
+
+#include <chrono>
+#include <cstdint>
+
+using hw2::DnsAnswer;
+using hw2::DnsCache;
+
+namespace
+{
+
+DnsAnswer success_answer(std::uint32_t ttl, std::uint32_t address)
+{
+    DnsAnswer answer;
+    answer.status = DnsAnswer::Status::SUCCESS;
+    answer.ttl = ttl;
+    answer.ipv4_count = 1;
+    answer.ipv4_addresses[0].s_addr = ::htonl(address);
+    return answer;
+}
+
+DnsAnswer status_answer(DnsAnswer::Status status)
+{
+    DnsAnswer answer;
+    answer.status = status;
+    return answer;
+}
+
+}  // namespace
+
+TEST_CASE("DnsCache serves an answer until its TTL elapses", "[dns_cache]")
+{
+    DnsCache cache(4);
+    DnsCache::clock_type::time_point now;
+    cache.insert("example.com", success_answer(60, 0x7F000001), now);
+
+    const DnsAnswer* answer = cache.find("example.com", now + std::chrono::seconds(59));
+    REQUIRE(answer != nullptr);
+    REQUIRE(answer->ipv4_count == 1);
+    REQUIRE(answer->ipv4_addresses[0].s_addr == ::htonl(0x7F000001));
+    REQUIRE(cache.find("example.com", now + std::chrono::seconds(60)) == nullptr);
+    REQUIRE(cache.find("example.org", now) == nullptr);
+    REQUIRE(cache.hits() == 1);
+    REQUIRE(cache.misses() == 2);
+}
+
+TEST_CASE("DnsCache bounds TTLs and caches only definite answers", "[dns_cache]")
+{
+    DnsCache cache(4);
+    DnsCache::clock_type::time_point now;
+
+    SECTION("long TTLs are cut to MAX_TTL")
+    {
+        cache.insert("example.com", success_answer(86400, 0x7F000001), now);
+        REQUIRE(cache.find("example.com", now + DnsCache::MAX_TTL - std::chrono::seconds(1)) != nullptr);
+        REQUIRE(cache.find("example.com", now + DnsCache::MAX_TTL) == nullptr);
+    }
+
+    SECTION("NAME_ERROR lives for NEGATIVE_TTL")
+    {
+        cache.insert("missing.example", status_answer(DnsAnswer::Status::NAME_ERROR), now);
+        const DnsAnswer* answer = cache.find("missing.example", now + DnsCache::NEGATIVE_TTL - std::chrono::seconds(1));
+        REQUIRE(answer != nullptr);
+        REQUIRE(answer->status == DnsAnswer::Status::NAME_ERROR);
+        REQUIRE(cache.find("missing.example", now + DnsCache::NEGATIVE_TTL) == nullptr);
+    }
+
+    SECTION("failures and zero TTLs are not cached")
+    {
+        cache.insert("failing.example", status_answer(DnsAnswer::Status::FAILURE), now);
+        cache.insert("example.com", success_answer(0, 0x7F000001), now);
+        REQUIRE(cache.size() == 0);
+    }
+}
+
+TEST_CASE("DnsCache replaces the answer of a name in place", "[dns_cache]")
+{
+    DnsCache cache(2);
+    DnsCache::clock_type::time_point now;
+    cache.insert("example.com", success_answer(60, 0x7F000001), now);
+    cache.insert("example.com", success_answer(60, 0x7F000002), now);
+    REQUIRE(cache.size() == 1);
+    const DnsAnswer* answer = cache.find("example.com", now);
+    REQUIRE(answer != nullptr);
+    REQUIRE(answer->ipv4_addresses[0].s_addr == ::htonl(0x7F000002));
+}
+
+TEST_CASE("DnsCache evicts with CLOCK, giving referenced entries a second chance", "[dns_cache]")
+{
+    DnsCache cache(3);
+    DnsCache::clock_type::time_point now;
+    cache.insert("a.example", success_answer(60, 1), now);
+    cache.insert("b.example", success_answer(60, 2), now);
+    cache.insert("c.example", success_answer(60, 3), now);
+
+    // a and c are referenced, so the hand passes them and takes b
+    REQUIRE(cache.find("a.example", now) != nullptr);
+    REQUIRE(cache.find("c.example", now) != nullptr);
+    cache.insert("d.example", success_answer(60, 4), now);
+    REQUIRE(cache.size() == 3);
+    REQUIRE(cache.find("b.example", now) == nullptr);
+    REQUIRE(cache.find("d.example", now) != nullptr);
+
+    // the hand stands at c, still referenced, so it passes c and takes a, whose reference it
+    // cleared on the previous round
+    cache.insert("e.example", success_answer(60, 5), now);
+    REQUIRE(cache.find("a.example", now) == nullptr);
+    REQUIRE(cache.find("c.example", now) != nullptr);
+    REQUIRE(cache.find("d.example", now) != nullptr);
+    REQUIRE(cache.find("e.example", now) != nullptr);
+}
+
+TEST_CASE("DnsCache evicts expired entries even if they were referenced", "[dns_cache]")
+{
+    DnsCache cache(2);
+    DnsCache::clock_type::time_point now;
+    cache.insert("short.example", success_answer(1, 1), now);
+    cache.insert("long.example", success_answer(60, 2), now);
+    REQUIRE(cache.find("short.example", now) != nullptr);
+    REQUIRE(cache.find("long.example", now) != nullptr);
+
+    DnsCache::clock_type::time_point later = now + std::chrono::seconds(2);
+    cache.insert("new.example", success_answer(60, 3), later);
+    REQUIRE(cache.find("long.example", later) != nullptr);
+    REQUIRE(cache.find("new.example", later) != nullptr);
+}
@@ -0,0 +1,30 @@
+#define CATCH_CONFIG_RUNNER
+#include <catch2/catch.hpp>
+
+#include <iostream>
+#include <string>
+
+std::string g_server_path;
+
+int main(int argc, char** argv) try
+{
+    Catch::Session session;
+
+    Catch::clara::Parser cli = session.cli()
+        | Catch::clara::Opt(g_server_path, "server")["-S"]["--server"]("Path of the server binary, needed by [relay] tests");
+    session.cli(cli);
+
+    int ret_code = session.applyCommandLine(argc, argv);
+    if (ret_code != 0)
+    {
+        std::cerr << "Error while parsing command line options" << std::endl;
+        return ret_code;
+    }
+
+    return session.run();
+}
+catch (const std::exception& e)
+{
+    std::cerr << e.what() << '\n';
+    return 1;
+}
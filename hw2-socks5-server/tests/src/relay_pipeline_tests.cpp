@@ -0,0 +1,75 @@
+#include <relay_pipeline.hpp>
+
+#include <catch2/catch.hpp>
+
+#include <utility>
+
+using hw2::RelayPipeline;
+
+TEST_CASE("RelayPipeline reads ahead while a slice is written", "[relay_pipeline]")
+{
+    RelayPipeline pipeline(4, 1024);
+    REQUIRE(pipeline.can_read());
+    REQUIRE_FALSE(pipeline.can_write());
+
+    REQUIRE(pipeline.start_read() == 0);
+    REQUIRE_FALSE(pipeline.can_read());  // one read at a time
+    pipeline.complete_read(100);
+
+    REQUIRE(pipeline.can_write());
+    REQUIRE(pipeline.start_write() == std::pair{ 100u, 0u });
+    REQUIRE_FALSE(pipeline.can_write());  // one write at a time
+
+    REQUIRE(pipeline.can_read());
+    REQUIRE(pipeline.start_read() == 1024);
+    pipeline.complete_read(1024);
+    pipeline.complete_write(100);
+
+    REQUIRE(pipeline.start_write() == std::pair{ 1024u, 1024u });
+}
+
+TEST_CASE("RelayPipeline stops reading when all slices are filled", "[relay_pipeline]")
+{
+    RelayPipeline pipeline(2, 512);
+    REQUIRE(pipeline.start_read() == 0);
+    pipeline.complete_read(512);
+    REQUIRE(pipeline.start_read() == 512);
+    pipeline.complete_read(512);
+    REQUIRE_FALSE(pipeline.can_read());
+
+    REQUIRE(pipeline.start_write() == std::pair{ 512u, 0u });
+    pipeline.complete_write(512);
+    // the freed first slice is read into again
+    REQUIRE(pipeline.can_read());
+    REQUIRE(pipeline.start_read() == 0);
+}
+
+TEST_CASE("RelayPipeline writes the rest of a slice after a partial write", "[relay_pipeline]")
+{
+    RelayPipeline pipeline(2, 512);
+    REQUIRE(pipeline.start_read() == 0);
+    pipeline.complete_read(300);
+
+    REQUIRE(pipeline.start_write() == std::pair{ 300u, 0u });
+    pipeline.complete_write(120);
+    REQUIRE(pipeline.start_write() == std::pair{ 180u, 120u });
+    pipeline.complete_write(180);
+    REQUIRE_FALSE(pipeline.can_write());
+}
+
+TEST_CASE("RelayPipeline drains the slices read before EOF", "[relay_pipeline]")
+{
+    RelayPipeline pipeline(4, 256);
+    REQUIRE(pipeline.start_read() == 0);
+    pipeline.complete_read(256);
+    REQUIRE(pipeline.start_read() == 256);
+    // the pending read returned 0
+    pipeline.set_eof();
+    REQUIRE_FALSE(pipeline.can_read());
+    REQUIRE_FALSE(pipeline.is_drained());
+
+    REQUIRE(pipeline.start_write() == std::pair{ 256u, 0u });
+    REQUIRE_FALSE(pipeline.is_drained());  // the write is in flight
+    pipeline.complete_write(256);
+    REQUIRE(pipeline.is_drained());
+}
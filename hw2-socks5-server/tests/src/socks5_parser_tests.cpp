@@ -0,0 +1,138 @@
+#include <socks5_parser.hpp>
+
+#include <catch2/catch.hpp>
+
+#include <arpa/inet.h>
+
+#include <cstring>
+#include <span>
+#include <vector>
+
+using hw2::byte_t;
+using hw2::Socks5Parser;
+
+TEST_CASE("Socks5Parser parses a greeting and a CONNECT to an IPv4 address", "[socks5_parser]")
+{
+    Socks5Parser parser;
+    std::vector<byte_t> greeting = { 0x05, 0x02, 0x02, 0x00 };
+    REQUIRE(parser.parse(greeting) == Socks5Parser::Result::GREETING);
+    REQUIRE(parser.consumed() == greeting.size());
+    REQUIRE(parser.no_auth_offered());
+
+    std::vector<byte_t> request = { 0x05, 0x01, 0x00, 0x01, 127, 0, 0, 1, 0x1F, 0x90 };
+    REQUIRE(parser.parse(request) == Socks5Parser::Result::REQUEST);
+    REQUIRE(parser.consumed() == request.size());
+    REQUIRE(parser.address_type() == Socks5Parser::AddressType::IPV4);
+    REQUIRE(parser.ipv4_address().s_addr == ::htonl(INADDR_LOOPBACK));
+    REQUIRE(parser.port() == ::htons(8080));
+}
+
+TEST_CASE("Socks5Parser parses domain name and IPv6 requests", "[socks5_parser]")
+{
+    Socks5Parser parser;
+    std::vector<byte_t> greeting = { 0x05, 0x01, 0x00 };
+    REQUIRE(parser.parse(greeting) == Socks5Parser::Result::GREETING);
+
+    SECTION("domain name")
+    {
+        std::vector<byte_t> request = { 0x05, 0x01, 0x00, 0x03, 11, 'e', 'x', 'a', 'm', 'p', 'l', 'e', '.',
+                                        'c', 'o', 'm', 0x00, 0x50 };
+        REQUIRE(parser.parse(request) == Socks5Parser::Result::REQUEST);
+        REQUIRE(parser.consumed() == request.size());
+        REQUIRE(parser.address_type() == Socks5Parser::AddressType::DOMAIN_NAME);
+        REQUIRE(parser.domain_name() == "example.com");
+        REQUIRE(parser.port() == ::htons(80));
+    }
+
+    SECTION("IPv6")
+    {
+        std::vector<byte_t> request = { 0x05, 0x01, 0x00, 0x04 };
+        request.insert(request.end(), reinterpret_cast<const byte_t*>(&in6addr_loopback),
+                       reinterpret_cast<const byte_t*>(&in6addr_loopback) + sizeof(in6_addr));
+        request.insert(request.end(), { 0x01, 0xBB });
+        REQUIRE(parser.parse(request) == Socks5Parser::Result::REQUEST);
+        REQUIRE(parser.consumed() == request.size());
+        REQUIRE(parser.address_type() == Socks5Parser::AddressType::IPV6);
+        REQUIRE(std::memcmp(&parser.ipv6_address(), &in6addr_loopback, sizeof(in6_addr)) == 0);
+        REQUIRE(parser.port() == ::htons(443));
+    }
+}
+
+TEST_CASE("Socks5Parser waits for every byte of a message", "[socks5_parser]")
+{
+    std::vector<byte_t> greeting = { 0x05, 0x02, 0x02, 0x00 };
+    std::vector<byte_t> request = { 0x05, 0x01, 0x00, 0x03, 4, 'h', 'o', 's', 't', 0x00, 0x50 };
+
+    Socks5Parser parser;
+    std::span<const byte_t> data(greeting);
+    for (std::size_t size = 0; size < greeting.size(); ++size)
+        REQUIRE(parser.parse(data.first(size)) == Socks5Parser::Result::INCOMPLETE);
+    REQUIRE(parser.parse(data) == Socks5Parser::Result::GREETING);
+
+    data = request;
+    for (std::size_t size = 0; size < request.size(); ++size)
+        REQUIRE(parser.parse(data.first(size)) == Socks5Parser::Result::INCOMPLETE);
+    REQUIRE(parser.parse(data) == Socks5Parser::Result::REQUEST);
+    REQUIRE(parser.domain_name() == "host");
+}
+
+TEST_CASE("Socks5Parser consumes only its message of pipelined data", "[socks5_parser]")
+{
+    // greeting, request and payload sent together by the client
+    std::vector<byte_t> data = { 0x05, 0x01, 0x00,
+                                 0x05, 0x01, 0x00, 0x01, 10, 0, 0, 1, 0x00, 0x16,
+                                 'p', 'a', 'y', 'l', 'o', 'a', 'd' };
+    Socks5Parser parser;
+    std::span<const byte_t> rest(data);
+    REQUIRE(parser.parse(rest) == Socks5Parser::Result::GREETING);
+    rest = rest.subspan(parser.consumed());
+    REQUIRE(parser.parse(rest) == Socks5Parser::Result::REQUEST);
+    rest = rest.subspan(parser.consumed());
+    REQUIRE(rest.size() == 7);
+    REQUIRE(rest[0] == 'p');
+}
+
+TEST_CASE("Socks5Parser rejects invalid greetings", "[socks5_parser]")
+{
+    Socks5Parser parser;
+
+    SECTION("wrong version, even before the rest arrives")
+    {
+        std::vector<byte_t> greeting = { 0x04 };
+        REQUIRE(parser.parse(greeting) == Socks5Parser::Result::INVALID_GREETING);
+    }
+
+    SECTION("no methods")
+    {
+        std::vector<byte_t> greeting = { 0x05, 0x00 };
+        REQUIRE(parser.parse(greeting) == Socks5Parser::Result::INVALID_GREETING);
+    }
+
+    SECTION("no authentication not offered")
+    {
+        std::vector<byte_t> greeting = { 0x05, 0x01, 0x02 };
+        REQUIRE(parser.parse(greeting) == Socks5Parser::Result::GREETING);
+        REQUIRE_FALSE(parser.no_auth_offered());
+    }
+}
+
+TEST_CASE("Socks5Parser rejects requests it cannot serve with a reply code", "[socks5_parser]")
+{
+    Socks5Parser parser;
+    std::vector<byte_t> greeting = { 0x05, 0x01, 0x00 };
+    REQUIRE(parser.parse(greeting) == Socks5Parser::Result::GREETING);
+
+    SECTION("BIND command")
+    {
+        std::vector<byte_t> request = { 0x05, 0x02, 0x00, 0x01, 127, 0, 0, 1, 0x00, 0x50 };
+        REQUIRE(parser.parse(request) == Socks5Parser::Result::INVALID_REQUEST);
+        REQUIRE(parser.reply_code() == Socks5Parser::REPLY_COMMAND_NOT_SUPPORTED);
+    }
+
+    SECTION("unknown address type")
+    {
+        std::vector<byte_t> request = { 0x05, 0x01, 0x00, 0x02, 127, 0, 0, 1, 0x00, 0x50 };
+        REQUIRE(parser.parse(request) == Socks5Parser::Result::INVALID_REQUEST);
+        REQUIRE(parser.reply_code() == Socks5Parser::REPLY_ADDRESS_TYPE_NOT_SUPPORTED);
+    }
+}
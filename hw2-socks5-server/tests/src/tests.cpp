@@ -0,0 +1,318 @@
+#include <catch2/catch.hpp>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern std::string g_server_path;
+
+namespace
+{
+
+class FileDescriptor
+{
+public:
+    explicit FileDescriptor(int fd)
+        : m_fd(fd)
+    {
+    }
+
+    ~FileDescriptor()
+    {
+        if (m_fd != -1)
+            ::close(m_fd);
+    }
+
+    FileDescriptor(const FileDescriptor&) = delete;
+    FileDescriptor& operator=(const FileDescriptor&) = delete;
+
+    [[nodiscard]] int get() const { return m_fd; }
+
+private:
+    int m_fd;
+};
+
+sockaddr_in loopback_address(in_port_t port)
+{
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = ::htonl(INADDR_LOOPBACK);
+    address.sin_port = ::htons(port);
+    return address;
+}
+
+// a socket which fails instead of hanging the test if the server gets stuck
+int socket_with_timeout()
+{
+    int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    REQUIRE(fd != -1);
+    timeval timeout = { .tv_sec = 5, .tv_usec = 0 };
+    ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    return fd;
+}
+
+// listens on an ephemeral loopback port, stored in address
+int listen_loopback(sockaddr_in& address)
+{
+    int fd = socket_with_timeout();
+    address = loopback_address(0);
+    socklen_t address_length = sizeof(address);
+    REQUIRE(::bind(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == 0);
+    REQUIRE(::listen(fd, 16) == 0);
+    REQUIRE(::getsockname(fd, reinterpret_cast<sockaddr*>(&address), &address_length) == 0);
+    return fd;
+}
+
+bool send_all(int fd, const unsigned char* data, std::size_t size)
+{
+    while (size != 0)
+    {
+        ssize_t nsent = ::send(fd, data, size, MSG_NOSIGNAL);
+        if (nsent <= 0)
+            return false;
+        data += nsent;
+        size -= static_cast<std::size_t>(nsent);
+    }
+    return true;
+}
+
+bool recv_all(int fd, unsigned char* data, std::size_t size)
+{
+    return ::recv(fd, data, size, MSG_WAITALL) == static_cast<ssize_t>(size);
+}
+
+std::vector<unsigned char> recv_until_eof(int fd)
+{
+    std::vector<unsigned char> received;
+    unsigned char block[1 << 14];
+    for (;;)
+    {
+        ssize_t nread = ::recv(fd, block, sizeof(block), 0);
+        if (nread <= 0)
+            break;
+        received.insert(received.end(), block, block + nread);
+    }
+    return received;
+}
+
+// a port the kernel considers free right now, the server binds it shortly after
+in_port_t free_port()
+{
+    sockaddr_in address = {};
+    FileDescriptor probe(listen_loopback(address));
+    return ::ntohs(address.sin_port);
+}
+
+// the server binary listening on free loopback ports, killed when the test ends
+class ServerProcess
+{
+public:
+    explicit ServerProcess(std::vector<std::string> options)
+        : m_port(free_port())
+        , m_metrics_port(free_port())
+    {
+        if (g_server_path.empty())
+            FAIL("The path of the server binary is not given with --server");
+        std::vector<std::string> arguments = { g_server_path, "-t", "1", "-p", std::to_string(m_port),
+                                               "-m", std::to_string(m_metrics_port) };
+        arguments.insert(arguments.end(), options.begin(), options.end());
+        std::vector<char*> argv;
+        for (std::string& argument : arguments)
+            argv.push_back(argument.data());
+        argv.push_back(nullptr);
+
+        m_pid = ::fork();
+        REQUIRE(m_pid != -1);
+        if (m_pid == 0)
+        {
+            ::execv(g_server_path.c_str(), argv.data());
+            std::_Exit(EXIT_FAILURE);
+        }
+        if (!this->wait_until_listening())
+        {
+            this->stop();
+            FAIL("The server did not start listening");
+        }
+    }
+
+    ~ServerProcess()
+    {
+        this->stop();
+    }
+
+    ServerProcess(const ServerProcess&) = delete;
+    ServerProcess& operator=(const ServerProcess&) = delete;
+
+    [[nodiscard]] in_port_t port() const { return m_port; }
+
+    // the socks5_sessions_active gauge of the metrics endpoint, -1 if it cannot be read
+    [[nodiscard]] long active_sessions() const
+    {
+        FileDescriptor fd(socket_with_timeout());
+        sockaddr_in address = loopback_address(m_metrics_port);
+        if (::connect(fd.get(), reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0)
+            return -1;
+        const std::string request = "GET /metrics HTTP/1.1\r\nHost: localhost\r\n\r\n";
+        if (!send_all(fd.get(), reinterpret_cast<const unsigned char*>(request.data()), request.size()))
+            return -1;
+        std::vector<unsigned char> response = recv_until_eof(fd.get());
+        std::string text(response.begin(), response.end());
+        const std::string name = "\nsocks5_sessions_active ";
+        std::size_t position = text.find(name);
+        if (position == std::string::npos)
+            return -1;
+        return std::strtol(text.c_str() + position + name.size(), nullptr, 10);
+    }
+
+    // waits for the gauge to drop to zero, returns whether it did within a few seconds
+    [[nodiscard]] bool wait_until_idle() const
+    {
+        for (unsigned attempt = 0; attempt < 100; ++attempt)
+        {
+            if (this->active_sessions() == 0)
+                return true;
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        }
+        return false;
+    }
+
+private:
+    void stop() const
+    {
+        ::kill(m_pid, SIGTERM);
+        ::waitpid(m_pid, nullptr, 0);
+    }
+
+    bool wait_until_listening() const
+    {
+        sockaddr_in address = loopback_address(m_port);
+        for (unsigned attempt = 0; attempt < 100; ++attempt)
+        {
+            if (::waitpid(m_pid, nullptr, WNOHANG) == m_pid)
+                return false;
+            FileDescriptor fd(::socket(AF_INET, SOCK_STREAM, 0));
+            if (::connect(fd.get(), reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == 0)
+                return true;
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        }
+        return false;
+    }
+
+    in_port_t m_port;
+    in_port_t m_metrics_port;
+    pid_t m_pid = -1;
+};
+
+// the greeting and a CONNECT request to an IPv4 destination
+std::vector<unsigned char> connect_message(const sockaddr_in& destination_address)
+{
+    std::vector<unsigned char> message = { 0x05, 0x01, 0x00,  // greeting, no authentication
+                                           0x05, 0x01, 0x00, 0x01 };  // CONNECT to IPv4 address
+    message.insert(message.end(), reinterpret_cast<const unsigned char*>(&destination_address.sin_addr),
+                   reinterpret_cast<const unsigned char*>(&destination_address.sin_addr) + 4);
+    message.insert(message.end(), reinterpret_cast<const unsigned char*>(&destination_address.sin_port),
+                   reinterpret_cast<const unsigned char*>(&destination_address.sin_port) + 2);
+    return message;
+}
+
+// a client connected through the proxy to the destination, with the replies checked
+int connect_through(const ServerProcess& server, const std::vector<unsigned char>& message)
+{
+    int client = socket_with_timeout();
+    sockaddr_in proxy_address = loopback_address(server.port());
+    REQUIRE(::connect(client, reinterpret_cast<const sockaddr*>(&proxy_address), sizeof(proxy_address)) == 0);
+    REQUIRE(send_all(client, message.data(), message.size()));
+
+    unsigned char replies[2 + 10];
+    REQUIRE(recv_all(client, replies, sizeof(replies)));
+    REQUIRE(replies[1] == 0x00);  // no authentication accepted
+    REQUIRE(replies[3] == 0x00);  // succeeded
+    return client;
+}
+
+std::vector<unsigned char> make_payload(std::size_t size)
+{
+    // a period coprime to the buffer sizes, so that bytes moved within the stream are noticed
+    std::vector<unsigned char> payload(size);
+    for (std::size_t i = 0; i < size; ++i)
+        payload[i] = static_cast<unsigned char>(i % 251);
+    return payload;
+}
+
+}  // namespace
+
+TEST_CASE("Payload sent right after CONNECT reaches the destination intact", "[relay]")
+{
+    std::string relay_mode = GENERATE(as<std::string>{}, "copy", "splice", "pipelined");
+    CAPTURE(relay_mode);
+    ServerProcess server({ "-r", relay_mode });
+
+    sockaddr_in destination_address = {};
+    FileDescriptor destination_listener(listen_loopback(destination_address));
+
+    // more than a buffer slice of the pipelined relay and more than a page a pipe may be limited
+    // to, sent together with the handshake, so that the server reads the payload with the request
+    std::vector<unsigned char> payload = make_payload(40 * 1024);
+    std::vector<unsigned char> message = connect_message(destination_address);
+    message.insert(message.end(), payload.begin(), payload.end());
+
+    FileDescriptor client(connect_through(server, message));
+    ::shutdown(client.get(), SHUT_WR);
+
+    FileDescriptor destination(::accept(destination_listener.get(), nullptr, nullptr));
+    REQUIRE(destination.get() != -1);
+    std::vector<unsigned char> received = recv_until_eof(destination.get());
+    REQUIRE(received.size() == payload.size());
+    REQUIRE(received == payload);
+}
+
+TEST_CASE("A splice session stalled on a silent destination releases its sockets", "[relay]")
+{
+    bool fixed_files = GENERATE(false, true);
+    bool idle_timeout = GENERATE(false, true);
+    CAPTURE(fixed_files, idle_timeout);
+    std::vector<std::string> options = { "-r", "splice", "-I", "1" };
+    if (fixed_files)
+        options.push_back("-f");
+    ServerProcess server(options);
+
+    sockaddr_in destination_address = {};
+    FileDescriptor destination_listener(listen_loopback(destination_address));
+    FileDescriptor client(connect_through(server, connect_message(destination_address)));
+    // the destination never sends anything, so the downstream splice waits in its poll
+    FileDescriptor destination(::accept(destination_listener.get(), nullptr, nullptr));
+    REQUIRE(destination.get() != -1);
+    timeval timeout = { .tv_sec = 5, .tv_usec = 0 };
+    ::setsockopt(destination.get(), SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    REQUIRE(server.active_sessions() == 1);
+
+    if (idle_timeout)
+    {
+        // the session is aborted once it stays idle for a second
+        unsigned char byte;
+        REQUIRE(::recv(client.get(), &byte, 1, 0) == 0);
+    }
+    else
+    {
+        // the session fails on the client EOF, with the destination poll still in flight
+        ::shutdown(client.get(), SHUT_WR);
+    }
+
+    // the destination socket is closed for real, not just its slot or fd
+    unsigned char byte;
+    REQUIRE(::recv(destination.get(), &byte, 1, 0) == 0);
+    REQUIRE(server.wait_until_idle());
+}
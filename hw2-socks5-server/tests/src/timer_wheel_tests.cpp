@@ -0,0 +1,93 @@
+#include <timer_wheel.hpp>
+
+#include <catch2/catch.hpp>
+
+#include <cstdint>
+#include <vector>
+
+using hw2::TimerWheel;
+
+namespace
+{
+
+// entries the wheel reports at tick
+std::vector<TimerWheel::Entry*> expire(TimerWheel& wheel, std::uint32_t tick)
+{
+    std::vector<TimerWheel::Entry*> expired;
+    wheel.expire(tick, [&expired](TimerWheel::Entry& entry) { expired.push_back(&entry); });
+    return expired;
+}
+
+}  // namespace
+
+TEST_CASE("TimerWheel expires an entry at its deadline only", "[timer_wheel]")
+{
+    TimerWheel wheel;
+    TimerWheel::Entry entry;
+    wheel.schedule(entry, 10);
+    REQUIRE(entry.is_scheduled());
+
+    for (std::uint32_t tick = 0; tick < 10; ++tick)
+        REQUIRE(expire(wheel, tick).empty());
+    REQUIRE(expire(wheel, 10) == std::vector<TimerWheel::Entry*>{ &entry });
+    REQUIRE_FALSE(entry.is_scheduled());
+    REQUIRE(expire(wheel, 10).empty());
+}
+
+TEST_CASE("TimerWheel skips deadlines of later rounds of the same slot", "[timer_wheel]")
+{
+    TimerWheel wheel;
+    TimerWheel::Entry near_entry;
+    TimerWheel::Entry far_entry;
+    wheel.schedule(near_entry, 3);
+    wheel.schedule(far_entry, 3 + TimerWheel::SLOTS_COUNT);
+
+    REQUIRE(expire(wheel, 3) == std::vector<TimerWheel::Entry*>{ &near_entry });
+    REQUIRE(far_entry.is_scheduled());
+    REQUIRE(expire(wheel, 3 + TimerWheel::SLOTS_COUNT) == std::vector<TimerWheel::Entry*>{ &far_entry });
+}
+
+TEST_CASE("TimerWheel cancels and moves entries", "[timer_wheel]")
+{
+    TimerWheel wheel;
+    TimerWheel::Entry first;
+    TimerWheel::Entry second;
+    wheel.schedule(first, 5);
+    wheel.schedule(second, 5);
+
+    SECTION("cancelled entries do not expire, cancelling twice is harmless")
+    {
+        wheel.cancel(first);
+        wheel.cancel(first);
+        REQUIRE_FALSE(first.is_scheduled());
+        REQUIRE(expire(wheel, 5) == std::vector<TimerWheel::Entry*>{ &second });
+    }
+
+    SECTION("rescheduling moves an entry to its new slot")
+    {
+        wheel.schedule(first, 7);
+        REQUIRE(expire(wheel, 5) == std::vector<TimerWheel::Entry*>{ &second });
+        REQUIRE(expire(wheel, 7) == std::vector<TimerWheel::Entry*>{ &first });
+    }
+}
+
+TEST_CASE("TimerWheel lets an expired entry be scheduled again from its handler", "[timer_wheel]")
+{
+    TimerWheel wheel;
+    TimerWheel::Entry entry;
+    wheel.schedule(entry, 1);
+
+    unsigned expirations = 0;
+    auto reschedule = [&wheel, &expirations](TimerWheel::Entry& expired)
+    {
+        ++expirations;
+        // a deadline of the same slot, which the ongoing expire must not report again
+        wheel.schedule(expired, expired.deadline + TimerWheel::SLOTS_COUNT);
+    };
+    wheel.expire(1, reschedule);
+    REQUIRE(expirations == 1);
+    REQUIRE(entry.is_scheduled());
+    REQUIRE(entry.deadline == 1 + TimerWheel::SLOTS_COUNT);
+    wheel.expire(1 + TimerWheel::SLOTS_COUNT, reschedule);
+    REQUIRE(expirations == 2);
+}
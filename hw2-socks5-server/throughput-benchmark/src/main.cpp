@@ -0,0 +1,651 @@
+// Measures relay throughput of the SOCKS5 server, iperf style.
+//
+// The benchmark listens on a loopback port and connects to itself through the server
+// with the given count of parallel streams. Data flows from the client to the peer, or
+// the other way round with --download, and is counted on the receiving side. Loopback
+// has almost no latency, so to see the effect of a high bandwidth-delay product emulate
+// one, e.g. with `tc qdisc add dev lo root netem delay 5ms`, and compare the server in
+// copy and pipelined relay modes.
+//
+// With --server_pid the CPU time and cycles the server spends per GiB received are reported
+// as well, e.g. to compare --zero_copy_threshold against plain copies with --download. Cycles
+// of all server threads are counted in user and kernel mode, which needs perf_event_paranoid
+// of at most 1 or CAP_PERFMON; otherwise only the CPU time is reported. Note that loopback
+// falls back to copying for zero-copy sends, so only a real NIC shows their gain.
+//
+// With --server the benchmark starts the server binary itself, once per --relay_mode, runs the
+// same load against each and prints a table of throughput and CPU cost per GiB; by default it
+// compares copying through user space buffers against splicing through pipes.
+
+#include <tclap/CmdLine.h>
+
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <linux/perf_event.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace
+{
+
+using clock_type = std::chrono::steady_clock;
+
+struct Shared
+{
+    std::atomic<bool> stop = false;
+    std::atomic<std::uint64_t> received_bytes = 0;
+    std::atomic<unsigned> failed_streams = 0;
+};
+
+bool send_all(int fd, const unsigned char* data, std::size_t size)
+{
+    while (size != 0)
+    {
+        ssize_t nsent = ::send(fd, data, size, MSG_NOSIGNAL);
+        if (nsent <= 0)
+        {
+            return false;
+        }
+        data += nsent;
+        size -= static_cast<std::size_t>(nsent);
+    }
+    return true;
+}
+
+bool recv_all(int fd, unsigned char* data, std::size_t size)
+{
+    return ::recv(fd, data, size, MSG_WAITALL) == static_cast<ssize_t>(size);
+}
+
+// connects to target through the SOCKS5 server, returns -1 on failure
+int connect_through_proxy(const sockaddr_in& proxy, const sockaddr_in& target)
+{
+    int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    int one = 1;
+    ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (::connect(fd, reinterpret_cast<const sockaddr*>(&proxy), sizeof(proxy)) != 0)
+    {
+        ::close(fd);
+        return -1;
+    }
+
+    const unsigned char greeting[] = { 0x05, 0x01, 0x00 };  // version 5, one method: no auth
+    unsigned char request[10] = { 0x05, 0x01, 0x00, 0x01 };  // CONNECT to IPv4 address
+    std::memcpy(request + 4, &target.sin_addr, 4);
+    std::memcpy(request + 8, &target.sin_port, 2);
+    unsigned char method_reply[2];
+    unsigned char connect_reply[10];
+    bool ok = send_all(fd, greeting, sizeof(greeting))
+        && recv_all(fd, method_reply, sizeof(method_reply)) && method_reply[1] == 0x00
+        && send_all(fd, request, sizeof(request))
+        && recv_all(fd, connect_reply, sizeof(connect_reply)) && connect_reply[1] == 0x00;
+    if (!ok)
+    {
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void send_until_stopped(int fd, std::size_t block_size, const Shared& shared)
+{
+    std::vector<unsigned char> block(block_size, 0x5A);
+    while (!shared.stop.load(std::memory_order_relaxed) && send_all(fd, block.data(), block.size()))
+    {
+    }
+    ::shutdown(fd, SHUT_WR);
+}
+
+void receive_until_eof(int fd, std::size_t block_size, Shared& shared)
+{
+    std::vector<unsigned char> block(block_size);
+    for (;;)
+    {
+        ssize_t nread = ::recv(fd, block.data(), block.size(), 0);
+        if (nread <= 0)
+        {
+            break;
+        }
+        shared.received_bytes.fetch_add(static_cast<std::uint64_t>(nread), std::memory_order_relaxed);
+    }
+}
+
+double gbits_per_second(std::uint64_t bytes, std::chrono::duration<double> elapsed)
+{
+    return static_cast<double>(bytes) * 8.0 / elapsed.count() / 1e9;
+}
+
+// user plus system CPU time of all threads of a process, nullopt if it is gone
+std::optional<double> process_cpu_seconds(pid_t pid)
+{
+    std::ifstream file("/proc/" + std::to_string(pid) + "/stat");
+    std::string stat((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    // the command name in parentheses may contain spaces, utime and stime are fields 14 and 15
+    std::size_t name_end = stat.rfind(')');
+    if (name_end == std::string::npos)
+    {
+        return std::nullopt;
+    }
+    std::istringstream fields(stat.substr(name_end + 2));
+    std::string field;
+    for (unsigned i = 3; i < 14; ++i)
+    {
+        fields >> field;
+    }
+    unsigned long long utime = 0;
+    unsigned long long stime = 0;
+    if (!(fields >> utime >> stime))
+    {
+        return std::nullopt;
+    }
+    return static_cast<double>(utime + stime) / static_cast<double>(::sysconf(_SC_CLK_TCK));
+}
+
+// CPU cycles of the threads a process has when the counter is created, user and kernel mode
+class CyclesCounter
+{
+public:
+    explicit CyclesCounter(pid_t pid)
+    {
+        std::string tasks_path = "/proc/" + std::to_string(pid) + "/task";
+        DIR* tasks = ::opendir(tasks_path.c_str());
+        if (tasks == nullptr)
+        {
+            return;
+        }
+        while (dirent* entry = ::readdir(tasks))
+        {
+            if (entry->d_name[0] == '.')
+            {
+                continue;
+            }
+            perf_event_attr attr = {};
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.size = sizeof(attr);
+            attr.config = PERF_COUNT_HW_CPU_CYCLES;
+            auto fd = static_cast<int>(::syscall(SYS_perf_event_open, &attr, std::atoi(entry->d_name), -1, -1, 0));
+            if (fd == -1)
+            {
+                this->close_all();
+                break;
+            }
+            m_fds.push_back(fd);
+        }
+        ::closedir(tasks);
+    }
+
+    ~CyclesCounter()
+    {
+        this->close_all();
+    }
+
+    CyclesCounter(const CyclesCounter&) = delete;
+    CyclesCounter& operator=(const CyclesCounter&) = delete;
+
+    // nullopt if a thread could not be counted
+    [[nodiscard]] std::optional<std::uint64_t> read() const
+    {
+        if (m_fds.empty())
+        {
+            return std::nullopt;
+        }
+        std::uint64_t total = 0;
+        for (int fd : m_fds)
+        {
+            std::uint64_t count = 0;
+            if (::read(fd, &count, sizeof(count)) != sizeof(count))
+            {
+                return std::nullopt;
+            }
+            total += count;
+        }
+        return total;
+    }
+
+private:
+    void close_all()
+    {
+        for (int fd : m_fds)
+        {
+            ::close(fd);
+        }
+        m_fds.clear();
+    }
+
+    std::vector<int> m_fds;
+};
+
+struct Options
+{
+    unsigned streams_count;
+    unsigned duration_seconds;
+    std::size_t block_size;
+    bool download;
+};
+
+struct Result
+{
+    unsigned failed_streams = 0;
+    std::uint64_t bytes = 0;
+    double gbits_per_second = 0;
+    std::optional<double> cpu_seconds_per_gib;
+    std::optional<double> cycles_per_gib;
+};
+
+// relays through the server at proxy for the duration, reporting throughput every second
+std::optional<Result> run_benchmark(const sockaddr_in& proxy, const Options& options, pid_t server_pid)
+{
+    // the peer listens on an ephemeral loopback port
+    int listen_fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in target = {};
+    target.sin_family = AF_INET;
+    target.sin_addr.s_addr = ::htonl(INADDR_LOOPBACK);
+    socklen_t target_length = sizeof(target);
+    if (listen_fd == -1
+        || ::bind(listen_fd, reinterpret_cast<const sockaddr*>(&target), sizeof(target)) != 0
+        || ::listen(listen_fd, static_cast<int>(options.streams_count)) != 0
+        || ::getsockname(listen_fd, reinterpret_cast<sockaddr*>(&target), &target_length) != 0)
+    {
+        std::perror("Cannot listen on loopback");
+        if (listen_fd != -1)
+        {
+            ::close(listen_fd);
+        }
+        return std::nullopt;
+    }
+
+    Shared shared;
+    std::size_t block_size = options.block_size;
+    bool download = options.download;
+    std::vector<std::thread> threads;
+    std::thread acceptor([&]()
+    {
+        std::vector<std::thread> peers;
+        for (unsigned i = 0; i < options.streams_count; ++i)
+        {
+            int fd = ::accept(listen_fd, nullptr, nullptr);
+            if (fd == -1)
+            {
+                break;
+            }
+            peers.emplace_back([fd, block_size, download, &shared]()
+            {
+                if (download)
+                    send_until_stopped(fd, block_size, shared);
+                else
+                    receive_until_eof(fd, block_size, shared);
+                ::close(fd);
+            });
+        }
+        for (std::thread& peer : peers)
+        {
+            peer.join();
+        }
+    });
+
+    for (unsigned i = 0; i < options.streams_count; ++i)
+    {
+        int fd = connect_through_proxy(proxy, target);
+        if (fd == -1)
+        {
+            std::fprintf(stderr, "Cannot connect through the server\n");
+            ++shared.failed_streams;
+            continue;
+        }
+        threads.emplace_back([fd, block_size, download, &shared]()
+        {
+            if (download)
+                receive_until_eof(fd, block_size, shared);
+            else
+                send_until_stopped(fd, block_size, shared);
+            ::close(fd);
+        });
+    }
+    if (shared.failed_streams != 0)
+    {
+        // unblock the acceptor waiting for streams which never come
+        ::shutdown(listen_fd, SHUT_RDWR);
+    }
+
+    // counted from here on, connection setup excluded
+    std::optional<CyclesCounter> server_cycles;
+    std::optional<double> server_cpu_start;
+    if (server_pid != 0)
+    {
+        server_cycles.emplace(server_pid);
+        server_cpu_start = process_cpu_seconds(server_pid);
+    }
+    clock_type::time_point start = clock_type::now();
+    std::uint64_t previous_bytes = 0;
+    for (unsigned second = 1; second <= options.duration_seconds; ++second)
+    {
+        std::this_thread::sleep_until(start + std::chrono::seconds(second));
+        std::uint64_t bytes = shared.received_bytes.load(std::memory_order_relaxed);
+        std::printf("%3u-%3u s: %8.3f Gbit/s\n", second - 1, second,
+                    gbits_per_second(bytes - previous_bytes, std::chrono::seconds(1)));
+        previous_bytes = bytes;
+    }
+    std::chrono::duration<double> elapsed = clock_type::now() - start;
+    std::uint64_t total_bytes = shared.received_bytes.load(std::memory_order_relaxed);
+    std::optional<std::uint64_t> cycles = server_cycles ? server_cycles->read() : std::nullopt;
+    std::optional<double> server_cpu_end = server_pid != 0 ? process_cpu_seconds(server_pid) : std::nullopt;
+    shared.stop = true;
+
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+    acceptor.join();
+    ::close(listen_fd);
+
+    Result result;
+    result.failed_streams = shared.failed_streams;
+    result.bytes = total_bytes;
+    result.gbits_per_second = gbits_per_second(total_bytes, elapsed);
+    double gibs = static_cast<double>(total_bytes) / static_cast<double>(1ull << 30);
+    if (server_cpu_start && server_cpu_end && gibs > 0)
+    {
+        result.cpu_seconds_per_gib = (*server_cpu_end - *server_cpu_start) / gibs;
+    }
+    if (cycles && gibs > 0)
+    {
+        result.cycles_per_gib = static_cast<double>(*cycles) / gibs;
+    }
+    return result;
+}
+
+void print_result(const Result& result, const Options& options, pid_t server_pid)
+{
+    std::printf("streams:    %u (%u failed)\n", options.streams_count, result.failed_streams);
+    std::printf("direction:  %s\n", options.download ? "destination -> client" : "client -> destination");
+    std::printf("received:   %llu bytes\n", static_cast<unsigned long long>(result.bytes));
+    std::printf("throughput: %.3f Gbit/s\n", result.gbits_per_second);
+    if (result.cpu_seconds_per_gib)
+    {
+        std::printf("server CPU: %.3f s per GiB\n", *result.cpu_seconds_per_gib);
+    }
+    if (result.cycles_per_gib)
+    {
+        std::printf("server cycles: %.4g per GiB\n", *result.cycles_per_gib);
+    }
+    else if (server_pid != 0)
+    {
+        std::printf("server cycles: unavailable, see perf_event_paranoid\n");
+    }
+}
+
+// starts the server binary on the port in the given relay mode, -1 on failure
+pid_t spawn_server(const std::string& path, in_port_t port, const std::string& relay_mode, unsigned threads_count)
+{
+    std::string port_string = std::to_string(port);
+    std::string threads_string = std::to_string(threads_count);
+    pid_t pid = ::fork();
+    if (pid == 0)
+    {
+        ::execl(path.c_str(), path.c_str(), "-p", port_string.c_str(), "-r", relay_mode.c_str(),
+                "-t", threads_string.c_str(), static_cast<char*>(nullptr));
+        std::perror("Cannot start the server");
+        std::_Exit(EXIT_FAILURE);
+    }
+    if (pid == -1)
+    {
+        std::perror("fork");
+    }
+    return pid;
+}
+
+// waits until the server accepts connections, false if it does not within a few seconds
+bool wait_for_server(const sockaddr_in& proxy, pid_t pid)
+{
+    for (unsigned attempt = 0; attempt < 100; ++attempt)
+    {
+        if (::waitpid(pid, nullptr, WNOHANG) == pid)
+        {
+            return false;  // exited, e.g. on a rejected option
+        }
+        int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        bool connected = fd != -1 && ::connect(fd, reinterpret_cast<const sockaddr*>(&proxy), sizeof(proxy)) == 0;
+        if (fd != -1)
+        {
+            ::close(fd);
+        }
+        if (connected)
+        {
+            return true;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    return false;
+}
+
+void stop_server(pid_t pid)
+{
+    ::kill(pid, SIGTERM);
+    ::waitpid(pid, nullptr, 0);
+}
+
+}  // namespace
+
+int main(int argc, char* argv[])
+{
+    std::string proxy_host;
+    in_port_t proxy_port;
+    Options options;
+    pid_t server_pid;
+    std::string server_path;
+    std::vector<std::string> relay_modes;
+    unsigned server_threads;
+    try
+    {
+        TCLAP::CmdLine cmd("Relay throughput benchmark for the SOCKS5 server", ' ', "0.1");
+
+        TCLAP::ValueArg<std::string> proxy_host_arg(
+            /* short flag */    "a",
+            /* long flag */     "address",
+            /* description */   "IPv4 address of the server",
+            /* required */      false,
+            /* default */       "127.0.0.1",
+            /* type info */     "string"
+        );
+        cmd.add(proxy_host_arg);
+
+        TCLAP::ValueArg<in_port_t> proxy_port_arg(
+            /* short flag */    "p",
+            /* long flag */     "port",
+            /* description */   "Port of the server",
+            /* required */      true,
+            /* default */       0,
+            /* type info */     "int"
+        );
+        cmd.add(proxy_port_arg);
+
+        TCLAP::ValueArg<unsigned> streams_count_arg(
+            /* short flag */    "s",
+            /* long flag */     "streams",
+            /* description */   "Count of parallel connections",
+            /* required */      false,
+            /* default */       1,
+            /* type info */     "int"
+        );
+        cmd.add(streams_count_arg);
+
+        TCLAP::ValueArg<unsigned> duration_arg(
+            /* short flag */    "d",
+            /* long flag */     "duration",
+            /* description */   "Benchmark duration in seconds",
+            /* required */      false,
+            /* default */       10,
+            /* type info */     "int"
+        );
+        cmd.add(duration_arg);
+
+        TCLAP::ValueArg<std::size_t> block_size_arg(
+            /* short flag */    "b",
+            /* long flag */     "block_size",
+            /* description */   "Size of a single send and receive call",
+            /* required */      false,
+            /* default */       128 * 1024,
+            /* type info */     "int"
+        );
+        cmd.add(block_size_arg);
+
+        TCLAP::SwitchArg download_arg(
+            /* short flag */    "r",
+            /* long flag */     "download",
+            /* description */   "Send from the destination to the client instead",
+            /* default */       false
+        );
+        cmd.add(download_arg);
+
+        TCLAP::ValueArg<pid_t> server_pid_arg(
+            /* short flag */    "P",
+            /* long flag */     "server_pid",
+            /* description */   "Process id of the server, to report its CPU time and cycles per GiB relayed",
+            /* required */      false,
+            /* default */       0,
+            /* type info */     "int"
+        );
+        cmd.add(server_pid_arg);
+
+        TCLAP::ValueArg<std::string> server_path_arg(
+            /* short flag */    "S",
+            /* long flag */     "server",
+            /* description */   "Path of the server binary, to start it on --port once per --relay_mode "
+                                "and compare the modes",
+            /* required */      false,
+            /* default */       "",
+            /* type info */     "path"
+        );
+        cmd.add(server_path_arg);
+
+        std::vector<std::string> known_relay_modes = { "copy", "splice", "buffer_ring", "pipelined" };
+        TCLAP::ValuesConstraint<std::string> relay_mode_constraint(known_relay_modes);
+        TCLAP::MultiArg<std::string> relay_modes_arg(
+            /* short flag */    "m",
+            /* long flag */     "relay_mode",
+            /* description */   "Relay mode to start the --server in, may be repeated (copy and splice by default)",
+            /* required */      false,
+            /* constraint */    &relay_mode_constraint
+        );
+        cmd.add(relay_modes_arg);
+
+        TCLAP::ValueArg<unsigned> server_threads_arg(
+            /* short flag */    "t",
+            /* long flag */     "server_threads",
+            /* description */   "Event loop threads of the --server",
+            /* required */      false,
+            /* default */       1,
+            /* type info */     "int"
+        );
+        cmd.add(server_threads_arg);
+
+        cmd.parse(argc, argv);
+        proxy_host = proxy_host_arg.getValue();
+        proxy_port = proxy_port_arg.getValue();
+        options.streams_count = std::max(streams_count_arg.getValue(), 1u);
+        options.duration_seconds = duration_arg.getValue();
+        options.block_size = std::max<std::size_t>(block_size_arg.getValue(), 1);
+        options.download = download_arg.getValue();
+        server_pid = server_pid_arg.getValue();
+        server_path = server_path_arg.getValue();
+        relay_modes = relay_modes_arg.getValue();
+        if (relay_modes.empty())
+        {
+            relay_modes = { "copy", "splice" };
+        }
+        server_threads = std::max(server_threads_arg.getValue(), 1u);
+    }
+    catch (TCLAP::ArgException& e)
+    {
+        std::fprintf(stderr, "Parsing command line arguments failed: '%s' for arg %s\n",
+                     e.error().c_str(), e.argId().c_str());
+        return EXIT_FAILURE;
+    }
+
+    sockaddr_in proxy = {};
+    proxy.sin_family = AF_INET;
+    proxy.sin_port = ::htons(proxy_port);
+    if (::inet_pton(AF_INET, proxy_host.c_str(), &proxy.sin_addr) != 1)
+    {
+        std::fprintf(stderr, "Invalid IPv4 address '%s'\n", proxy_host.c_str());
+        return EXIT_FAILURE;
+    }
+
+    if (server_path.empty())
+    {
+        std::optional<Result> result = run_benchmark(proxy, options, server_pid);
+        if (!result)
+        {
+            return EXIT_FAILURE;
+        }
+        print_result(*result, options, server_pid);
+        return result->failed_streams == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    // the same load against a fresh server per relay mode
+    std::vector<std::pair<std::string, Result>> results;
+    for (const std::string& relay_mode : relay_modes)
+    {
+        std::printf("relay mode %s:\n", relay_mode.c_str());
+        pid_t pid = spawn_server(server_path, proxy_port, relay_mode, server_threads);
+        if (pid == -1)
+        {
+            return EXIT_FAILURE;
+        }
+        if (!wait_for_server(proxy, pid))
+        {
+            std::fprintf(stderr, "The server in %s relay mode did not start\n", relay_mode.c_str());
+            stop_server(pid);
+            return EXIT_FAILURE;
+        }
+        std::optional<Result> result = run_benchmark(proxy, options, pid);
+        stop_server(pid);
+        if (!result)
+        {
+            return EXIT_FAILURE;
+        }
+        print_result(*result, options, pid);
+        results.emplace_back(relay_mode, *result);
+    }
+
+    std::printf("\n%-12s %12s %16s %18s\n", "relay mode", "Gbit/s", "CPU s per GiB", "cycles per GiB");
+    bool failed = false;
+    for (const auto& [relay_mode, result] : results)
+    {
+        std::printf("%-12s %12.3f", relay_mode.c_str(), result.gbits_per_second);
+        if (result.cpu_seconds_per_gib)
+            std::printf(" %16.3f", *result.cpu_seconds_per_gib);
+        else
+            std::printf(" %16s", "-");
+        if (result.cycles_per_gib)
+            std::printf(" %18.4g\n", *result.cycles_per_gib);
+        else
+            std::printf(" %18s\n", "-");
+        failed = failed || result.failed_streams != 0;
+    }
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}